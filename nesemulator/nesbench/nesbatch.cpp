@@ -0,0 +1,392 @@
+/*
+* nesbatch
+* ---
+* Runs many independent jobs, each on its own bus, on a work stealing
+* thread pool with one worker per core, and writes one result line per
+* job: final state hash (FNV-1a over bus::save_state), cycles, frames
+* and wall time.
+*
+* nesbatch [options] <job list>
+*	--threads <n>		Workers (default: hardware threads)
+*	--out <file>		Results file (default: stdout)
+*
+* Job list, one job per line, # starts a comment:
+*	<rom> <input|-> [frames=n] [cycles=n] [pc=addr] [trap=1] [start=addr] [load=addr]
+*
+* rom is an iNES file or a raw binary loaded at load (default 0x0000) and
+* started at start (default 0x0400). The input file holds two bytes per
+* frame, the buttons of pad 1 and pad 2, the last pair is held once it
+* runs out. A job stops at the first of its frame budget, cycle budget,
+* reaching pc, or trap (PC stops moving). Without any budget it stops
+* after 600 frames.
+*
+* Workers share nothing mutable: ROM images are parsed up front and only
+* read afterwards, every job gets a fresh bus.
+*/
+#include "bus.h"
+#include "mapper.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct job {
+	std::string rom_path;
+	std::string input_path;
+	uint64_t frame_budget = 0;
+	uint64_t cycle_budget = 0;
+	bool has_exit_pc = false;
+	uint16_t exit_pc = 0;
+	bool stop_on_trap = false;
+	uint16_t load_addr = 0x0000;
+	uint16_t start_pc = 0x0400;
+
+	// Filled in before the workers start, read only afterwards
+	std::shared_ptr<const rom> cartridge;
+	std::shared_ptr<const mapped_file> program;
+	std::vector<uint8_t> input;
+};
+
+struct job_result {
+	bool ok = false;
+	std::string status;
+	uint64_t hash = 0;
+	uint64_t cycles = 0;
+	uint64_t frames = 0;
+	double seconds = 0;
+};
+
+/*
+* Work stealing pool
+* ---
+* Every worker owns a deque of job indices, dealt out round robin. It
+* takes from the back of its own and, once that is empty, steals from
+* the front of the others, so workers that drew long jobs get relieved
+* without a shared queue every worker contends on.
+*/
+class work_pool
+{
+private:
+	struct worker_queue {
+		std::mutex lock;
+		std::deque<size_t> jobs;
+	};
+	std::vector<std::unique_ptr<worker_queue>> queues;
+
+public:
+	work_pool(size_t inWorkers, size_t inJobs)
+	{
+		for (size_t i = 0; i < inWorkers; i++) {
+			queues.emplace_back(new worker_queue());
+		}
+		for (size_t i = 0; i < inJobs; i++) {
+			queues[i % inWorkers]->jobs.push_back(i);
+		}
+	}
+
+	bool next(size_t inWorker, size_t& outJob)
+	{
+		{
+			worker_queue& own = *queues[inWorker];
+			std::lock_guard<std::mutex> lock(own.lock);
+			if (!own.jobs.empty()) {
+				outJob = own.jobs.back();
+				own.jobs.pop_back();
+				return true;
+			}
+		}
+
+		// Jobs are never added once running, so a full pass finding nothing means done
+		for (size_t i = 1; i < queues.size(); i++) {
+			worker_queue& victim = *queues[(inWorker + i) % queues.size()];
+			std::lock_guard<std::mutex> lock(victim.lock);
+			if (!victim.jobs.empty()) {
+				outJob = victim.jobs.front();
+				victim.jobs.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+static uint64_t fnv1a(const std::vector<uint8_t>& inData)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for (uint8_t byte : inData) {
+		hash = (hash ^ byte) * 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+static job_result run_job(const job& inJob)
+{
+	job_result result;
+	auto start = std::chrono::steady_clock::now();
+
+	std::unique_ptr<bus> nBUS(new bus());
+	cpu& cCPU = nBUS->cCPU;
+
+	if (inJob.cartridge) {
+		nBUS->insert_cartridge(inJob.cartridge);
+	}
+	else {
+		const uint8_t* data = inJob.program->data();
+		for (size_t i = 0; i < inJob.program->size() && inJob.load_addr + i <= MAXRAMSIZE; i++) {
+			nBUS->write((uint16_t)(inJob.load_addr + i), data[i]);
+		}
+		cCPU.PC = inJob.start_pc;
+	}
+
+	uint64_t frame_budget = inJob.frame_budget;
+	if (!frame_budget && !inJob.cycle_budget) {
+		frame_budget = 600;
+	}
+	uint64_t cycle_budget = inJob.cycle_budget ? inJob.cycle_budget : UINT64_MAX;
+	bool per_instruction = inJob.has_exit_pc || inJob.stop_on_trap;
+
+	result.status = "budget";
+	uint64_t frames = 0;
+	while (cCPU.total_cycles < cycle_budget && (!frame_budget || frames < frame_budget)) {
+		// Buttons for this frame, holding the last pair once the input runs out
+		if (inJob.input.size() >= 2) {
+			size_t pair = (size_t)std::min<uint64_t>(frames, inJob.input.size() / 2 - 1);
+			nBUS->cINPUT.buttons[0] = inJob.input[pair * 2];
+			nBUS->cINPUT.buttons[1] = inJob.input[pair * 2 + 1];
+		}
+
+		if (!per_instruction) {
+			nBUS->run_frame();
+			frames++;
+			continue;
+		}
+
+		bool stopped = false;
+		while (nBUS->frame == frames && cCPU.total_cycles < cycle_budget) {
+			uint16_t last_pc = cCPU.PC;
+			nBUS->step();
+			if (inJob.has_exit_pc && cCPU.PC == inJob.exit_pc) {
+				result.status = "pc";
+				stopped = true;
+				break;
+			}
+			if (inJob.stop_on_trap && cCPU.PC == last_pc) {
+				result.status = "trap";
+				stopped = true;
+				break;
+			}
+		}
+		if (stopped) {
+			break;
+		}
+		frames = nBUS->frame;
+	}
+
+	std::vector<uint8_t> state;
+	nBUS->save_state(state);
+
+	result.ok = true;
+	result.hash = fnv1a(state);
+	result.cycles = cCPU.total_cycles;
+	result.frames = nBUS->frame;
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return result;
+}
+
+static bool parse_number(const std::string& in, uint64_t& out)
+{
+	char* end = nullptr;
+	out = strtoull(in.c_str(), &end, 0);
+	return end != in.c_str() && *end == '\0';
+}
+
+static bool parse_job(const std::string& inLine, job& outJob, std::string& outError)
+{
+	std::istringstream fields(inLine);
+	if (!(fields >> outJob.rom_path >> outJob.input_path)) {
+		outError = "expected <rom> <input|->";
+		return false;
+	}
+
+	std::string option;
+	while (fields >> option) {
+		size_t equals = option.find('=');
+		uint64_t value = 0;
+		if (equals == std::string::npos || !parse_number(option.substr(equals + 1), value)) {
+			outError = "bad option " + option;
+			return false;
+		}
+
+		std::string key = option.substr(0, equals);
+		if (key == "frames") { outJob.frame_budget = value; }
+		else if (key == "cycles") { outJob.cycle_budget = value; }
+		else if (key == "pc") { outJob.exit_pc = (uint16_t)value; outJob.has_exit_pc = true; }
+		else if (key == "trap") { outJob.stop_on_trap = value != 0; }
+		else if (key == "start") { outJob.start_pc = (uint16_t)value; }
+		else if (key == "load") { outJob.load_addr = (uint16_t)value; }
+		else {
+			outError = "unknown option " + key;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Parse every ROM once, jobs running the same one share the image
+static bool load_job(job& ioJob, std::string& outError)
+{
+	std::shared_ptr<const mapped_file> file = mapped_file::open(ioJob.rom_path);
+	if (!file) {
+		outError = "could not open " + ioJob.rom_path;
+		return false;
+	}
+
+	if (rom::is_ines(file->data(), file->size())) {
+		ioJob.cartridge = rom::load(ioJob.rom_path, &outError);
+		if (!ioJob.cartridge) {
+			return false;
+		}
+		if (!mapper::supported(*ioJob.cartridge)) {
+			outError = "mapper " + std::to_string(ioJob.cartridge->mapper) + " with " + std::to_string(ioJob.cartridge->prg_size / 1024) +
+				" KB PRG and " + std::to_string(ioJob.cartridge->chr_size / 1024) + " KB CHR is not supported";
+			return false;
+		}
+	}
+	else {
+		ioJob.program = file;
+	}
+
+	if (ioJob.input_path != "-") {
+		std::ifstream input(ioJob.input_path, std::ios::binary);
+		if (!input) {
+			outError = "could not open " + ioJob.input_path;
+			return false;
+		}
+		ioJob.input.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+	}
+	return true;
+}
+
+static void usage()
+{
+	printf("usage: nesbatch [--threads n] [--out file] <job list>\n");
+}
+
+int main(int argc, char** argv)
+{
+	const char* list_path = nullptr;
+	const char* out_path = nullptr;
+	size_t workers = std::max(1u, std::thread::hardware_concurrency());
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg[0] != '-') {
+			list_path = argv[i];
+			continue;
+		}
+		if (i + 1 >= argc) {
+			usage();
+			return 2;
+		}
+		i++;
+
+		uint64_t value = 0;
+		if (arg == "--threads" && parse_number(argv[i], value) && value > 0) { workers = (size_t)value; }
+		else if (arg == "--out") { out_path = argv[i]; }
+		else {
+			usage();
+			return 2;
+		}
+	}
+	if (!list_path) {
+		usage();
+		return 2;
+	}
+
+	std::ifstream list(list_path);
+	if (!list) {
+		printf("Could not open %s\n", list_path);
+		return 1;
+	}
+
+	std::vector<job> jobs;
+	std::vector<job_result> results;
+	std::string line;
+	for (int line_number = 1; std::getline(list, line); line_number++) {
+		size_t comment = line.find('#');
+		if (comment != std::string::npos) {
+			line.erase(comment);
+		}
+		if (line.find_first_not_of(" \t\r") == std::string::npos) {
+			continue;
+		}
+
+		job next;
+		std::string error;
+		if (!parse_job(line, next, error)) {
+			printf("%s:%d: %s\n", list_path, line_number, error.c_str());
+			return 1;
+		}
+		job_result result;
+		if (!load_job(next, error)) {
+			result.status = error;
+		}
+		jobs.push_back(std::move(next));
+		results.push_back(result);
+	}
+
+	workers = std::min(workers, std::max<size_t>(1, jobs.size()));
+	work_pool pool(workers, jobs.size());
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (size_t w = 0; w < workers; w++) {
+		threads.emplace_back([&, w]() {
+			size_t index;
+			while (pool.next(w, index)) {
+				// Jobs that failed to load keep their error as the status
+				if (jobs[index].cartridge || jobs[index].program) {
+					results[index] = run_job(jobs[index]);
+				}
+			}
+		});
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	FILE* out = out_path ? fopen(out_path, "w") : stdout;
+	if (!out) {
+		printf("Could not write %s\n", out_path);
+		return 1;
+	}
+	fprintf(out, "# job rom status hash cycles frames wall_ms\n");
+	uint64_t total_cycles = 0;
+	size_t failed = 0;
+	for (size_t i = 0; i < jobs.size(); i++) {
+		const job_result& r = results[i];
+		fprintf(out, "%zu %s %s %016llx %llu %llu %.3f\n", i, jobs[i].rom_path.c_str(), r.ok ? r.status.c_str() : ("error:" + r.status).c_str(),
+			(unsigned long long)r.hash, (unsigned long long)r.cycles, (unsigned long long)r.frames, r.seconds * 1000);
+		total_cycles += r.cycles;
+		failed += r.ok ? 0 : 1;
+	}
+	if (out != stdout) {
+		fclose(out);
+	}
+
+	printf("%zu jobs (%zu failed) on %zu workers in %.3f s, %.1f M cycles/s aggregate\n",
+		jobs.size(), failed, workers, seconds, total_cycles / seconds / 1e6);
+	return failed ? 1 : 0;
+}
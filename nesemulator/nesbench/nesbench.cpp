@@ -0,0 +1,458 @@
+/*
+* nesbench
+* ---
+* Headless throughput benchmark for the cpu core. Loads a raw 6502
+* binary (e.g. 6502_functional_test.bin) or an iNES file, runs it until it reaches the
+* success PC, gets stuck in a trap or uses up the cycle budget, and
+* reports emulated instructions/sec, cycles/sec and MHz. iNES files run
+* whole frames through the bus scheduler, PPU included, and report
+* frames/sec instead of instructions/sec.
+*
+* nesbench [options] [binary]
+*	--load <addr>		Address the binary is loaded at (default 0x0000)
+*	--start <addr>		PC to start from (default 0x0400, iNES files use the reset vector)
+*	--success <addr>	PC that means the program passed
+*	--cycles <n>		Cycle budget per run (default 100000000)
+*	--runs <n>			Measured runs (default 5)
+*	--warmup <n>		Unmeasured runs before those (default 1)
+*	--rewind <MB>		iNES only: record every frame into a rewind buffer of that budget
+*						and report its memory use per second and step back cost
+*	--runahead <k>		iNES only: run k frames ahead of every displayed frame
+*	--shadow <0|1>		Run ahead on a second bus instead of save and restore
+*	--render <0|1>		iNES only: draw pictures (default 1). 0 runs every frame like a
+*						run-ahead frame, so the difference is the cost of rendering
+*	--simd <0|1|2>		Sprite kernels to use at most: scalar, SSE2, AVX2 (default 2)
+*	--thread <0|1>		iNES only: draw on a render thread, taking each picture one frame
+*						behind, and report how often its $2002 disagreed with the CPU's
+*	--blocks <0|1>		Run from the predecoded block cache and report its counters.
+*						Raw binaries still stop after every instruction to check PC
+*	--idle <0|1>		With --blocks, fast forward idle loops to the next event (default 1)
+*	--pairs <n>			Run from the block cache without superinstructions and print
+*						the n most executed opcode pairs
+*	--trace <file>		Builds with NES_TRACE: record the last TRACE_RECORDS instructions
+*						of every run and dump the last run's, for nesemulator --decode-trace.
+*						Tracing runs every instruction through cpu::clock()
+*
+* Without a binary the small multiply loop from main.cpp is run instead.
+*/
+#include "block_cache.h"
+#include "bus.h"
+#include "mapper.h"
+#include "render_thread.h"
+#include "rewind.h"
+#include "runahead.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// NTSC 2A03 clock
+static const double NES_CPU_MHZ = 1.789773;
+
+// Ring buffer size for --trace, 18 bytes each
+static const size_t TRACE_RECORDS = 1 << 20;
+
+struct bench_config {
+	std::shared_ptr<const rom> cartridge;
+	std::vector<uint8_t> program;
+	uint16_t load_addr = 0x0000;
+	uint16_t start_pc = 0x0400;
+	bool has_success = false;
+	uint16_t success_pc = 0;
+	uint64_t cycle_budget = 100000000;
+	int runs = 5;
+	int warmup = 1;
+	size_t rewind_budget = 0;	// Bytes, 0 disables rewind recording
+	uint32_t runahead_frames = 0;
+	bool runahead_shadow = false;
+	bool render = true;
+	sprite_kernels::level simd = sprite_kernels::avx2;
+	bool render_thread = false;
+	bool blocks = false;
+	bool skip_idle = true;
+	uint32_t pairs = 0;	// Pair histogram entries to print, 0 doesn't record one
+	const char* trace_path = nullptr;
+};
+
+struct run_result {
+	uint64_t instructions = 0;
+	uint64_t cycles = 0;
+	uint64_t frames = 0;	// Only counted for cartridges
+	double seconds = 0;
+
+	// Rewind buffer at the end of the run, with --rewind
+	size_t rewind_frames = 0;
+	size_t rewind_bytes = 0;
+	size_t state_size = 0;
+	double rewind_bytes_per_second = 0;
+	double step_back_us = 0;	// Average over stepping back through the whole buffer
+
+	uint64_t frames_emulated = 0;	// With --runahead, including the frames run ahead
+	uint64_t pictures = 0;			// Completed by the PPU
+	uint64_t tile_hits = 0;
+	uint64_t tile_rebuilds = 0;
+	uint64_t tile_invalidations = 0;
+	uint64_t render_checks = 0;		// With --thread
+	uint64_t render_mispredictions = 0;
+	uint64_t pictures_taken = 0;
+	uint16_t final_pc = 0;
+	bool trapped = false;	// PC stopped moving
+
+	// Block cache counters, with --blocks
+	uint64_t block_hits = 0;
+	uint64_t block_misses = 0;
+	uint64_t block_invalidations = 0;
+	uint64_t block_instructions = 0;
+	uint64_t block_fused = 0;
+	uint64_t block_dispatches = 0;
+	uint64_t idle_cycles = 0;
+	std::vector<uint64_t> pairs;	// With --pairs, first << 8 | second
+};
+
+static run_result run_once(const bench_config& config)
+{
+	// Fresh machine for every run so runs don't see each other's state
+	std::unique_ptr<bus> nBUS(new bus());
+	cpu& cCPU = nBUS->cCPU;
+	nBUS->enable_block_cache(config.blocks || config.pairs);
+	if (config.pairs) {
+		nBUS->cBLOCKS->record_pairs(true);
+	}
+	if (nBUS->cBLOCKS) {
+		nBUS->cBLOCKS->skip_idle = config.skip_idle;
+	}
+
+	if (config.cartridge) {
+		nBUS->insert_cartridge(config.cartridge);
+		nBUS->output_enabled = config.render;
+		nBUS->cPPU.kernels = &sprite_kernels::get(config.simd);
+		nBUS->cPPU.enable_render_thread(config.render_thread);
+	}
+	else {
+		uint16_t WritePtr = config.load_addr;
+		for (uint8_t byte : config.program) {
+			nBUS->write(WritePtr++, byte);
+		}
+		cCPU.PC = config.start_pc;
+	}
+#ifdef NES_TRACE
+	if (config.trace_path) {
+		cCPU.trace.enable(TRACE_RECORDS);
+	}
+#endif
+
+	run_result result;
+	auto start = std::chrono::steady_clock::now();
+
+	// Games never trap, so cartridges just run frames until the budget is used
+	std::unique_ptr<rewind_buffer> rewind(config.rewind_budget ? new rewind_buffer(config.rewind_budget) : nullptr);
+	std::unique_ptr<runahead> ahead(config.runahead_frames ? new runahead(nBUS.get(), config.runahead_frames, config.runahead_shadow) : nullptr);
+	while (config.cartridge && cCPU.total_cycles < config.cycle_budget) {
+		if (ahead) {
+			ahead->run_frame(0);
+		}
+		else {
+			nBUS->run_frame();
+		}
+		result.frames++;
+		// The frontend's side of a render thread: show the frame before the one just run
+		if (config.render_thread && !ahead && nBUS->frame >= 2 && nBUS->cPPU.picture(nBUS->frame - 2)) {
+			result.pictures_taken++;
+		}
+		if (rewind) {
+			rewind->push(*nBUS);
+		}
+	}
+
+	while (!config.cartridge && cCPU.total_cycles < config.cycle_budget) {
+		uint16_t last_pc = cCPU.PC;
+		if (nBUS->cBLOCKS) {
+			cCPU.run_blocks(*nBUS->cBLOCKS, cCPU.total_cycles + 1);
+		}
+		else {
+			cCPU.clock();
+		}
+		result.instructions++;
+
+		// Test programs signal pass and fail by jumping or branching to themselves
+		if (cCPU.PC == last_pc) {
+			result.trapped = true;
+			break;
+		}
+		if (config.has_success && cCPU.PC == config.success_pc) {
+			break;
+		}
+	}
+
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	result.cycles = cCPU.total_cycles;
+	result.final_pc = cCPU.PC;
+#ifdef NES_TRACE
+	if (config.trace_path) {
+		std::ofstream dump(config.trace_path, std::ios::binary);
+		cCPU.trace.dump(dump);
+	}
+#endif
+	result.frames_emulated = ahead ? ahead->frames_emulated : result.frames;
+	result.pictures = ahead ? ahead->presented().cPPU.frames_rendered : nBUS->cPPU.frames_rendered;
+	result.tile_hits = nBUS->cPPU.tiles.hits;
+	result.tile_rebuilds = nBUS->cPPU.tiles.rebuilds;
+	result.tile_invalidations = nBUS->cPPU.tiles.invalidations;
+	if (render_thread* renderer = nBUS->cPPU.renderer()) {
+		renderer->drain();
+		result.render_checks = renderer->checks;
+		result.render_mispredictions = renderer->mispredictions;
+	}
+	if (nBUS->cBLOCKS) {
+		result.block_hits = nBUS->cBLOCKS->hits;
+		result.block_misses = nBUS->cBLOCKS->misses;
+		result.block_invalidations = nBUS->cBLOCKS->invalidations;
+		result.block_instructions = nBUS->cBLOCKS->instructions;
+		result.block_fused = nBUS->cBLOCKS->fused;
+		result.block_dispatches = nBUS->cBLOCKS->dispatches;
+		result.idle_cycles = nBUS->cBLOCKS->idle_cycles;
+		for (uint32_t pair = 0; config.pairs && pair < 0x10000; pair++) {
+			result.pairs.push_back(nBUS->cBLOCKS->pair_count(pair >> 8, pair & 0xFF));
+		}
+	}
+
+	if (rewind && rewind->frames()) {
+		result.rewind_frames = rewind->frames();
+		result.rewind_bytes = rewind->bytes_used();
+		result.state_size = rewind->state_size();
+		result.rewind_bytes_per_second = rewind->bytes_per_second();
+
+		size_t steps = 0;
+		auto rewind_start = std::chrono::steady_clock::now();
+		while (rewind->step_back(*nBUS)) {
+			steps++;
+		}
+		double rewind_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - rewind_start).count();
+		result.step_back_us = steps ? rewind_seconds / steps * 1e6 : 0;
+	}
+	return result;
+}
+
+static void print_run(const char* label, const run_result& r)
+{
+	double mhz = r.cycles / r.seconds / 1e6;
+	if (r.frames) {
+		printf("%-8s %12llu frames %12llu cycles %9.3f s %10.1f fps %10.2f MHz %8.1fx NES\n",
+			label, (unsigned long long)r.frames, (unsigned long long)r.cycles, r.seconds,
+			r.frames / r.seconds, mhz, mhz / NES_CPU_MHZ);
+		return;
+	}
+	printf("%-8s %12llu instr %12llu cycles %9.3f s %10.2f Minstr/s %10.2f MHz %8.1fx NES\n",
+		label, (unsigned long long)r.instructions, (unsigned long long)r.cycles, r.seconds,
+		r.instructions / r.seconds / 1e6, mhz, mhz / NES_CPU_MHZ);
+}
+
+static bool parse_number(const char* in, uint64_t& out)
+{
+	char* end = nullptr;
+	out = strtoull(in, &end, 0);
+	return end != in && *end == '\0';
+}
+
+/*
+* Most executed opcode pairs, with their share of all pairs executed
+*/
+static void print_pairs(const std::vector<uint64_t>& inPairs, uint32_t inCount)
+{
+	std::vector<uint32_t> order;
+	uint64_t total = 0;
+	for (uint32_t pair = 0; pair < inPairs.size(); pair++) {
+		total += inPairs[pair];
+		if (inPairs[pair]) {
+			order.push_back(pair);
+		}
+	}
+	std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+		return inPairs[a] > inPairs[b];
+	});
+
+	printf("pairs    %llu executed, %zu distinct\n", (unsigned long long)total, order.size());
+	for (size_t i = 0; i < order.size() && i < inCount; i++) {
+		uint8_t first = order[i] >> 8;
+		uint8_t second = order[i] & 0xFF;
+		printf("  $%02X %s  $%02X %s  %14llu  %5.2f%%\n", first, cpu::mnemonic(cpu::opcode_table[first].operation),
+			second, cpu::mnemonic(cpu::opcode_table[second].operation), (unsigned long long)inPairs[order[i]], 100.0 * inPairs[order[i]] / total);
+	}
+}
+
+static void usage()
+{
+	printf("usage: nesbench [--load addr] [--start addr] [--success addr] [--cycles n] [--runs n] [--warmup n] [--rewind MB] [--runahead k] [--shadow 0|1] [--render 0|1] [--simd 0|1|2] [--thread 0|1] [--blocks 0|1] [--idle 0|1] [--pairs n] [--trace file] [binary]\n");
+}
+
+int main(int argc, char** argv)
+{
+	bench_config config;
+	const char* path = nullptr;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		uint64_t value = 0;
+
+		if (arg[0] != '-') {
+			path = argv[i];
+			continue;
+		}
+		if (arg == "--trace" && i + 1 < argc) {
+#ifdef NES_TRACE
+			config.trace_path = argv[++i];
+			continue;
+#else
+			printf("--trace needs a build with NES_TRACE\n");
+			return 2;
+#endif
+		}
+		if (i + 1 >= argc || !parse_number(argv[i + 1], value)) {
+			usage();
+			return 2;
+		}
+		i++;
+
+		if (arg == "--load") { config.load_addr = (uint16_t)value; }
+		else if (arg == "--start") { config.start_pc = (uint16_t)value; }
+		else if (arg == "--success") { config.success_pc = (uint16_t)value; config.has_success = true; }
+		else if (arg == "--cycles") { config.cycle_budget = value; }
+		else if (arg == "--runs") { config.runs = std::max(1, (int)value); }
+		else if (arg == "--warmup") { config.warmup = (int)value; }
+		else if (arg == "--rewind") { config.rewind_budget = (size_t)value << 20; }
+		else if (arg == "--runahead") { config.runahead_frames = (uint32_t)value; }
+		else if (arg == "--shadow") { config.runahead_shadow = value != 0; }
+		else if (arg == "--render") { config.render = value != 0; }
+		else if (arg == "--simd") { config.simd = (sprite_kernels::level)std::min<uint64_t>(value, sprite_kernels::avx2); }
+		else if (arg == "--thread") { config.render_thread = value != 0; }
+		else if (arg == "--blocks") { config.blocks = value != 0; }
+		else if (arg == "--idle") { config.skip_idle = value != 0; }
+		else if (arg == "--pairs") { config.pairs = (uint32_t)value; }
+		else {
+			usage();
+			return 2;
+		}
+	}
+
+	if (path) {
+		std::shared_ptr<const mapped_file> file = mapped_file::open(path);
+		if (!file) {
+			printf("Could not open %s\n", path);
+			return 1;
+		}
+		if (rom::is_ines(file->data(), file->size())) {
+			std::string error;
+			config.cartridge = rom::load(path, &error);
+			if (!config.cartridge) {
+				printf("%s: %s\n", path, error.c_str());
+				return 1;
+			}
+			if (!mapper::supported(*config.cartridge)) {
+				printf("%s: mapper %u with %u KB PRG and %u KB CHR is not supported\n", path, config.cartridge->mapper,
+					config.cartridge->prg_size / 1024, config.cartridge->chr_size / 1024);
+				return 1;
+			}
+		}
+		else {
+			config.program.assign(file->data(), file->data() + file->size());
+		}
+	}
+	else {
+		// Multiply loop from main.cpp with a jump back to the start
+		config.program = {
+			0xA2, 0x0A, 0x8E, 0x00, 0x00, 0xA2, 0x03, 0x8E, 0x01, 0x00, 0xAC, 0x00, 0x00, 0xA9, 0x00, 0x18,
+			0x6D, 0x01, 0x00, 0x88, 0xD0, 0xFA, 0x8D, 0x02, 0x00, 0xEA, 0xEA, 0xEA, 0x4C, 0x00, 0x02
+		};
+		config.load_addr = 0x0200;
+		config.start_pc = 0x0200;
+		path = "built-in loop";
+	}
+
+	if (config.cartridge) {
+		printf("%s: mapper %u, %u KB PRG, %u KB CHR, budget %llu cycles, %s sprite kernels\n", path, config.cartridge->mapper,
+			config.cartridge->prg_size / 1024, config.cartridge->chr_size / 1024, (unsigned long long)config.cycle_budget,
+			sprite_kernels::get(config.simd).name);
+	}
+	else {
+		printf("%s: %zu bytes at $%04X, start $%04X, budget %llu cycles\n", path, config.program.size(),
+			config.load_addr, config.start_pc, (unsigned long long)config.cycle_budget);
+	}
+
+	for (int i = 0; i < config.warmup; i++) {
+		run_once(config);
+	}
+
+	std::vector<run_result> results;
+	for (int i = 0; i < config.runs; i++) {
+		results.push_back(run_once(config));
+		print_run(("run " + std::to_string(i + 1)).c_str(), results.back());
+	}
+
+	// Best and median by throughput, the median is what to track across releases
+	std::sort(results.begin(), results.end(), [](const run_result& a, const run_result& b) {
+		return a.cycles / a.seconds > b.cycles / b.seconds;
+	});
+	print_run("best", results.front());
+	print_run("median", results[results.size() / 2]);
+
+	const run_result& median = results[results.size() / 2];
+	if (median.rewind_frames) {
+		printf("rewind   %zu frames in %.2f MB, %zu byte states, %.1f KB per second retained (%.1f s in budget), step back %.1f us\n",
+			median.rewind_frames, median.rewind_bytes / 1048576.0, median.state_size, median.rewind_bytes_per_second / 1024,
+			config.rewind_budget / median.rewind_bytes_per_second, median.step_back_us);
+	}
+
+	if (median.frames) {
+		printf("ppu      %llu pictures, rendering %s, %.1f us per frame\n", (unsigned long long)median.pictures,
+			config.render ? "on" : "off", median.seconds / median.frames * 1e6);
+		uint64_t rows = median.tile_hits + median.tile_rebuilds;
+		printf("tiles    %llu row lookups, %.3f%% hit rate, %llu tiles decoded, %llu dropped\n", (unsigned long long)rows,
+			rows ? 100.0 * median.tile_hits / rows : 0.0, (unsigned long long)median.tile_rebuilds, (unsigned long long)median.tile_invalidations);
+	}
+	if (config.render_thread && median.frames) {
+		printf("thread   %llu pictures taken one frame behind, %llu catch-ups checked, %llu $2002 mispredictions\n",
+			(unsigned long long)median.pictures_taken, (unsigned long long)median.render_checks, (unsigned long long)median.render_mispredictions);
+	}
+
+	if (config.runahead_frames && median.frames) {
+		// The headroom is how many times over real time the displayed frames still run
+		printf("runahead %u frames (%s), %.2f frames emulated per displayed frame, %.1f us per displayed frame, %.1fx realtime\n",
+			config.runahead_frames, config.runahead_shadow ? "shadow bus" : "save/restore",
+			(double)median.frames_emulated / median.frames, median.seconds / median.frames * 1e6,
+			median.frames / median.seconds / 60.0988);
+	}
+
+	if (config.blocks || config.pairs) {
+		uint64_t lookups = median.block_hits + median.block_misses;
+		printf("blocks   %llu hits, %llu misses, %llu invalidations, %.2f%% hit rate, %.1f instructions per block\n",
+			(unsigned long long)median.block_hits, (unsigned long long)median.block_misses,
+			(unsigned long long)median.block_invalidations, lookups ? 100.0 * median.block_hits / lookups : 0.0,
+			lookups ? (double)median.block_instructions / lookups : 0.0);
+		printf("fused    %llu superinstructions decoded, %.2f instructions per dispatch\n", (unsigned long long)median.block_fused,
+			median.block_dispatches ? (double)median.block_instructions / median.block_dispatches : 0.0);
+		printf("idle     %llu cycles skipped, %.1f%% of the run\n", (unsigned long long)median.idle_cycles,
+			median.cycles ? 100.0 * median.idle_cycles / median.cycles : 0.0);
+	}
+
+	if (config.pairs) {
+		print_pairs(median.pairs, config.pairs);
+	}
+
+	// Every run executes the same instructions, report where the median one stopped with the rest
+	if (config.has_success && median.final_pc == config.success_pc) {
+		printf("Reached success PC $%04X\n", config.success_pc);
+	}
+	else if (median.trapped) {
+		printf("Trapped at $%04X\n", median.final_pc);
+	}
+	else {
+		printf("Stopped at $%04X after the cycle budget\n", median.final_pc);
+	}
+	return 0;
+}
@@ -0,0 +1,384 @@
+/*
+* nescheck
+* ---
+* Regression checks for bugs that got past the benchmarks: each builds a
+* small program on a fresh bus, runs it and compares what it sees with
+* what it should. Prints one line per check and exits 1 if any failed.
+* Run by ctest.
+*
+* nescheck [name]	Only the check with that name
+*/
+#include "bus.h"
+#include "mapper.h"
+#include "sprite_kernels.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct check {
+	const char* name;
+	bool (*run)(std::string& outWhy);
+};
+
+static void poke(bus& nBUS, uint16_t inAddr, std::vector<uint8_t> inBytes)
+{
+	for (uint8_t byte : inBytes) {
+		nBUS.write(inAddr++, byte);
+	}
+}
+
+/*
+* A page written after a save and then write protected by the block
+* cache has to be copied back by an incremental restore
+*/
+static bool dirty_code_page(std::string& outWhy)
+{
+	bus nBUS;
+	nBUS.enable_block_cache(true);
+	poke(nBUS, 0x0200, { 0xEE, 0x80, 0x02, 0x4C, 0x10, 0x02 });	// INC $0280; JMP $0210
+	poke(nBUS, 0x0210, { 0x4C, 0x10, 0x02 });						// JMP $0210
+	nBUS.write(0x0280, 10);
+	nBUS.cCPU.PC = 0x0200;
+
+	snapshot saved;
+	nBUS.save(saved);
+	nBUS.run(1000);
+	if (nBUS.read(0x0280) != 11) {
+		outWhy = "the program didn't run";
+		return false;
+	}
+	nBUS.restore(saved);
+	if (nBUS.read(0x0280) != 10) {
+		outWhy = "$0280 restored as " + std::to_string(nBUS.read(0x0280)) + ", expected 10";
+		return false;
+	}
+	return true;
+}
+
+/*
+* CNROM program: bank 0 draws tile 1 everywhere in colour $16 and bank 1
+* in $2A. The NMI selects bank 0, busy waits about 16k cycles without
+* touching the PPU and selects bank 1, near line 120
+*/
+static std::vector<uint8_t> cnrom_split_image()
+{
+	std::vector<uint8_t> image = { 'N', 'E', 'S', 0x1A, 2, 2, 0x30, 0x00, 0, 0, 0, 0, 0, 0, 0, 0 };
+	std::vector<uint8_t> prg(0x8000, 0xEA);
+	const uint8_t program[] = {
+		// Reset: wait for the PPU, palette $0F $16 $2A
+		0x78, 0xD8, 0xA2, 0xFF, 0x9A, 0xAD, 0x02, 0x20, 0x10, 0xFB, 0xAD, 0x02, 0x20, 0x10, 0xFB,
+		0xA9, 0x3F, 0x8D, 0x06, 0x20, 0xA9, 0x00, 0x8D, 0x06, 0x20, 0xA9, 0x0F, 0x8D, 0x07, 0x20,
+		0xA9, 0x16, 0x8D, 0x07, 0x20, 0xA9, 0x2A, 0x8D, 0x07, 0x20,
+		// Nametable 0 all tile 1, attributes 0
+		0xA9, 0x20, 0x8D, 0x06, 0x20, 0xA9, 0x00, 0x8D, 0x06, 0x20, 0xA9, 0x01, 0xA0, 0x04, 0xA2, 0x00,
+		0x8D, 0x07, 0x20, 0xE8, 0xD0, 0xFA, 0x88, 0xD0, 0xF7,
+		0xA9, 0x23, 0x8D, 0x06, 0x20, 0xA9, 0xC0, 0x8D, 0x06, 0x20, 0xA9, 0x00, 0xA2, 0x40,
+		0x8D, 0x07, 0x20, 0xCA, 0xD0, 0xFA,
+		// Scroll 0, NMI and background on, then idle
+		0x8D, 0x05, 0x20, 0x8D, 0x05, 0x20, 0xA9, 0x80, 0x8D, 0x00, 0x20, 0xA9, 0x0A, 0x8D, 0x01, 0x20,
+		0x4C, 0x65, 0x80,
+		// NMI at $8068: bank 0, wait, bank 1
+		0xA9, 0x00, 0x8D, 0x00, 0x80, 0xA2, 0x0D, 0xA0, 0x00, 0x88, 0xD0, 0xFD, 0xCA, 0xD0, 0xFA,
+		0xA9, 0x01, 0x8D, 0x00, 0x80, 0x40
+	};
+	std::copy(program, program + sizeof(program), prg.begin());
+	const uint8_t vectors[] = { 0x68, 0x80, 0x00, 0x80, 0x00, 0x80 };
+	std::copy(vectors, vectors + sizeof(vectors), prg.end() - 6);
+	image.insert(image.end(), prg.begin(), prg.end());
+
+	// Tile 1 of bank 0 is pixel 1 throughout, of bank 1 pixel 2
+	std::vector<uint8_t> chr(0x4000, 0);
+	std::fill(chr.begin() + 0x10, chr.begin() + 0x18, 0xFF);
+	std::fill(chr.begin() + 0x2018, chr.begin() + 0x2020, 0xFF);
+	image.insert(image.end(), chr.begin(), chr.end());
+
+	return image;
+}
+
+/*
+* A CNROM bank switch in the middle of the picture, with no PPU access
+* before it: the lines above it keep the old bank
+*/
+static bool mid_frame_chr_switch(std::string& outWhy)
+{
+	std::vector<uint8_t> image = cnrom_split_image();
+	const char* path = "nescheck_cnrom.nes";
+	std::ofstream(path, std::ios::binary).write((const char*)image.data(), image.size());
+	std::shared_ptr<const rom> cartridge = rom::load(path);
+	bool ok = false;
+	if (!cartridge) {
+		outWhy = "couldn't load the test cartridge";
+	}
+	else {
+		bus nBUS;
+		nBUS.insert_cartridge(cartridge);
+		for (int i = 0; i < 4; i++) {
+			nBUS.run_frame();
+		}
+
+		// First line in the new bank
+		const uint8_t* picture = nBUS.cPPU.framebuffer;
+		uint32_t split = 0;
+		while (split < ppu::HEIGHT && picture[split * ppu::WIDTH] == 0x16) {
+			split++;
+		}
+		bool clean = true;
+		for (uint32_t y = split; y < ppu::HEIGHT; y++) {
+			clean &= picture[y * ppu::WIDTH] == 0x2A;
+		}
+		ok = clean && split > 100 && split < 150;
+		if (!ok) {
+			outWhy = "bank 1 starts at line " + std::to_string(split) + (clean ? "" : " and isn't kept to the end") + ", expected near 120";
+		}
+	}
+	cartridge.reset();
+	std::remove(path);
+	return ok;
+}
+
+/*
+* A bus destroyed while its render thread still has log entries to
+* replay, holding the last reference to the cartridge: the thread draws
+* them from CHR-ROM before the image is unmapped
+*/
+static bool render_thread_teardown(std::string& outWhy)
+{
+	std::vector<uint8_t> image = cnrom_split_image();
+	const char* path = "nescheck_teardown.nes";
+	std::ofstream(path, std::ios::binary).write((const char*)image.data(), image.size());
+	bool ok = true;
+	for (int i = 0; i < 50 && ok; i++) {
+		std::unique_ptr<bus> nBUS(new bus());
+		std::shared_ptr<const rom> cartridge = rom::load(path);
+		ok = cartridge && nBUS->insert_cartridge(std::move(cartridge));
+		if (ok) {
+			// Rendering is on from the third frame
+			nBUS->cPPU.enable_render_thread(true);
+			for (int frame = 0; frame < 3; frame++) {
+				nBUS->run_frame();
+			}
+			nBUS->run(10000 + i * 97);
+		}
+	}
+	if (!ok) {
+		outWhy = "couldn't load the test cartridge";
+	}
+	std::remove(path);
+	return ok;
+}
+
+/*
+* Headers whose sizes don't fit the file or can't be banked are rejected
+* by rom::load, a plain NROM image still loads
+*/
+static bool bad_rom_sizes(std::string& outWhy)
+{
+	struct image {
+		const char* what;
+		std::vector<uint8_t> header;
+		size_t body;		// Bytes after the header
+		bool loads;
+	};
+	const image images[] = {
+		{ "NROM 16KB PRG, 8KB CHR", { 'N', 'E', 'S', 0x1A, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, 0x6000, true },
+		{ "NES 2.0 PRG of 2^63 bytes", { 'N', 'E', 'S', 0x1A, 0xFC, 0, 0, 0x08, 0, 0x0F, 0, 0, 0, 0, 0, 0 }, 0, false },
+		{ "NES 2.0 CHR of 1 byte", { 'N', 'E', 'S', 0x1A, 1, 0, 0x30, 0x08, 0, 0xF0, 0, 0, 0, 0, 0, 0 }, 0x4001, false },
+		{ "NES 2.0 PRG of 4KB", { 'N', 'E', 'S', 0x1A, 0x30, 0, 0, 0x08, 0, 0x0F, 0, 0, 0, 0, 0, 0 }, 0x1000, false },
+		{ "trainer past the end", { 'N', 'E', 'S', 0x1A, 1, 0, 0x04, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, 0x100, false },
+	};
+
+	const char* path = "nescheck_sizes.nes";
+	bool ok = true;
+	for (const image& entry : images) {
+		std::vector<uint8_t> file = entry.header;
+		file.resize(file.size() + entry.body, 0xEA);
+		std::ofstream(path, std::ios::binary).write((const char*)file.data(), file.size());
+		std::string error;
+		bool loaded = rom::load(path, &error) != nullptr;
+		if (loaded != entry.loads) {
+			outWhy = std::string(entry.what) + (loaded ? " loaded" : " was rejected: " + error);
+			ok = false;
+			break;
+		}
+	}
+	std::remove(path);
+	return ok;
+}
+
+/*
+* A CNROM image with only 1KB of CHR-ROM loads but has no 8KB bank to
+* map: inserting it fails instead of dividing by the bank count
+*/
+static bool small_chr_rom(std::string& outWhy)
+{
+	// NES 2.0, CHR size 2^10 in exponent notation
+	std::vector<uint8_t> image = { 'N', 'E', 'S', 0x1A, 1, 10 << 2, 0x30, 0x08, 0, 0xF0, 0, 0, 0, 0, 0, 0 };
+	image.resize(16 + 0x4000 + 0x400, 0xEA);
+
+	const char* path = "nescheck_small_chr.nes";
+	std::ofstream(path, std::ios::binary).write((const char*)image.data(), image.size());
+	std::shared_ptr<const rom> cartridge = rom::load(path);
+	bool ok = false;
+	if (!cartridge) {
+		outWhy = "rom::load rejected a 1KB CHR-ROM";
+	}
+	else {
+		bus nBUS;
+		ok = !nBUS.insert_cartridge(cartridge) && !mapper::supported(*cartridge);
+		if (!ok) {
+			outWhy = "a 1KB CHR-ROM was inserted";
+		}
+	}
+	cartridge.reset();
+	std::remove(path);
+	return ok;
+}
+
+/*
+* NES 2.0 PRG-RAM of 128 bytes: every CPU page pointing into a memory
+* region has its 256 bytes inside it
+*/
+static bool small_prg_ram(std::string& outWhy)
+{
+	std::vector<uint8_t> image = { 'N', 'E', 'S', 0x1A, 1, 1, 0, 0x08, 0, 0, 0x01, 0, 0, 0, 0, 0 };
+	image.resize(16 + 0x4000 + 0x2000, 0xEA);
+
+	const char* path = "nescheck_small_ram.nes";
+	std::ofstream(path, std::ios::binary).write((const char*)image.data(), image.size());
+	std::shared_ptr<const rom> cartridge = rom::load(path);
+	bool ok = false;
+	if (!cartridge) {
+		outWhy = "couldn't load the test cartridge";
+	}
+	else {
+		bus nBUS;
+		nBUS.insert_cartridge(cartridge);
+		ok = true;
+		for (uint32_t page = 0; page < 0x100 && ok; page++) {
+			const uint8_t* ptr = nBUS.write_pages[page];
+			for (const bus::memory_region& region : nBUS.regions) {
+				if (ptr >= region.data && ptr < region.data + region.size && ptr + 0x100 > region.data + region.size) {
+					char where[64];
+					snprintf(where, sizeof(where), "page $%02X runs past the end of its memory", page);
+					outWhy = where;
+					ok = false;
+				}
+			}
+		}
+	}
+	cartridge.reset();
+	std::remove(path);
+	return ok;
+}
+
+/*
+* The SSE2 and AVX2 sprite kernels, where the host runs them, against
+* the scalar ones on random OAM, lines and palettes: more than 8 sprites
+* on a line, 8x16 sprites, the row of line 0 and runs of any length
+* and alignment included
+*/
+static bool sprite_kernels_match(std::string& outWhy)
+{
+	const sprite_kernels& reference = sprite_kernels::get(sprite_kernels::scalar);
+	std::vector<const sprite_kernels*> levels;
+	for (sprite_kernels::level level : { sprite_kernels::sse2, sprite_kernels::avx2 }) {
+		const sprite_kernels& kernels = sprite_kernels::get(level);
+		if (&kernels != &reference && (levels.empty() || levels.back() != &kernels)) {
+			levels.push_back(&kernels);
+		}
+	}
+
+	uint64_t random = 0x2545F4914F6CDD1DULL;
+	auto next = [&random]() {
+		random ^= random << 13;
+		random ^= random >> 7;
+		random ^= random << 17;
+		return (uint32_t)random;
+	};
+
+	for (const sprite_kernels* kernels : levels) {
+		for (uint32_t round = 0; round < 20000; round++) {
+			// Sprite Y within a few lines of the row, so lines often have more than 8
+			uint8_t oam[256];
+			uint32_t row = next() % 8 == 0 ? 0xFFFFFFFF : next() % 240;
+			for (uint32_t i = 0; i < 256; i++) {
+				oam[i] = (uint8_t)next();
+				if (i % 4 == 0 && next() % 2) {
+					oam[i] = (uint8_t)(row + 4 - next() % 20);
+				}
+			}
+			uint32_t height = next() % 2 ? 16 : 8;
+			uint8_t expected_found[8] = {}, found[8] = {};
+			uint32_t expected_count = reference.evaluate(oam, row, height, expected_found);
+			uint32_t count = kernels->evaluate(oam, row, height, found);
+			if (count != expected_count || memcmp(found, expected_found, std::min(count, 8u)) != 0) {
+				outWhy = std::string(kernels->name) + " evaluate differs on row " + std::to_string((int32_t)row);
+				return false;
+			}
+
+			uint8_t expected_line[ppu::WIDTH + 8], line[ppu::WIDTH + 8], pixels[8];
+			for (uint32_t i = 0; i < sizeof(line); i++) {
+				expected_line[i] = line[i] = next() % 2 ? 0 : (uint8_t)(0x10 | (next() & 0x6F));
+			}
+			for (uint8_t& pixel : pixels) {
+				pixel = next() % 4;
+			}
+			uint32_t x = next() % ppu::WIDTH;
+			uint8_t base = (uint8_t)(0x10 | (next() & 0x0C) | (next() % 2 ? SPRITE_BEHIND : 0) | (next() % 8 ? 0 : SPRITE_ZERO));
+			reference.draw(expected_line + x, pixels, base);
+			kernels->draw(line + x, pixels, base);
+			if (memcmp(line, expected_line, sizeof(line)) != 0) {
+				outWhy = std::string(kernels->name) + " draw differs at x " + std::to_string(x);
+				return false;
+			}
+
+			uint8_t background[ppu::WIDTH], palette[32], expected_out[ppu::WIDTH], out[ppu::WIDTH];
+			for (uint8_t& pixel : background) {
+				pixel = next() % 3 ? (uint8_t)(next() % 16) : 0;
+			}
+			for (uint8_t& colour : palette) {
+				colour = (uint8_t)next();
+			}
+			uint32_t first = next() % ppu::WIDTH;
+			uint32_t length = 1 + next() % (ppu::WIDTH - first);
+			uint8_t grey = next() % 2 ? 0x3F : 0x30;
+			bool expected_hit = reference.composite(expected_out, background + first, line + first, length, palette, grey);
+			bool hit = kernels->composite(out, background + first, line + first, length, palette, grey);
+			if (hit != expected_hit || memcmp(out, expected_out, length) != 0) {
+				outWhy = std::string(kernels->name) + " composite differs on " + std::to_string(length) + " pixels from x " + std::to_string(first);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static const check checks[] = {
+	{ "dirty_code_page", dirty_code_page },
+	{ "mid_frame_chr_switch", mid_frame_chr_switch },
+	{ "bad_rom_sizes", bad_rom_sizes },
+	{ "small_chr_rom", small_chr_rom },
+	{ "small_prg_ram", small_prg_ram },
+	{ "render_thread_teardown", render_thread_teardown },
+	{ "sprite_kernels_match", sprite_kernels_match },
+};
+
+int main(int argc, char** argv)
+{
+	int failed = 0;
+	for (const check& entry : checks) {
+		if (argc > 1 && strcmp(argv[1], entry.name) != 0) {
+			continue;
+		}
+		std::string why;
+		bool ok = entry.run(why);
+		printf("%-24s %s%s%s\n", entry.name, ok ? "ok" : "FAIL", ok ? "" : ": ", why.c_str());
+		failed += !ok;
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,88 @@
+/*
+* nesflags
+* ---
+* Differential check for NES_LAZY_FLAGS. Runs random programs and prints
+* one line per program with a hash of PC, A, X, Y, flags() and the cycle
+* count after every instruction, and of the whole state at the end. The
+* build links it once against nescore and once against nescore_lazy, and
+* ctest runs both and expects the same output. Each program runs with
+* the block cache off and then on; the two columns differ from each
+* other, as a step of the cache also runs the opcodes that take no
+* cycles after an instruction.
+*
+* nesflags [programs] [instructions]	Defaults 200 and 20000
+*/
+#include "bus.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+static uint64_t fnv(uint64_t inHash, uint64_t inValue)
+{
+	for (int i = 0; i < 8; i++) {
+		inHash = (inHash ^ (inValue & 0xFF)) * 1099511628211ULL;
+		inValue >>= 8;
+	}
+	return inHash;
+}
+
+// xorshift64, so both builds see the same programs
+static uint64_t next_random(uint64_t& ioState)
+{
+	ioState ^= ioState << 13;
+	ioState ^= ioState >> 7;
+	ioState ^= ioState << 17;
+	return ioState;
+}
+
+static uint64_t run_program(uint64_t inSeed, uint64_t inInstructions, bool inBlocks)
+{
+	std::unique_ptr<bus> nBUS(new bus());
+	cpu& cCPU = nBUS->cCPU;
+	nBUS->enable_block_cache(inBlocks);
+
+	// 64KB of random bytes, registers and flags included
+	uint64_t random = inSeed;
+	for (uint32_t addr = 0; addr <= MAXRAMSIZE; addr++) {
+		nBUS->write((uint16_t)addr, (uint8_t)next_random(random));
+	}
+	cCPU.PC = (uint16_t)next_random(random);
+	cCPU.A = (uint8_t)next_random(random);
+	cCPU.X = (uint8_t)next_random(random);
+	cCPU.Y = (uint8_t)next_random(random);
+	cCPU.set_flags((uint8_t)next_random(random));
+
+	uint64_t hash = 1469598103934665603ULL;
+	for (uint64_t i = 0; i < inInstructions; i++) {
+		if (nBUS->cBLOCKS) {
+			cCPU.run_blocks(*nBUS->cBLOCKS, cCPU.total_cycles + 1);
+		}
+		else {
+			cCPU.clock();
+		}
+		hash = fnv(hash, cCPU.PC | (uint64_t)cCPU.A << 16 | (uint64_t)cCPU.X << 24 | (uint64_t)cCPU.Y << 32 | (uint64_t)cCPU.flags() << 40);
+		hash = fnv(hash, cCPU.total_cycles);
+	}
+
+	std::vector<uint8_t> state;
+	nBUS->save_state(state);
+	for (uint8_t byte : state) {
+		hash = fnv(hash, byte);
+	}
+	return hash;
+}
+
+int main(int argc, char** argv)
+{
+	uint64_t programs = argc > 1 ? strtoull(argv[1], nullptr, 0) : 200;
+	uint64_t instructions = argc > 2 ? strtoull(argv[2], nullptr, 0) : 20000;
+
+	for (uint64_t program = 0; program < programs; program++) {
+		uint64_t seed = 0x9E3779B97F4A7C15ULL * (program + 1);
+		printf("%4llu %016llx %016llx\n", (unsigned long long)program,
+			(unsigned long long)run_program(seed, instructions, false), (unsigned long long)run_program(seed, instructions, true));
+	}
+	return 0;
+}
@@ -0,0 +1,184 @@
+/*
+* neslockstep
+* ---
+* Runs the same program on many lanes twice, once as independent buses
+* stepped one after the other and once through the lockstep engine, and
+* reports the aggregate instructions per second of both. The final
+* registers, cycle counts and memory of every lane are compared, any
+* difference fails the run.
+*
+* neslockstep [options]
+*	--lanes <n>		Lanes (default 64)
+*	--rounds <n>	Instructions run per lane (default 200000)
+*	--runs <n>		Timed runs, the fastest is kept (default 3)
+*	--load <file>	Raw 64KB image to run on every lane instead of the built in loop
+*	--start <addr>	Where a loaded image starts (default 0x0400)
+*
+* The built in loop mixes arithmetic, shifts, transfers, stores and a
+* read-modify-write on a per lane seed at $10, so the lanes branch apart
+* and back together. Like a cartridge it runs from one ROM page all lanes
+* share, a loaded image is copied into the RAM of every lane.
+*/
+#include "bus.h"
+#include "lockstep.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+static const uint16_t CODE_START = 0x8000;
+
+static const uint8_t workload[0x100] = {
+	0xA5, 0x10,			// LDA $10
+	0xA2, 0x00,			// LDX #$00
+	0x18,				// loop: CLC
+	0x69, 0x07,			// ADC #$07
+	0x49, 0x5A,			// EOR #$5A
+	0x0A,				// ASL A
+	0xAA,				// TAX
+	0xE8,				// INX
+	0xE0, 0x80,			// CPX #$80
+	0x90, 0x03,			// BCC skip
+	0xE9, 0x03,			// SBC #$03
+	0x4A,				// LSR A
+	0x29, 0x7F,			// skip: AND #$7F
+	0x09, 0x01,			// ORA #$01
+	0x95, 0x20,			// STA $20,X
+	0xA8,				// TAY
+	0x88,				// DEY
+	0x6A,				// ROR A
+	0x2A,				// ROL A
+	0xC9, 0x40,			// CMP #$40
+	0xB0, 0x02,			// BCS store
+	0x65, 0x11,			// ADC $11
+	0x85, 0x10,			// store: STA $10
+	0xE6, 0x11,			// INC $11
+	0x8A,				// TXA
+	0x98,				// TYA
+	0x4C, 0x04, 0x80,	// JMP loop
+};
+
+static std::shared_ptr<const mapped_file> image;
+static uint16_t image_start = 0x0400;
+
+static void setup_lane(bus& nBUS, size_t inLane)
+{
+	if (image) {
+		for (size_t i = 0; i < image->size() && i <= MAXRAMSIZE; i++) {
+			nBUS.write((uint16_t)i, image->data()[i]);
+		}
+		nBUS.cCPU.PC = image_start;
+		return;
+	}
+
+	nBUS.map_rom(CODE_START >> 8, 1, workload, sizeof(workload));
+	nBUS.write(0x10, (uint8_t)(inLane * 37));
+	nBUS.cCPU.PC = CODE_START;
+}
+
+static bool same_lane(bus& inA, bus& inB)
+{
+	const cpu& a = inA.cCPU;
+	const cpu& b = inB.cCPU;
+	if (a.A != b.A || a.X != b.X || a.Y != b.Y || a.flags() != b.flags() || a.PC != b.PC
+		|| a.new_SP.ptr != b.new_SP.ptr || a.total_cycles != b.total_cycles) {
+		return false;
+	}
+	for (uint32_t addr = 0; addr <= 0xFFFF; addr++) {
+		if (inA.peek((uint16_t)addr) != inB.peek((uint16_t)addr)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void usage()
+{
+	printf("usage: neslockstep [--lanes n] [--rounds n] [--runs n] [--load file] [--start addr]\n");
+}
+
+int main(int argc, char** argv)
+{
+	size_t lanes = 64;
+	uint64_t rounds = 200000;
+	int runs = 3;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			usage();
+			return 2;
+		}
+		const char* value = argv[++i];
+
+		if (arg == "--lanes") { lanes = std::max(1ULL, strtoull(value, nullptr, 0)); }
+		else if (arg == "--rounds") { rounds = std::max(1ULL, strtoull(value, nullptr, 0)); }
+		else if (arg == "--runs") { runs = std::max(1, atoi(value)); }
+		else if (arg == "--load") {
+			image = mapped_file::open(value);
+			if (!image) {
+				printf("Could not open %s\n", value);
+				return 2;
+			}
+		}
+		else if (arg == "--start") { image_start = (uint16_t)strtoul(value, nullptr, 0); }
+		else {
+			usage();
+			return 2;
+		}
+	}
+
+	double scalar_best = 0;
+	double lockstep_best = 0;
+	double vector_share = 0;
+	bool match = true;
+
+	for (int run = 0; run < runs; run++) {
+		std::vector<std::unique_ptr<bus>> scalar;
+		for (size_t i = 0; i < lanes; i++) {
+			scalar.emplace_back(new bus());
+			setup_lane(*scalar.back(), i);
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		for (std::unique_ptr<bus>& nBUS : scalar) {
+			for (uint64_t r = 0; r < rounds; r++) {
+				nBUS->step();
+			}
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		scalar_best = std::max(scalar_best, lanes * rounds / seconds);
+
+		lockstep engine(lanes);
+		for (size_t i = 0; i < lanes; i++) {
+			setup_lane(engine.lane(i), i);
+		}
+
+		start = std::chrono::steady_clock::now();
+		engine.start();
+		engine.run(rounds);
+		engine.finish();
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		lockstep_best = std::max(lockstep_best, lanes * rounds / seconds);
+		vector_share = (double)engine.vector_instructions / (engine.vector_instructions + engine.scalar_instructions);
+
+		for (size_t i = 0; i < lanes; i++) {
+			if (!same_lane(*scalar[i], engine.lane(i))) {
+				printf("lane %zu differs from its scalar run\n", i);
+				match = false;
+			}
+		}
+	}
+
+	printf("%zu lanes, %llu instructions each, vector ops: %s\n", lanes, (unsigned long long)rounds, lockstep::isa());
+	printf("scalar    %10.2f M instructions/s\n", scalar_best / 1e6);
+	printf("lockstep  %10.2f M instructions/s  (%.1f%% in vector groups)\n", lockstep_best / 1e6, vector_share * 100);
+	printf("speedup   %10.2fx\n", lockstep_best / scalar_best);
+	printf("%s\n", match ? "final states match" : "FINAL STATES DIFFER");
+
+	return match ? 0 : 1;
+}
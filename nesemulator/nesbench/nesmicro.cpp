@@ -0,0 +1,227 @@
+/*
+* nesmicro
+* ---
+* Per opcode microbenchmarks. For every opcode in cpu::opcode_table a
+* block of copies of just that instruction is written into a fresh bus,
+* followed by a JMP back to the start, and timed in isolation.
+*
+* nesmicro [options]
+*	--instructions <n>	Instructions timed per opcode and repeat (default 500000)
+*	--repeat <n>		Repeats per opcode, the fastest is kept (default 5)
+*	--out <file>		Write the results as a baseline file
+*	--compare <file>	Compare against a baseline, exit 1 on a regression
+*	--threshold <pct>	Slowdown allowed before compare fails (default 10)
+*/
+#include "bus.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+* Memory layout of the synthesised loops
+* ---
+* Zero page is filled with $03 so every indirect pointer reads $0303, and
+* absolute operands point at $0310. Indexing by X or Y reaches at most
+* $0402, well clear of the code at $0800. The stack page is filled with
+* $08, so wherever the stack pointer has wrapped to, RTI pulls a valid
+* frame: P = $08 and a return to the copy at $0808.
+*/
+static const uint16_t CODE_START = 0x0800;
+static const uint16_t DATA_ADDR = 0x0310;
+static const uint8_t ZP_ADDR = 0x10;
+static const int BLOCK_COPIES = 200;
+
+static const char* mode_name(cpu::mode m)
+{
+	static const char* const names[] = {
+		"none", "acc", "abs", "absx", "absy", "imm", "impl",
+		"ind", "xind", "yind", "rel", "zpg", "zpgx", "zpgy"
+	};
+	return names[(uint8_t)m];
+}
+
+/*
+* Write BLOCK_COPIES of the opcode followed by JMP CODE_START
+*/
+static void build_loop(bus& nBUS, uint8_t opcode)
+{
+	const cpu::opcode_info& info = cpu::opcode_table[opcode];
+
+	for (uint32_t addr = 0x0000; addr < 0x0100; addr++) {
+		nBUS.write(addr, 0x03);
+	}
+	for (uint32_t addr = 0x0100; addr < 0x0200; addr++) {
+		nBUS.write(addr, 0x08);
+	}
+	// JMP ($0300) and the BRK vector both lead back to the start
+	nBUS.write(0x0300, CODE_START & 0xFF);
+	nBUS.write(0x0301, CODE_START >> 8);
+	nBUS.write(0xFFFE, CODE_START & 0xFF);
+	nBUS.write(0xFFFF, CODE_START >> 8);
+
+	uint16_t WritePtr = CODE_START;
+	for (int i = 0; i < BLOCK_COPIES; i++) {
+		uint16_t next = WritePtr + info.bytes;
+		uint16_t operand = 0;
+
+		switch (info.addressing) {
+		case cpu::mode::imm:	operand = 0x55; break;
+		case cpu::mode::zpg:
+		case cpu::mode::zpgx:
+		case cpu::mode::zpgy:
+		case cpu::mode::xind:
+		case cpu::mode::yind:	operand = ZP_ADDR; break;
+		case cpu::mode::abs:
+		case cpu::mode::absx:
+		case cpu::mode::absy:	operand = DATA_ADDR; break;
+		case cpu::mode::ind:	operand = 0x0300; break;
+		case cpu::mode::rel:	operand = 0x00; break;	// Taken or not, lands on the next copy
+		default: break;
+		}
+		// JMP and JSR chain into the next copy instead of leaving the block
+		if (info.operation == cpu::op::JMP && info.addressing == cpu::mode::abs) { operand = next; }
+		if (info.operation == cpu::op::JSR) { operand = next; }
+
+		nBUS.write(WritePtr++, opcode);
+		if (info.bytes >= 2) { nBUS.write(WritePtr++, operand & 0xFF); }
+		if (info.bytes >= 3) { nBUS.write(WritePtr++, operand >> 8); }
+	}
+
+	nBUS.write(WritePtr++, 0x4C);
+	nBUS.write(WritePtr++, CODE_START & 0xFF);
+	nBUS.write(WritePtr++, CODE_START >> 8);
+}
+
+static double time_opcode(uint8_t opcode, uint64_t instructions, int repeat)
+{
+	double best = 0;
+
+	for (int r = 0; r < repeat; r++) {
+		std::unique_ptr<bus> nBUS(new bus());
+		build_loop(*nBUS, opcode);
+		nBUS->cCPU.PC = CODE_START;
+
+		auto start = std::chrono::steady_clock::now();
+		for (uint64_t i = 0; i < instructions; i++) {
+			nBUS->cCPU.clock();
+		}
+		double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / instructions;
+
+		if (r == 0 || ns < best) {
+			best = ns;
+		}
+	}
+	return best;
+}
+
+/*
+* Baseline file: one "opcode,mnemonic,mode,ns" line per opcode
+*/
+static bool read_baseline(const char* path, std::map<int, double>& out)
+{
+	std::ifstream file(path);
+	if (!file) {
+		return false;
+	}
+
+	std::string line;
+	while (std::getline(file, line)) {
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+		std::stringstream fields(line);
+		std::string opcode, mnemonic, mode, ns;
+		if (std::getline(fields, opcode, ',') && std::getline(fields, mnemonic, ',') &&
+			std::getline(fields, mode, ',') && std::getline(fields, ns, ',')) {
+			out[(int)strtol(opcode.c_str(), nullptr, 16)] = strtod(ns.c_str(), nullptr);
+		}
+	}
+	return true;
+}
+
+static void usage()
+{
+	printf("usage: nesmicro [--instructions n] [--repeat n] [--out file] [--compare file] [--threshold pct]\n");
+}
+
+int main(int argc, char** argv)
+{
+	uint64_t instructions = 500000;
+	int repeat = 5;
+	const char* out_path = nullptr;
+	const char* compare_path = nullptr;
+	double threshold = 10.0;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			usage();
+			return 2;
+		}
+		const char* value = argv[++i];
+
+		if (arg == "--instructions") { instructions = std::max(1ULL, strtoull(value, nullptr, 0)); }
+		else if (arg == "--repeat") { repeat = std::max(1, atoi(value)); }
+		else if (arg == "--out") { out_path = value; }
+		else if (arg == "--compare") { compare_path = value; }
+		else if (arg == "--threshold") { threshold = strtod(value, nullptr); }
+		else {
+			usage();
+			return 2;
+		}
+	}
+
+	std::map<int, double> baseline;
+	if (compare_path && !read_baseline(compare_path, baseline)) {
+		printf("Could not read baseline %s\n", compare_path);
+		return 2;
+	}
+
+	std::ofstream out;
+	if (out_path) {
+		out.open(out_path);
+		out << "# opcode,mnemonic,mode,ns_per_instruction\n";
+	}
+
+	int regressions = 0;
+	for (int opcode = 0; opcode < 0x100; opcode++) {
+		const cpu::opcode_info& info = cpu::opcode_table[opcode];
+		if (info.operation == cpu::op::none) {
+			continue;
+		}
+
+		double ns = time_opcode((uint8_t)opcode, instructions, repeat);
+		const char* mnemonic = cpu::mnemonic(info.operation);
+		printf("%02X  %s %-5s %8.2f ns", opcode, mnemonic, mode_name(info.addressing), ns);
+
+		auto base = baseline.find(opcode);
+		if (base != baseline.end() && base->second > 0) {
+			double change = (ns - base->second) / base->second * 100.0;
+			printf("  %+7.1f%%", change);
+			if (change > threshold) {
+				printf("  REGRESSION");
+				regressions++;
+			}
+		}
+		printf("\n");
+
+		if (out_path) {
+			char line[64];
+			snprintf(line, sizeof(line), "%02X,%s,%s,%.3f\n", opcode, mnemonic, mode_name(info.addressing), ns);
+			out << line;
+		}
+	}
+
+	if (compare_path) {
+		printf("%d opcode(s) slower than baseline by more than %.1f%%\n", regressions, threshold);
+	}
+	return regressions > 0 ? 1 : 0;
+}
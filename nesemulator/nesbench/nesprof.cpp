@@ -0,0 +1,147 @@
+/*
+* nesprof
+* ---
+* Runs an iNES file or a raw 6502 binary with the instruction profiler
+* on and prints where the emulated cycles went: the hottest PCs,
+* opcodes and subroutines, the last aggregated over every call stack
+* they ran in. Needs nescore built with NES_PROFILE. A saved profile
+* can be read back without one.
+*
+* nesprof [options] <program>
+* nesprof --read <dump> [--top n] [--folded file]
+*	--cycles <n>		Cycles to run (default 100000000)
+*	--start <addr>		PC raw binaries start from (default 0x0400)
+*	--top <n>			Entries per table (default 20)
+*	--dump <file>		Save the profile, for --read later
+*	--folded <file>		Write folded call stacks for flamegraph.pl
+*	--read <file>		Report on a saved profile instead of running anything
+*/
+#include "bus.h"
+#include "profiler.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+
+static void usage()
+{
+	printf("usage: nesprof [--cycles n] [--start addr] [--top n] [--dump file] [--folded file] <program>\n");
+	printf("       nesprof --read <dump> [--top n] [--folded file]\n");
+}
+
+#ifdef NES_PROFILE
+static bool run_profile(const char* inPath, uint64_t inCycles, uint16_t inStart, std::ostream& out)
+{
+	std::shared_ptr<const mapped_file> file = mapped_file::open(inPath);
+	if (!file) {
+		printf("Could not open %s\n", inPath);
+		return false;
+	}
+
+	std::unique_ptr<bus> nBUS(new bus());
+	if (rom::is_ines(file->data(), file->size())) {
+		std::string error;
+		std::shared_ptr<const rom> cartridge = rom::load(inPath, &error);
+		if (!cartridge) {
+			printf("%s: %s\n", inPath, error.c_str());
+			return false;
+		}
+		if (!nBUS->insert_cartridge(cartridge)) {
+			printf("%s: mapper %u with %u KB PRG and %u KB CHR is not supported\n", inPath, cartridge->mapper,
+				cartridge->prg_size / 1024, cartridge->chr_size / 1024);
+			return false;
+		}
+	}
+	else {
+		for (size_t i = 0; i < file->size() && i <= MAXRAMSIZE; i++) {
+			nBUS->write((uint16_t)i, file->data()[i]);
+		}
+		nBUS->cCPU.PC = inStart;
+	}
+
+	nBUS->cCPU.profile.enable();
+	nBUS->run(inCycles);
+	nBUS->cCPU.profile.dump(out);
+	return true;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+	const char* path = nullptr;
+	const char* read_path = nullptr;
+	const char* dump_path = nullptr;
+	const char* folded_path = nullptr;
+	uint64_t cycles = 100000000;
+	uint16_t start = 0x0400;
+	size_t top = 20;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg[0] != '-') {
+			path = argv[i];
+			continue;
+		}
+		if (i + 1 >= argc) {
+			usage();
+			return 2;
+		}
+		const char* value = argv[++i];
+
+		if (arg == "--cycles") { cycles = strtoull(value, nullptr, 0); }
+		else if (arg == "--start") { start = (uint16_t)strtoul(value, nullptr, 0); }
+		else if (arg == "--top") { top = (size_t)strtoull(value, nullptr, 0); }
+		else if (arg == "--dump") { dump_path = value; }
+		else if (arg == "--folded") { folded_path = value; }
+		else if (arg == "--read") { read_path = value; }
+		else {
+			usage();
+			return 2;
+		}
+	}
+
+	// The profile goes through its dump form either way, so both paths report the same
+	std::stringstream profile;
+	if (read_path) {
+		std::ifstream in(read_path, std::ios::binary);
+		profile << in.rdbuf();
+	}
+	else if (path) {
+#ifdef NES_PROFILE
+		if (!run_profile(path, cycles, start, profile)) {
+			return 1;
+		}
+#else
+		(void)cycles;
+		(void)start;
+		printf("nesprof needs nescore built with NES_PROFILE to run programs\n");
+		return 2;
+#endif
+	}
+	else {
+		usage();
+		return 2;
+	}
+
+	if (dump_path) {
+		std::ofstream out(dump_path, std::ios::binary);
+		out << profile.str();
+	}
+
+	if (!profiler::report(profile, std::cout, top)) {
+		printf("Not a profile dump\n");
+		return 1;
+	}
+
+	if (folded_path) {
+		profile.clear();
+		profile.seekg(0);
+		std::ofstream out(folded_path);
+		profiler::folded(profile, out);
+	}
+	return 0;
+}
@@ -0,0 +1,9 @@
+# Run FIRST and SECOND and fail unless both succeed with the same output
+execute_process(COMMAND ${FIRST} OUTPUT_VARIABLE first_output RESULT_VARIABLE first_result)
+execute_process(COMMAND ${SECOND} OUTPUT_VARIABLE second_output RESULT_VARIABLE second_result)
+if(NOT first_result EQUAL 0 OR NOT second_result EQUAL 0)
+	message(FATAL_ERROR "${FIRST} exited with ${first_result}, ${SECOND} with ${second_result}")
+endif()
+if(NOT first_output STREQUAL second_output)
+	message(FATAL_ERROR "${FIRST} and ${SECOND} printed different output:\n${first_output}\n---\n${second_output}")
+endif()
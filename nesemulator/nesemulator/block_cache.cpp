@@ -0,0 +1,194 @@
+#include "block_cache.h"
+#include "bus.h"
+
+#include <algorithm>
+
+/*
+* Instructions after which PC may not be the next instruction's
+*/
+static bool ends_block(cpu::op inOp)
+{
+	switch (inOp) {
+	case cpu::op::BPL: case cpu::op::BMI: case cpu::op::BVC: case cpu::op::BVS:
+	case cpu::op::BCC: case cpu::op::BCS: case cpu::op::BNE: case cpu::op::BEQ:
+	case cpu::op::JMP: case cpu::op::JSR: case cpu::op::RTS: case cpu::op::RTI:
+	case cpu::op::BRK:
+		return true;
+	default:
+		return false;
+	}
+}
+
+block_cache::block_cache(bus* inBus)
+	: cBUS(inBus), index(0x10000, 0)
+{
+}
+
+const block_cache::block* block_cache::build(uint16_t inPC)
+{
+	// Only plain memory is decoded, code behind a device stays on the bus path
+	uint8_t page_number = inPC >> 8;
+	const uint8_t* page = cBUS->read_pages[page_number];
+
+	uint32_t slot;
+	if (free_blocks.empty()) {
+		blocks.emplace_back();
+		slot = (uint32_t)blocks.size();
+	}
+	else {
+		slot = free_blocks.back();
+		free_blocks.pop_back();
+	}
+	block& decoded = blocks[slot - 1];
+	decoded.entries.clear();
+
+	uint32_t offset = inPC & 0xFF;
+	while (page && decoded.entries.size() < max_length) {
+		uint8_t opcode = page[offset];
+		const cpu::opcode_info& info = cpu::opcode_table[opcode];
+		if (info.operation == cpu::op::none || offset + info.bytes > 0x100) {
+			break;
+		}
+
+		uint16_t operand = 0;
+		if (info.bytes > 1) {
+			operand = page[offset + 1];
+		}
+		if (info.bytes > 2) {
+			operand |= page[offset + 2] << 8;
+		}
+		decoded.entries.push_back({ cpu::handler_for(opcode), (uint16_t)((page_number << 8) | offset), operand, opcode });
+
+		offset += info.bytes;
+		if (ends_block(info.operation) || offset == 0x100) {
+			break;
+		}
+	}
+
+	if (decoded.entries.empty()) {
+		free_blocks.push_back(slot);
+		index[inPC] = uncacheable;
+		return nullptr;
+	}
+
+	if (pairs.empty()) {
+		fuse(decoded);
+	}
+	decoded.idle = is_idle_loop(decoded);
+
+	misses++;
+	index[inPC] = slot;
+	cBUS->protect_code(page_number);
+	return &decoded;
+}
+
+void block_cache::fuse(block& ioBlock)
+{
+	uint8_t opcodes[max_length];
+	uint32_t count = (uint32_t)ioBlock.entries.size();
+	for (uint32_t i = 0; i < count; i++) {
+		opcodes[i] = ioBlock.entries[i].opcode;
+	}
+
+	// Sequences don't overlap, the entries a sequence covers keep their own handlers
+	for (uint32_t i = 0; i < count;) {
+		uint32_t length = 1;
+		cpu::decoded_handler run = cpu::fused_handler(opcodes + i, count - i, length);
+		if (run) {
+			ioBlock.entries[i].run = run;
+			fused++;
+		}
+		i += length;
+	}
+}
+
+/*
+* Idle loops
+* - Loads, compares, logic and arithmetic on registers and flags, reading
+*	only pages of plain memory, then a branch or JMP back to the first
+*	instruction. Whether an iteration really leaves the registers as it
+*	found them is checked when it runs
+*/
+bool block_cache::is_idle_loop(const block& inBlock) const
+{
+	const entry& last = inBlock.entries.back();
+	const cpu::opcode_info& jump = cpu::opcode_table[last.opcode];
+	uint16_t start = inBlock.entries.front().pc;
+	if (jump.addressing == cpu::mode::rel) {
+		if ((uint16_t)(last.pc + 2 + (int8_t)last.operand) != start) {
+			return false;
+		}
+	}
+	else if (last.opcode != 0x4C || last.operand != start) {	// JMP abs
+		return false;
+	}
+
+	for (size_t i = 0; i + 1 < inBlock.entries.size(); i++) {
+		const entry& next = inBlock.entries[i];
+		const cpu::opcode_info& info = cpu::opcode_table[next.opcode];
+		switch (info.operation) {
+		case cpu::op::LDA: case cpu::op::LDX: case cpu::op::LDY:
+		case cpu::op::CMP: case cpu::op::CPX: case cpu::op::CPY:
+		case cpu::op::BIT: case cpu::op::AND: case cpu::op::ORA: case cpu::op::EOR:
+		case cpu::op::ADC: case cpu::op::SBC:
+		case cpu::op::TAX: case cpu::op::TAY: case cpu::op::TXA: case cpu::op::TYA:
+		case cpu::op::CLC: case cpu::op::SEC: case cpu::op::CLV: case cpu::op::CLD: case cpu::op::SED:
+		case cpu::op::NOP:
+			break;
+		case cpu::op::ASL: case cpu::op::LSR: case cpu::op::ROL: case cpu::op::ROR:
+			if (info.addressing != cpu::mode::acc) {
+				return false;
+			}
+			break;
+		default:
+			return false;
+		}
+
+		// Devices may change what they read as, or change state by being read
+		uint8_t page = next.operand >> 8;
+		switch (info.addressing) {
+		case cpu::mode::zpg: case cpu::mode::zpgx: case cpu::mode::zpgy: case cpu::mode::abs:
+			if (!cBUS->read_pages[page]) {
+				return false;
+			}
+			break;
+		case cpu::mode::absx: case cpu::mode::absy:
+			if (!cBUS->read_pages[page] || !cBUS->read_pages[(uint8_t)(page + 1)]) {
+				return false;
+			}
+			break;
+		case cpu::mode::imm: case cpu::mode::impl: case cpu::mode::acc:
+			break;
+		default:
+			return false;
+		}
+	}
+	return true;
+}
+
+void block_cache::invalidate(uint8_t inPage)
+{
+	uint32_t* slots = &index[inPage << 8];
+	for (uint32_t i = 0; i < 0x100; i++) {
+		if (slots[i] && slots[i] != uncacheable) {
+			free_blocks.push_back(slots[i]);
+			invalidations++;
+		}
+		slots[i] = 0;
+	}
+	generation++;
+}
+
+void block_cache::clear()
+{
+	for (uint32_t page = 0; page < 0x100; page++) {
+		invalidate((uint8_t)page);
+	}
+}
+
+void block_cache::record_pairs(bool inRecord)
+{
+	pairs.assign(inRecord ? 0x10000 : 0, 0);
+	last_opcode = 0;
+	clear();
+}
@@ -0,0 +1,109 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "cpu.h"
+
+class bus;
+
+/*
+* Decoded block cache
+* ---
+* Runs of predecoded instructions keyed by the PC they start at. Each
+* entry holds the opcode's decoded handler, which takes its operand
+* from the entry instead of reading it through the bus, with the operand
+* bytes already assembled. A block ends after the first instruction
+* that can change PC (branches, jumps, calls, returns, BRK), before an
+* instruction that runs into the next page and at max_length.
+*
+* Where a block holds one of the cpu's superinstruction sequences the
+* first entry gets the fused handler, which runs the whole sequence in
+* one dispatch. The later entries keep their own handlers for when the
+* sequence stops part way. While the pair histogram is being recorded
+* nothing is fused, so every opcode pair executed is counted.
+*
+* A block that branches back to its own start and only reads plain
+* memory and changes registers is marked idle, e.g. a game polling a RAM
+* flag its NMI handler sets, or jumping to itself. Nothing outside the
+* cpu can change what it reads until the next event, so once an
+* iteration ends with the registers it started with, every iteration
+* after it is the same. run_blocks then skips the whole iterations left
+* before the event and charges their cycles.
+*
+* Blocks never span a page, so invalidation is per page: remapping a
+* page or writing to one the cache decoded code from drops every block
+* that starts in it. The bus write protects pages the cache read code
+* from, so checking for code costs plain memory writes nothing.
+*/
+class block_cache
+{
+public:
+	using entry = cpu::decoded;
+
+	struct block {
+		std::vector<entry> entries;
+		bool idle = false;	// Side effect free loop back to the block's start
+	};
+
+	static constexpr uint32_t max_length = 32;
+
+private:
+	bus* cBUS;
+	std::vector<block> blocks;
+	std::vector<uint32_t> free_blocks;
+	std::vector<uint32_t> index;	// Per PC: block + 1, 0 when not decoded yet, uncacheable otherwise
+	static constexpr uint32_t uncacheable = UINT32_MAX;
+
+	std::vector<uint64_t> pairs;	// Per opcode pair, first << 8 | second, empty when not recording
+	uint8_t last_opcode = 0;
+
+	const block* build(uint16_t inPC);
+	void fuse(block& ioBlock);
+	bool is_idle_loop(const block& inBlock) const;
+
+public:
+	explicit block_cache(bus*);
+
+	// Block starting at inPC, decoded on a miss. nullptr if the code there can't be cached
+	inline const block* find(uint16_t inPC)
+	{
+		uint32_t slot = index[inPC];
+		if (slot && slot != uncacheable) {
+			hits++;
+			return &blocks[slot - 1];
+		}
+		return slot ? nullptr : build(inPC);
+	}
+
+	// Drop every block starting in the page
+	void invalidate(uint8_t inPage);
+	void clear();
+
+	/*
+	* Pair histogram
+	* - Counts of every two opcodes executed one after the other, the
+	*	profile superinstructions are picked from. Turning it on or off
+	*	drops all blocks, so they are rebuilt with or without fusing
+	*/
+	void record_pairs(bool inRecord);
+	inline void count_pair(uint8_t inOpcode)
+	{
+		if (!pairs.empty()) {
+			pairs[last_opcode << 8 | inOpcode]++;
+			last_opcode = inOpcode;
+		}
+	}
+	uint64_t pair_count(uint8_t inFirst, uint8_t inSecond) const { return pairs.empty() ? 0 : pairs[inFirst << 8 | inSecond]; }
+
+	uint32_t generation = 0;	// Bumped whenever blocks are dropped, a running block stops there
+
+	uint64_t hits = 0;
+	uint64_t misses = 0;			// Blocks decoded
+	uint64_t invalidations = 0;		// Blocks dropped
+	uint64_t instructions = 0;		// Run from blocks
+	uint64_t fused = 0;				// Superinstructions placed in blocks
+	uint64_t dispatches = 0;		// Handler calls running those instructions
+
+	bool skip_idle = true;			// Fast forward idle blocks to the next event
+	uint64_t idle_skips = 0;
+	uint64_t idle_cycles = 0;		// Cycles charged without running them
+};
@@ -1,3 +1,503 @@
 #include "bus.h"
+#include "block_cache.h"
+#include "mapper.h"
 
-bus::bus() : cCPU(this), cRAM() { }
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iterator>
+
+bus::bus() : cCPU(this), cRAM(), cPPU(this)
+{
+	// Until something else is mapped the whole address space is flat RAM
+	add_region(cRAM.data(), MAXRAMSIZE + 1);
+	map_memory(0x00, 0x100, cRAM.data(), MAXRAMSIZE + 1);
+	reschedule();
+}
+
+bus::~bus()
+{
+	// cPPU outlives the cartridge, a render thread has to finish drawing from its pattern memory first
+	cPPU.enable_render_thread(false);
+}
+
+bool bus::insert_cartridge(std::shared_ptr<const rom> inCartridge)
+{
+	std::unique_ptr<mapper> newMapper = mapper::create(this, inCartridge);
+	if (!newMapper) {
+		return false;
+	}
+	// A render thread may still be drawing from the old cartridge's pattern memory
+	cPPU.flush();
+	cartridge = std::move(inCartridge);
+	cMAPPER = std::move(newMapper);
+
+	regions.clear();
+	dirty_flags.clear();
+	memset(dirty_pages, 0, sizeof(dirty_pages));
+	base_snapshot = 0;
+	add_region(cRAM.data(), 0x800);
+	add_region(cPPU.vram, sizeof(cPPU.vram), false);
+	add_region(cPPU.oam, sizeof(cPPU.oam), false);
+	add_region(cPPU.palette, sizeof(cPPU.palette), false);
+	cMAPPER->add_regions();
+
+	// Internal RAM lives in cRAM, the mapper maps PRG-RAM and PRG-ROM
+	unmap(0x00, 0x100);
+	map_memory(0x00, 0x20, cRAM.data(), 0x800);
+	map_device(0x20, 0x20, &cPPU);
+	map_device(0x40, 0x01, &cPPU);
+	cMAPPER->reset();
+
+	cPPU.reset();
+	if (std::find(components.begin(), components.end(), &cPPU) == components.end()) {
+		attach(&cPPU);
+	}
+	cPPU.synced_cycle = cCPU.total_cycles;
+
+	cCPU.PC = (uint16_t)read(0xFFFC) | ((uint16_t)read(0xFFFD) << 8);
+	return true;
+}
+
+void bus::attach(clocked_device* inDevice)
+{
+	inDevice->synced_cycle = cCPU.total_cycles;
+	components.push_back(inDevice);
+	reschedule();
+}
+
+void bus::catch_up_all()
+{
+	for (clocked_device* component : components) {
+		catch_up(*component);
+	}
+}
+
+void bus::schedule_nmi(uint64_t inCycle)
+{
+	nmi_cycle = inCycle;
+	next_event = std::min(next_event, std::max(inCycle, cCPU.total_cycles));
+}
+
+void bus::cancel_nmi()
+{
+	nmi_cycle = UINT64_MAX;
+}
+
+void bus::set_irq(irq_source inSource, uint64_t inCycle)
+{
+	irq_cycles[(size_t)inSource] = inCycle;
+	irq_cycle = std::min(irq_cycle, inCycle);
+	if (cCPU.irq_enabled()) {
+		next_event = std::min(next_event, std::max(inCycle, cCPU.total_cycles));
+	}
+}
+
+void bus::clear_irq(irq_source inSource)
+{
+	irq_cycles[(size_t)inSource] = UINT64_MAX;
+	irq_cycle = *std::min_element(std::begin(irq_cycles), std::end(irq_cycles));
+}
+
+void bus::reschedule()
+{
+	next_event = std::min({ frame_end, nmi_cycle, run_end });
+	if (cCPU.irq_enabled()) {
+		next_event = std::min(next_event, irq_cycle);
+	}
+	for (clocked_device* component : components) {
+		next_event = std::min(next_event, component->next_sync());
+	}
+
+	// An event that is already due is handled after the next instruction
+	next_event = std::max(next_event, cCPU.total_cycles + 1);
+}
+
+void bus::run(uint64_t inCycles)
+{
+	// The end of the run is just another event, so the inner loop has one comparison
+	run_end = cCPU.total_cycles + inCycles;
+	next_event = std::min(next_event, run_end);
+
+	while (cCPU.total_cycles < run_end) {
+		if (cBLOCKS) {
+			cCPU.run_blocks(*cBLOCKS, next_event);
+		}
+		else {
+			while (cCPU.total_cycles < next_event) {
+				cCPU.clock();
+			}
+		}
+		service_events();
+	}
+	run_end = UINT64_MAX;
+}
+
+void bus::run_frame()
+{
+	uint64_t current = frame;
+	while (frame == current) {
+		run(frame_end > cCPU.total_cycles ? frame_end - cCPU.total_cycles : 1);
+	}
+}
+
+void bus::service_events()
+{
+	uint64_t now = cCPU.total_cycles;
+
+	if (now >= frame_end) {
+		catch_up_all();
+		frame++;
+		frame_end = ((frame + 1) * FRAME_DOTS + 2) / 3;
+	}
+	for (clocked_device* component : components) {
+		if (component->next_sync() <= now) {
+			catch_up(*component);
+		}
+	}
+
+	// NMI wins over IRQ, the IRQ stays held and is taken after the handler's RTI
+	if (nmi_cycle <= now) {
+		nmi_cycle = UINT64_MAX;
+		cCPU.nmi();
+	}
+	else if (irq_cycle <= now && cCPU.irq_enabled()) {
+		cCPU.irq();
+	}
+	reschedule();
+}
+
+void bus::add_region(uint8_t* inData, uint32_t inSize, bool inTracked)
+{
+	uint32_t first = (uint32_t)dirty_flags.size();
+	regions.push_back({ inData, inSize, first, inTracked });
+	dirty_flags.resize(first + (inSize + 0xFF) / 0x100, 1);
+}
+
+void bus::fold_dirty(uint8_t inPage)
+{
+	if (!dirty_pages[inPage]) {
+		return;
+	}
+	dirty_pages[inPage] = 0;
+
+	// A page the block cache protected since the write has its pointer parked
+	const uint8_t* ptr = write_pages[inPage] ? write_pages[inPage] : code_pages[inPage];
+	for (const memory_region& region : regions) {
+		if (ptr >= region.data && ptr < region.data + region.size) {
+			dirty_flags[region.first_page + (ptr - region.data) / 0x100] = 1;
+			return;
+		}
+	}
+}
+
+// True if any of the 8 flags at inFlags is set, lets the scans skip clean runs
+static inline bool any_of_8(const uint8_t* inFlags)
+{
+	uint64_t word;
+	memcpy(&word, inFlags, sizeof(word));
+	return word != 0;
+}
+
+void bus::fold_dirty()
+{
+	for (uint16_t page = 0; page < 0x100; page += 8) {
+		if (!any_of_8(dirty_pages + page)) {
+			continue;
+		}
+		for (uint16_t i = page; i < page + 8; i++) {
+			fold_dirty((uint8_t)i);
+		}
+	}
+}
+
+void bus::copy_dirty(const memory_region& inRegion, uint8_t* outDst, const uint8_t* inSrc)
+{
+	const uint8_t* flags = dirty_flags.data() + inRegion.first_page;
+	uint32_t pages = (inRegion.size + 0xFF) / 0x100;
+
+	for (uint32_t page = 0; page < pages; page++) {
+		if ((page & 7) == 0 && page + 8 <= pages && !any_of_8(flags + page)) {
+			page += 7;
+			continue;
+		}
+		if (flags[page]) {
+			uint32_t offset = page * 0x100;
+			memcpy(outDst + offset, inSrc + offset, std::min<uint32_t>(0x100, inRegion.size - offset));
+		}
+	}
+}
+
+void bus::map_memory(uint8_t inFirstPage, uint16_t inCount, uint8_t* inBase, uint32_t inSize)
+{
+	for (uint16_t i = 0; i < inCount && inFirstPage + i < 0x100; i++) {
+		uint8_t* ptr = inBase + ((i << 8) % inSize);
+
+		fold_dirty(inFirstPage + i);
+		release_code(inFirstPage + i);
+		read_pages[inFirstPage + i] = ptr;
+		write_pages[inFirstPage + i] = ptr;
+		devices[inFirstPage + i] = nullptr;
+	}
+}
+
+void bus::map_rom(uint8_t inFirstPage, uint16_t inCount, const uint8_t* inBase, uint32_t inSize, bus_device* inWrites)
+{
+	for (uint16_t i = 0; i < inCount && inFirstPage + i < 0x100; i++) {
+		const uint8_t* ptr = inBase + ((i << 8) % inSize);
+
+		// Bank switches rewrite whole windows, pages already showing the same bank keep their blocks
+		uint8_t page = (uint8_t)(inFirstPage + i);
+		if (read_pages[page] == ptr && !write_pages[page] && !code_pages[page] && devices[page] == inWrites) {
+			continue;
+		}
+		fold_dirty(page);
+		release_code(page);
+		read_pages[page] = ptr;
+		write_pages[page] = nullptr;
+		devices[page] = inWrites;
+	}
+}
+
+void bus::map_device(uint8_t inFirstPage, uint16_t inCount, bus_device* inDevice)
+{
+	for (uint16_t i = 0; i < inCount && inFirstPage + i < 0x100; i++) {
+		fold_dirty(inFirstPage + i);
+		release_code(inFirstPage + i);
+		read_pages[inFirstPage + i] = nullptr;
+		write_pages[inFirstPage + i] = nullptr;
+		devices[inFirstPage + i] = inDevice;
+	}
+}
+
+void bus::unmap(uint8_t inFirstPage, uint16_t inCount)
+{
+	map_device(inFirstPage, inCount, nullptr);
+}
+
+uint8_t bus::read_device(uint16_t inAddr)
+{
+	bus_device* device = devices[inAddr >> 8];
+	return device ? device->read(inAddr) : (uint8_t)(inAddr >> 8);
+}
+
+void bus::write_device(uint16_t inAddr, uint8_t inData)
+{
+	if (code_pages[inAddr >> 8]) {
+		write_code(inAddr, inData);
+		return;
+	}
+
+	bus_device* device = devices[inAddr >> 8];
+	if (device) {
+		device->write(inAddr, inData);
+	}
+}
+
+/*
+* Block cache
+*/
+void bus::enable_block_cache(bool inEnable)
+{
+	flush_code();
+	cBLOCKS.reset(inEnable ? new block_cache(this) : nullptr);
+}
+
+void bus::protect_code(uint8_t inPage)
+{
+	uint8_t* memory = write_pages[inPage];
+	if (!memory) {
+		return;
+	}
+	for (uint32_t page = 0; page < 0x100; page++) {
+		if (write_pages[page] == memory) {
+			code_pages[page] = memory;
+			write_pages[page] = nullptr;
+		}
+	}
+}
+
+void bus::release_code(uint8_t inPage)
+{
+	if (code_pages[inPage]) {
+		write_pages[inPage] = code_pages[inPage];
+		code_pages[inPage] = nullptr;
+	}
+	if (cBLOCKS) {
+		cBLOCKS->invalidate(inPage);
+	}
+}
+
+void bus::write_code(uint16_t inAddr, uint8_t inData)
+{
+	uint8_t* memory = code_pages[inAddr >> 8];
+	for (uint32_t page = 0; page < 0x100; page++) {
+		if (code_pages[page] == memory) {
+			release_code((uint8_t)page);
+		}
+	}
+	write(inAddr, inData);
+}
+
+void bus::flush_code()
+{
+	for (uint32_t page = 0; page < 0x100; page++) {
+		if (code_pages[page]) {
+			write_pages[page] = code_pages[page];
+			code_pages[page] = nullptr;
+		}
+	}
+	if (cBLOCKS) {
+		cBLOCKS->clear();
+	}
+}
+
+/*
+* Save states
+*/
+void bus::save_registers(state_writer& inState) const
+{
+	cCPU.save_state(inState);
+
+	inState.write(next_event);
+	inState.write(frame);
+	inState.write(frame_end);
+	inState.write(nmi_cycle);
+	inState.write(irq_cycles);
+	inState.write(irq_cycle);
+
+	cINPUT.save_state(inState);
+	if (cMAPPER) {
+		cMAPPER->save_state(inState);
+	}
+	for (const clocked_device* component : components) {
+		inState.write(component->synced_cycle);
+		component->save_state(inState);
+	}
+}
+
+void bus::load_registers(state_reader& inState)
+{
+	cCPU.load_state(inState);
+
+	inState.read(next_event);
+	inState.read(frame);
+	inState.read(frame_end);
+	inState.read(nmi_cycle);
+	inState.read(irq_cycles);
+	inState.read(irq_cycle);
+
+	cINPUT.load_state(inState);
+	if (cMAPPER) {
+		cMAPPER->load_state(inState);
+	}
+	for (clocked_device* component : components) {
+		inState.read(component->synced_cycle);
+		component->load_state(inState);
+	}
+}
+
+void bus::save(snapshot& outSnapshot)
+{
+	static std::atomic<uint64_t> next_id(1);
+
+	fold_dirty();
+	size_t total = dirty_flags.size() * 0x100;
+	bool incremental = outSnapshot.id && outSnapshot.id == base_snapshot && outSnapshot.memory.size() == total;
+	if (!incremental) {
+		outSnapshot.memory.assign(total, 0);
+	}
+	// A new id every save, so other buses that restored the old contents copy it whole
+	outSnapshot.id = next_id++;
+
+	for (const memory_region& region : regions) {
+		uint8_t* out = outSnapshot.memory.data() + (size_t)region.first_page * 0x100;
+		if (!incremental || !region.tracked) {
+			memcpy(out, region.data, region.size);
+		}
+		else {
+			copy_dirty(region, out, region.data);
+		}
+	}
+
+	outSnapshot.registers.clear();
+	state_writer registers(outSnapshot.registers);
+	save_registers(registers);
+
+	std::fill(dirty_flags.begin(), dirty_flags.end(), 0);
+	base_snapshot = outSnapshot.id;
+}
+
+bool bus::restore(const snapshot& inSnapshot)
+{
+	if (!inSnapshot.id || inSnapshot.memory.size() != dirty_flags.size() * 0x100) {
+		return false;
+	}
+
+	fold_dirty();
+	bool incremental = inSnapshot.id == base_snapshot;
+	for (const memory_region& region : regions) {
+		const uint8_t* in = inSnapshot.memory.data() + (size_t)region.first_page * 0x100;
+		if (!incremental || !region.tracked) {
+			memcpy(region.data, in, region.size);
+		}
+		else {
+			copy_dirty(region, region.data, in);
+		}
+	}
+
+	state_reader registers(inSnapshot.registers);
+	load_registers(registers);
+	flush_code();
+
+	std::fill(dirty_flags.begin(), dirty_flags.end(), 0);
+	base_snapshot = inSnapshot.id;
+	return registers.ok();
+}
+
+void bus::save_state(std::vector<uint8_t>& outState)
+{
+	outState.clear();
+	state_writer state(outState);
+
+	std::vector<uint8_t> registers;
+	state_writer register_state(registers);
+	save_registers(register_state);
+
+	state.write((uint32_t)registers.size());
+	state.write_bytes(registers.data(), registers.size());
+	for (const memory_region& region : regions) {
+		state.write_bytes(region.data, region.size);
+	}
+}
+
+bool bus::load_state(const uint8_t* inData, size_t inSize)
+{
+	state_reader state(inData, inSize);
+
+	uint32_t register_size = 0;
+	state.read(register_size);
+	size_t memory_size = 0;
+	for (const memory_region& region : regions) {
+		memory_size += region.size;
+	}
+	if (!state.ok() || inSize != sizeof(register_size) + register_size + memory_size) {
+		return false;
+	}
+
+	state_reader registers(inData + sizeof(register_size), register_size);
+	load_registers(registers);
+
+	const uint8_t* memory = inData + sizeof(register_size) + register_size;
+	for (const memory_region& region : regions) {
+		memcpy(region.data, memory, region.size);
+		memory += region.size;
+	}
+
+	flush_code();
+
+	// Memory no longer matches any snapshot
+	fold_dirty();
+	base_snapshot = 0;
+	return registers.ok() && registers.at_end();
+}
@@ -1,15 +1,254 @@
 #pragma once
 #include <cstdint>
+#include <memory>
+#include <vector>
+#include "controller.h"
 #include "cpu.h"
+#include "device.h"
+#include "ppu.h"
 #include "ram.h"
+#include "rom.h"
+#include "state.h"
+
+class block_cache;
+class mapper;
 
 class bus
 {
 public:
 	cpu cCPU; // Connected CPU
 	ram cRAM;
+	controller cINPUT;	// Reached through cPPU at $4016 / $4017 with a cartridge
+	ppu cPPU;			// Attached with a cartridge
 
 public:
 	bus();
+	~bus();
+
+	std::shared_ptr<const rom> cartridge;
+	std::unique_ptr<mapper> cMAPPER;	// Set while a cartridge is inserted
+
+	// Cleared while running frames nobody sees (run-ahead), the PPU and APU skip producing output
+	bool output_enabled = true;
+
+	/*
+	* Switch to the NES memory map and start the cartridge: 2KB of RAM
+	* mirrored up to $1FFF, the PPU, the controllers and $6000-$FFFF
+	* handed to the cartridge's mapper, then jump to the reset vector.
+	* Returns false if the mapper isn't supported
+	*/
+	bool insert_cartridge(std::shared_ptr<const rom>);
+
+public:
+	/*
+	* Scheduler
+	* ---
+	* The master clock is cCPU.total_cycles. The CPU runs whole instructions
+	* up to next_event, the earliest cycle at which some component has to be
+	* caught up (its next_sync or the end of the frame), so the run loop
+	* only compares one counter per instruction. Components are also caught
+	* up when their registers are accessed; that uses the cycle the current
+	* instruction started at, as the CPU charges its cycles at the end.
+	*/
+	static constexpr uint64_t FRAME_DOTS = 341 * 262;	// NTSC PPU dots per frame, 3 per CPU cycle
+
+	std::vector<clocked_device*> components;
+	uint64_t next_event = 0;
+	uint64_t frame = 0;		// Frames completed
+	uint64_t frame_end = (FRAME_DOTS + 2) / 3;	// First cycle of the next frame
+	uint64_t run_end = UINT64_MAX;				// Where the current run() stops
+
+	void attach(clocked_device*);
+
+	/*
+	* Interrupts
+	* ---
+	* Sources don't hold a flag the CPU has to poll, they tell the bus the
+	* cycle their line asserts, often well ahead of time. NMI is an edge
+	* taken once; each IRQ source holds the level from its cycle until it
+	* is cleared. Both just pull next_event in, so they are serviced at the
+	* first instruction boundary at or after that cycle
+	*/
+	enum class irq_source : uint8_t {
+		apu_frame,
+		apu_dmc,
+		mapper,
+		count
+	};
+	uint64_t nmi_cycle = UINT64_MAX;
+	uint64_t irq_cycles[(size_t)irq_source::count] = { UINT64_MAX, UINT64_MAX, UINT64_MAX };
+	uint64_t irq_cycle = UINT64_MAX;	// Earliest of irq_cycles
+
+	void schedule_nmi(uint64_t inCycle);
+	void cancel_nmi();
+	void set_irq(irq_source, uint64_t inCycle);
+	void clear_irq(irq_source);
+
+	// For CLI, PLP and RTI: check a held IRQ once the current instruction ends
+	inline void recheck_interrupts() { next_event = cCPU.total_cycles; }
+
+	/*
+	* Save states
+	* ---
+	* Memory that belongs in a snapshot is registered as a region. Writes
+	* through the page table set a flag for their CPU page, which is folded
+	* into per region page flags when the page is remapped or a snapshot is
+	* taken. A restore of the snapshot that was last saved or restored only
+	* copies back the pages written since; any other snapshot is copied
+	* whole and becomes the new base. Saving into the base snapshot again
+	* is incremental the same way.
+	*/
+	struct memory_region {
+		uint8_t* data;
+		uint32_t size;
+		uint32_t first_page;	// Index of its first page in dirty_flags and snapshot memory
+		bool tracked;			// Only written through the page table, otherwise always copied
+	};
+	std::vector<memory_region> regions;
+	std::vector<uint8_t> dirty_flags;	// One per region page
+	uint8_t dirty_pages[0x100] = {};	// CPU pages written since the last fold
+	uint64_t base_snapshot = 0;			// Snapshot id the flags are relative to
+
+	void add_region(uint8_t* inData, uint32_t inSize, bool inTracked = true);
+
+	void save(snapshot&);
+	// Returns false if the snapshot came from a different memory layout
+	bool restore(const snapshot&);
+
+	// Registers of the cpu, scheduler, mapper and components
+	void save_registers(state_writer&) const;
+	void load_registers(state_reader&);
+
+	/*
+	* The whole state as one flat buffer: the register block, then every
+	* memory region. Its size only changes with the cartridge, so buffers
+	* from consecutive frames line up byte for byte
+	*/
+	void save_state(std::vector<uint8_t>&);
+	bool load_state(const uint8_t* inData, size_t inSize);
+
+	inline void catch_up(clocked_device& inDevice)
+	{
+		if (inDevice.synced_cycle < cCPU.total_cycles) {
+			inDevice.run_until(cCPU.total_cycles);
+			inDevice.synced_cycle = cCPU.total_cycles;
+		}
+	}
+	void catch_up_all();
+
+	// Recompute next_event, for components whose next_sync moved
+	void reschedule();
+
+	// Run at least inCycles CPU cycles
+	void run(uint64_t inCycles);
+	// Run up to the end of the current frame
+	void run_frame();
+	// Run one instruction, for callers that check state after each
+	inline void step()
+	{
+		cCPU.clock();
+		poll_events();
+	}
+	// Service what fell due, for callers that advance cCPU.total_cycles themselves
+	inline void poll_events()
+	{
+		if (cCPU.total_cycles >= next_event) {
+			service_events();
+		}
+	}
+
+private:
+	void service_events();
+
+public:
+	/*
+	* Block cache
+	* ---
+	* Off by default. While on, run() executes predecoded blocks. Pages
+	* the cache decoded code from are write protected: their write
+	* pointer is parked in code_pages so writes take the device path,
+	* which drops the blocks of the page and every page mirroring the
+	* same memory, then writes and unprotects. Remapping a page drops its
+	* blocks as well, loading a state drops them all.
+	*/
+	std::unique_ptr<block_cache> cBLOCKS;
+	uint8_t* code_pages[0x100] = {};	// Parked write pointer of protected pages
+
+	void enable_block_cache(bool inEnable);
+	// For the cache: catch writes to the page and its mirrors from now on
+	void protect_code(uint8_t inPage);
+
+private:
+	void release_code(uint8_t inPage);	// Drop a page's blocks, before remapping it
+	void write_code(uint16_t inAddr, uint8_t inData);
+	void flush_code();
+
+public:
+	/*
+	* Page table
+	* ---
+	* One entry for each 256 byte page of the CPU address space, kept as
+	* separate arrays so the pointers the fast path needs are packed
+	* together. Pages backed by plain memory hold a host pointer so an
+	* access is a single indexed load, only pages without one call into
+	* their device. Reads of unmapped pages return the high byte of the
+	* address, writes to them are dropped.
+	*/
+	const uint8_t* read_pages[0x100];	// Direct read pointer for each page
+	uint8_t* write_pages[0x100];		// Direct write pointer, nullptr for ROM and I/O
+	bus_device* devices[0x100];			// Handles accesses that have no pointer
+
+	/*
+	* Map inCount pages starting at inFirstPage. inSize is the size of the
+	* backing memory, smaller regions are mirrored across the range a page
+	* at a time, so it has to be a whole number of pages
+	*/
+	void map_memory(uint8_t inFirstPage, uint16_t inCount, uint8_t* inBase, uint32_t inSize);
+	void map_rom(uint8_t inFirstPage, uint16_t inCount, const uint8_t* inBase, uint32_t inSize, bus_device* inWrites = nullptr);
+	void map_device(uint8_t inFirstPage, uint16_t inCount, bus_device* inDevice);
+	void unmap(uint8_t inFirstPage, uint16_t inCount);
+
+	inline uint8_t read(uint16_t inAddr)
+	{
+		const uint8_t* page = read_pages[inAddr >> 8];
+		if (page) {
+			return page[inAddr & 0xFF];
+		}
+		return read_device(inAddr);
+	}
+
+	inline void write(uint16_t inAddr, uint8_t inData)
+	{
+		uint8_t* page = write_pages[inAddr >> 8];
+		if (page) {
+			page[inAddr & 0xFF] = inData;
+			dirty_pages[inAddr >> 8] = 1;
+		}
+		else {
+			write_device(inAddr, inData);
+		}
+	}
+
+private:
+	// Move the CPU page flags onto the region pages they were written to
+	void fold_dirty(uint8_t inPage);
+	void fold_dirty();
+	// Copy the flagged pages of a region between it and a snapshot
+	void copy_dirty(const memory_region&, uint8_t* outDst, const uint8_t* inSrc);
+
+public:
+	// Slow paths for pages without a pointer, kept out of line
+	uint8_t read_device(uint16_t inAddr);
+	void write_device(uint16_t inAddr, uint8_t inData);
+
+	inline uint8_t peek(uint16_t inAddr)
+	{
+		const uint8_t* page = read_pages[inAddr >> 8];
+		if (page) {
+			return page[inAddr & 0xFF];
+		}
+		bus_device* device = devices[inAddr >> 8];
+		return device ? device->peek(inAddr) : (uint8_t)(inAddr >> 8);
+	}
 };
 
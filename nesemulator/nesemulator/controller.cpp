@@ -0,0 +1,53 @@
+#include "controller.h"
+
+uint8_t controller::read(uint16_t inAddr)
+{
+	if (inAddr != 0x4016 && inAddr != 0x4017) {
+		return (uint8_t)(inAddr >> 8);
+	}
+
+	int port = inAddr & 0x01;
+	if (strobe) {
+		shift[port] = buttons[port];
+	}
+
+	// Bits 5-7 are open bus ($40), after 8 reads official pads return 1s
+	uint8_t bit = shift[port] & 0x01;
+	shift[port] = (shift[port] >> 1) | 0x80;
+	return 0x40 | bit;
+}
+
+uint8_t controller::peek(uint16_t inAddr)
+{
+	if (inAddr != 0x4016 && inAddr != 0x4017) {
+		return (uint8_t)(inAddr >> 8);
+	}
+	return 0x40 | (shift[inAddr & 0x01] & 0x01);
+}
+
+void controller::write(uint16_t inAddr, uint8_t inData)
+{
+	if (inAddr != 0x4016) {
+		return;
+	}
+
+	strobe = inData & 0x01;
+	if (strobe) {
+		shift[0] = buttons[0];
+		shift[1] = buttons[1];
+	}
+}
+
+void controller::save_state(state_writer& inState) const
+{
+	inState.write(buttons);
+	inState.write(shift);
+	inState.write(strobe);
+}
+
+void controller::load_state(state_reader& inState)
+{
+	inState.read(buttons);
+	inState.read(shift);
+	inState.read(strobe);
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstdint>
+#include "device.h"
+#include "state.h"
+
+/*
+* Standard controllers on $4016 and $4017
+* ---
+* buttons is the live state the frontend sets. Writing 1 then 0 to bit 0
+* of $4016 latches it into the shift registers, each read then returns
+* the next button in A, B, Select, Start, Up, Down, Left, Right order.
+* Mapped on the whole $40xx page; other addresses read as open bus.
+*/
+class controller : public bus_device
+{
+public:
+	enum button : uint8_t {
+		button_A = 0x01,
+		button_B = 0x02,
+		button_select = 0x04,
+		button_start = 0x08,
+		button_up = 0x10,
+		button_down = 0x20,
+		button_left = 0x40,
+		button_right = 0x80
+	};
+
+	uint8_t buttons[2] = {};
+
+private:
+	uint8_t shift[2] = {};
+	bool strobe = false;
+
+public:
+	uint8_t read(uint16_t) override;
+	void write(uint16_t, uint8_t) override;
+	uint8_t peek(uint16_t) override;
+
+	void save_state(state_writer&) const;
+	void load_state(state_reader&);
+};
@@ -1,7 +1,91 @@
 #include "cpu.h"
+#include "block_cache.h"
 #include "bus.h"
 
-#include <iostream>
+#include <algorithm>
+#include <array>
+#include <utility>
+
+/*
+* Handler for every opcode, built at compile time from opcode_table
+*/
+using handler = cpu::handler;
+
+template<std::size_t... OPC>
+static constexpr std::array<handler, 0x100> make_handlers(std::index_sequence<OPC...>)
+{
+	return { &cpu::step<static_cast<uint8_t>(OPC)>... };
+}
+
+template<std::size_t... OPC>
+static constexpr std::array<cpu::decoded_handler, 0x100> make_decoded_handlers(std::index_sequence<OPC...>)
+{
+	return { &cpu::run_decoded<static_cast<uint8_t>(OPC)>... };
+}
+
+static constexpr std::array<handler, 0x100> handlers = make_handlers(std::make_index_sequence<0x100>{});
+static constexpr std::array<cpu::decoded_handler, 0x100> decoded_handlers = make_decoded_handlers(std::make_index_sequence<0x100>{});
+
+cpu::decoded_handler cpu::handler_for(uint8_t inOpcode)
+{
+	return decoded_handlers[inOpcode];
+}
+
+/*
+* Superinstructions
+* - Opcode sequences that run as one block entry, saving the dispatches
+*	between them. The main.cpp multiply loop and the test programs top the
+*	pair histogram of nesbench --pairs with ADC / DEY / BNE and CLC / ADC,
+*	the rest are the loops games wait and copy in: polling PPU status or
+*	a RAM flag, counting down and indexed copies. Longer sequences first,
+*	so they win over a pair they start with
+*/
+struct fused_sequence {
+	uint32_t length;
+	uint8_t opcodes[3];
+	cpu::decoded_handler run;
+};
+
+template<uint8_t... OPS>
+static constexpr fused_sequence fuse()
+{
+	return { sizeof...(OPS), { OPS... }, &cpu::run_decoded<OPS...> };
+}
+
+static constexpr fused_sequence fused_sequences[] = {
+	fuse<0x6D, 0x88, 0xD0>(),	// ADC abs, DEY, BNE
+	fuse<0xAD, 0x29, 0xF0>(),	// LDA abs, AND #, BEQ
+	fuse<0xB1, 0x91, 0xC8>(),	// LDA (zp),Y, STA (zp),Y, INY
+	fuse<0xBD, 0x9D, 0xE8>(),	// LDA abs,X, STA abs,X, INX
+	fuse<0xAD, 0x10>(),			// LDA abs, BPL
+	fuse<0xAD, 0x30>(),			// LDA abs, BMI
+	fuse<0xA5, 0xF0>(),			// LDA zp, BEQ
+	fuse<0xA5, 0xD0>(),			// LDA zp, BNE
+	fuse<0xCA, 0xD0>(),			// DEX, BNE
+	fuse<0x88, 0xD0>(),			// DEY, BNE
+	fuse<0xE8, 0xD0>(),			// INX, BNE
+	fuse<0xC8, 0xD0>(),			// INY, BNE
+	fuse<0xC6, 0xD0>(),			// DEC zp, BNE
+	fuse<0xE0, 0xD0>(),			// CPX #, BNE
+	fuse<0xC9, 0xD0>(),			// CMP #, BNE
+	fuse<0xC9, 0xF0>(),			// CMP #, BEQ
+	fuse<0x85, 0xA5>(),			// STA zp, LDA zp
+	fuse<0x18, 0x69>(),			// CLC, ADC #
+	fuse<0x38, 0xE9>(),			// SEC, SBC #
+	fuse<0x0A, 0x0A>(),			// ASL A, ASL A
+	fuse<0x4A, 0x4A>(),			// LSR A, LSR A
+};
+
+cpu::decoded_handler cpu::fused_handler(const uint8_t* inOpcodes, uint32_t inCount, uint32_t& outLength)
+{
+	for (const fused_sequence& sequence : fused_sequences) {
+		if (sequence.length <= inCount && std::equal(sequence.opcodes, sequence.opcodes + sequence.length, inOpcodes)) {
+			outLength = sequence.length;
+			return sequence.run;
+		}
+	}
+	return nullptr;
+}
 
 cpu::cpu(bus* inBus)
 {
@@ -13,14 +97,31 @@ void cpu::reset()
 {
 	PC = 0x200;
 	SP = 0x0;
-	PF = Empty_Flag;
+	set_flags(Empty_Flag);
 	A = 0;
 	X = 0;
 	Y = 0;
+	total_cycles = 0;
+
+	// Scratch values too, so save states of identical runs compare equal
+	hi = lo = full_addr = rel_addr = operand = 0;
+	page_crossed = false;
+	clock_cycles = 0;
+	opcode = 0;
+	data = 0;
 }
 
 inline void cpu::set_flag(flag inFlag, bool inState = true)
 {
+#ifdef NES_LAZY_FLAGS
+	switch (inFlag) {
+	case flag_Z: lazy_Z = !inState; return;
+	case flag_N: lazy_N = inState ? flag_N : 0; return;
+	case flag_C: lazy_C = inState; return;
+	case flag_O: lazy_V = inState; return;
+	default: break;
+	}
+#endif
 	if (inState) {
 		PF |= inFlag;
 	}
@@ -29,8 +130,28 @@ inline void cpu::set_flag(flag inFlag, bool inState = true)
 	}
 }
 
+inline void cpu::set_nz(uint8_t inValue)
+{
+#ifdef NES_LAZY_FLAGS
+	lazy_Z = inValue;
+	lazy_N = inValue;
+#else
+	set_flag(flag_Z, inValue == 0);
+	set_flag(flag_N, inValue & 0x80);
+#endif
+}
+
 inline bool cpu::get_status(flag inFlag)
 {
+#ifdef NES_LAZY_FLAGS
+	switch (inFlag) {
+	case flag_Z: return !lazy_Z;
+	case flag_N: return lazy_N & flag_N;
+	case flag_C: return lazy_C;
+	case flag_O: return lazy_V;
+	default: break;
+	}
+#endif
 	if ((PF & inFlag) > 0) {
 		return true;
 	}
@@ -38,51 +159,417 @@ inline bool cpu::get_status(flag inFlag)
 
 }
 
+// The stack pointer points at the next free byte, pushes write then decrement
 inline void cpu::AddToStack(uint8_t inVal)
 {
-	cBUS->cRAM.write(new_SP--, inVal);
+	cBUS->write(new_SP.get_ptr(), inVal);
+	--new_SP;
 }
 
 inline uint8_t cpu::RemoveFromStack()
 {
-	return cBUS->cRAM.read(new_SP++);
+	return cBUS->read(++new_SP);
 }
 
 void cpu::clock()
 {
 	clock_cycles = 0;
 
+#ifdef NES_TRACE
+	if (trace.enabled()) {
+		uint8_t traced = cBUS->peek(PC);
+		uint8_t bytes = opcode_table[traced].bytes;
+		trace.record({
+			total_cycles, PC, traced,
+			{ bytes > 1 ? cBUS->peek(PC + 1) : (uint8_t)0, bytes > 2 ? cBUS->peek(PC + 2) : (uint8_t)0 },
+			A, X, Y, flags(), (uint8_t)new_SP.ptr
+		});
+	}
+#endif
+
+#ifdef NES_PROFILE
+	uint16_t start_pc = PC;
+#endif
+
 	// Read the next opcode
-	opcode = cBUS->cRAM.read(PC++);
+	opcode = cBUS->read(PC++);
+
+#ifdef NES_SWITCH_CORE
+	execute();
+#else
+	// Call the handler specialised for this opcode
+	(this->*handlers[opcode])();
+#endif
+
+	total_cycles += clock_cycles;
+
+#ifdef NES_PROFILE
+	if (profile.enabled()) {
+		profile.record(start_pc, opcode, clock_cycles, full_addr);
+	}
+#endif
+}
+
+/*
+* Block execution
+* - Each entry gets the same bookkeeping clock() does, with PC already
+*	past the instruction. Stops between instructions once inEnd is
+*	reached or a write or remap dropped blocks, as the running block may
+*	be one of them. Superinstructions check the same between the opcodes
+*	they run
+*/
+void cpu::run_blocks(block_cache& ioCache, const uint64_t& inEnd)
+{
+	while (total_cycles < inEnd) {
+#ifdef NES_TRACE
+		if (trace.enabled()) {
+			clock();
+			continue;
+		}
+#endif
+#ifdef NES_PROFILE
+		if (profile.enabled()) {
+			clock();
+			continue;
+		}
+#endif
+		const block_cache::block* current = ioCache.find(PC);
+		if (!current) {
+			clock();
+			ioCache.count_pair(opcode);
+			continue;
+		}
+
+		uint32_t generation = ioCache.generation;
+		uint64_t start = total_cycles;
+		uint8_t a = A, x = X, y = Y, pf = current->idle ? flags() : 0;
+
+		const decoded* next = current->entries.data();
+		const decoded* last = next + current->entries.size();
+		while (next < last) {
+			uint32_t ran = (this->*next->run)(next, inEnd, ioCache.generation);
+			ioCache.count_pair(next->opcode);
+
+			next += ran;
+			ioCache.instructions += ran;
+			ioCache.dispatches++;
+			if (total_cycles >= inEnd || ioCache.generation != generation) {
+				break;
+			}
+		}
+
+		// Back at the start with the registers unchanged, the iterations up to inEnd would all do the same
+		if (current->idle && ioCache.skip_idle && next == last && ioCache.generation == generation
+			&& PC == current->entries.front().pc && total_cycles < inEnd
+			&& A == a && X == x && Y == y && flags() == pf) {
+			uint64_t iteration = total_cycles - start;
+			uint64_t skipped = (inEnd - total_cycles - 1) / iteration * iteration;
+			total_cycles += skipped;
+			ioCache.idle_skips++;
+			ioCache.idle_cycles += skipped;
+		}
+	}
+}
+
+/*
+* Save states
+* - Everything an instruction can leave behind, including the scratch
+*   values and the new_PC / new_SP wrappers with their pending postfix steps
+*/
+void cpu::save_state(state_writer& inState) const
+{
+	inState.write(PC);
+	inState.write(SP);
+	inState.write(new_PC);
+	inState.write(new_SP);
+	inState.write(flags());
+	inState.write(A);
+	inState.write(X);
+	inState.write(Y);
+	inState.write(hi);
+	inState.write(lo);
+	inState.write(full_addr);
+	inState.write(rel_addr);
+	inState.write(page_crossed);
+	inState.write(clock_cycles);
+	inState.write(total_cycles);
+	inState.write(opcode);
+	inState.write(data);
+}
+
+void cpu::load_state(state_reader& inState)
+{
+	inState.read(PC);
+	inState.read(SP);
+	inState.read(new_PC);
+	inState.read(new_SP);
+	uint8_t flags_read = 0;
+	inState.read(flags_read);
+	set_flags(flags_read);
+	inState.read(A);
+	inState.read(X);
+	inState.read(Y);
+	inState.read(hi);
+	inState.read(lo);
+	inState.read(full_addr);
+	inState.read(rel_addr);
+	inState.read(page_crossed);
+	inState.read(clock_cycles);
+	inState.read(total_cycles);
+	inState.read(opcode);
+	inState.read(data);
+}
+
+void cpu::nmi()
+{
+	interrupt(0xFFFA);
+}
+
+void cpu::irq()
+{
+	interrupt(0xFFFE);
+}
+
+void cpu::interrupt(uint16_t inVector)
+{
+	AddToStack(PC >> 8);
+	AddToStack(PC & 0x00FF);
+	AddToStack((flags() & ~flag_B) | UnusedFlag);
+	set_flag(flag_I);
+
+	PC = (uint16_t)cBUS->read(inVector) | ((uint16_t)cBUS->read(inVector + 1) << 8);
+	total_cycles += 7;
+
+#ifdef NES_PROFILE
+	if (profile.enabled()) {
+		profile.interrupt(PC, 7);
+	}
+#endif
+}
+
+/*
+* Mnemonics
+* - Kept out of opcode_table, only tracing and disassembly read these
+*/
+const char* cpu::mnemonic(op inOp)
+{
+	static const char* const titles[] = {
+		"???", "BRK", "ORA", "ASL", "PHP", "BPL", "CLC", "JSR",
+		"AND", "BIT", "ROL", "PLP", "BMI", "SEC", "RTI", "EOR",
+		"LSR", "PHA", "JMP", "BVC", "CLI", "RTS", "ADC", "ROR",
+		"PLA", "BVS", "SEI", "STA", "STY", "STX", "DEY", "TXA",
+		"BCC", "TYA", "TXS", "LDY", "LDA", "LDX", "TAY", "TAX",
+		"BCS", "CLV", "TSX", "CPY", "CMP", "DEC", "INY", "DEX",
+		"BNE", "CLD", "CPX", "SBC", "INC", "INX", "NOP", "BEQ",
+		"SED"
+	};
+	return titles[(uint8_t)inOp];
+}
 
-	// Call the address mode method 
-	(this->*allinstructions[opcode].addr_mode)();
+/*
+* Opcode handlers
+* - address and operate pick the methods for an opcode at compile time,
+*	step joins them into one handler per opcode
+*/
+template<uint8_t OPC>
+void cpu::step()
+{
+	constexpr opcode_info info = opcode_table[OPC];
 
-	// Run the operation
-	(this->*allinstructions[opcode].operation)();
+	address<info.addressing>();
+	operate<info.operation, info.addressing>();
 
 	/*
 	* Add the cycles for the instruction.
 	* ---
-	* Additinoal cycles added by operations and address modes
-	* are added inside the op and adrmode methods
+	* Additinoal cycles added by operations are added inside the op
+	* methods. Page crossings only cost a cycle for opcodes that read
 	*/
-	clock_cycles += this->allinstructions[opcode].MC;
+	clock_cycles += info.cycles;
+	if constexpr (info.page_cross) {
+		clock_cycles += page_crossed;
+	}
+}
 
-	std::cout << "~ " << this->allinstructions[opcode].title << std::endl;
-	std::cout << "~ A " << (int) A << std::endl;
-	std::cout << "~ X " << (int) X << std::endl;
-	std::cout << "~ Y " << (int) Y << std::endl << std::endl;
+template<uint8_t OPC>
+void cpu::step_decoded(const decoded& inOp)
+{
+	constexpr opcode_info info = opcode_table[OPC];
+
+	clock_cycles = 0;
+	opcode = OPC;
+	operand = inOp.operand;
+	PC = inOp.pc + info.bytes;
+
+	address_decoded<info.addressing>();
+	operate<info.operation, info.addressing>();
+
+	clock_cycles += info.cycles;
+	if constexpr (info.page_cross) {
+		clock_cycles += page_crossed;
+	}
+	total_cycles += clock_cycles;
+}
+
+template<uint8_t... OPS>
+uint32_t cpu::run_decoded(const decoded* inOps, const uint64_t& inEnd, const uint32_t& inGeneration)
+{
+	uint32_t generation = inGeneration;
+	uint32_t ran = 0;
+	((step_decoded<OPS>(inOps[ran]), ++ran == sizeof...(OPS) || (total_cycles < inEnd && inGeneration == generation)) && ...);
+	return ran;
+}
+
+template<cpu::mode M>
+void cpu::address()
+{
+	if constexpr (M == mode::acc) { acc(); }
+	else if constexpr (M == mode::abs) { abs(); }
+	else if constexpr (M == mode::absx) { absx(); }
+	else if constexpr (M == mode::absy) { absy(); }
+	else if constexpr (M == mode::imm) { imm(); }
+	else if constexpr (M == mode::impl) { impl(); }
+	else if constexpr (M == mode::ind) { ind(); }
+	else if constexpr (M == mode::xind) { xind(); }
+	else if constexpr (M == mode::yind) { yind(); }
+	else if constexpr (M == mode::rel) { rel(); }
+	else if constexpr (M == mode::zpg) { zpg(); }
+	else if constexpr (M == mode::zpgx) { zpgx(); }
+	else if constexpr (M == mode::zpgy) { zpgy(); }
+}
+
+template<cpu::op O, cpu::mode M>
+void cpu::operate()
+{
+	if constexpr (O == op::BRK) { BRK(); }
+	else if constexpr (O == op::ORA) { ORA<M>(); }
+	else if constexpr (O == op::ASL) { ASL<M>(); }
+	else if constexpr (O == op::PHP) { PHP(); }
+	else if constexpr (O == op::BPL) { BPL(); }
+	else if constexpr (O == op::CLC) { CLC(); }
+	else if constexpr (O == op::JSR) { JSR(); }
+	else if constexpr (O == op::AND) { AND<M>(); }
+	else if constexpr (O == op::BIT) { BIT<M>(); }
+	else if constexpr (O == op::ROL) { ROL<M>(); }
+	else if constexpr (O == op::PLP) { PLP(); }
+	else if constexpr (O == op::BMI) { BMI(); }
+	else if constexpr (O == op::SEC) { SEC(); }
+	else if constexpr (O == op::RTI) { RTI(); }
+	else if constexpr (O == op::EOR) { EOR<M>(); }
+	else if constexpr (O == op::LSR) { LSR<M>(); }
+	else if constexpr (O == op::PHA) { PHA(); }
+	else if constexpr (O == op::JMP) { JMP(); }
+	else if constexpr (O == op::BVC) { BVC(); }
+	else if constexpr (O == op::CLI) { CLI(); }
+	else if constexpr (O == op::RTS) { RTS(); }
+	else if constexpr (O == op::ADC) { ADC<M>(); }
+	else if constexpr (O == op::ROR) { ROR<M>(); }
+	else if constexpr (O == op::PLA) { PLA(); }
+	else if constexpr (O == op::BVS) { BVS(); }
+	else if constexpr (O == op::SEI) { SEI(); }
+	else if constexpr (O == op::STA) { STA(); }
+	else if constexpr (O == op::STY) { STY(); }
+	else if constexpr (O == op::STX) { STX(); }
+	else if constexpr (O == op::DEY) { DEY(); }
+	else if constexpr (O == op::TXA) { TXA(); }
+	else if constexpr (O == op::BCC) { BCC(); }
+	else if constexpr (O == op::TYA) { TYA(); }
+	else if constexpr (O == op::TXS) { TXS(); }
+	else if constexpr (O == op::LDY) { LDY<M>(); }
+	else if constexpr (O == op::LDA) { LDA<M>(); }
+	else if constexpr (O == op::LDX) { LDX<M>(); }
+	else if constexpr (O == op::TAY) { TAY(); }
+	else if constexpr (O == op::TAX) { TAX(); }
+	else if constexpr (O == op::BCS) { BCS(); }
+	else if constexpr (O == op::CLV) { CLV(); }
+	else if constexpr (O == op::TSX) { TSX(); }
+	else if constexpr (O == op::CPY) { CPY<M>(); }
+	else if constexpr (O == op::CMP) { CMP<M>(); }
+	else if constexpr (O == op::DEC) { DEC<M>(); }
+	else if constexpr (O == op::INY) { INY(); }
+	else if constexpr (O == op::DEX) { DEX(); }
+	else if constexpr (O == op::BNE) { BNE(); }
+	else if constexpr (O == op::CLD) { CLD(); }
+	else if constexpr (O == op::CPX) { CPX<M>(); }
+	else if constexpr (O == op::SBC) { SBC<M>(); }
+	else if constexpr (O == op::INC) { INC<M>(); }
+	else if constexpr (O == op::INX) { INX(); }
+	else if constexpr (O == op::NOP) { NOP(); }
+	else if constexpr (O == op::BEQ) { BEQ(); }
+	else if constexpr (O == op::SED) { SED(); }
 }
 
-void cpu::load_to_data()
+/*
+* The address modes below with their operand bytes taken from operand,
+* everything they read through the operand stays a bus read
+*/
+template<cpu::mode M>
+void cpu::address_decoded()
 {
-	if (!(allinstructions[opcode].addr_mode == &cpu::impl)) {
-		data = cBUS->cRAM.read(full_addr);
+	if constexpr (M == mode::abs || M == mode::absx || M == mode::absy || M == mode::ind) {
+		lo = operand & 0x00FF;
+		hi = operand >> 8;
+		full_addr = (hi << 8) | lo;
+
+		if constexpr (M == mode::absx) {
+			full_addr += X;
+			page_crossed = (full_addr & 0xFF00) != (hi << 8);
+		}
+		else if constexpr (M == mode::absy) {
+			full_addr += Y;
+			page_crossed = (full_addr & 0xFF00) != (hi << 8);
+		}
+		else if constexpr (M == mode::ind) {
+			if (lo == 0x00FF) {
+				full_addr = ((uint16_t)cBUS->read(full_addr & 0xFF00) << 8) | cBUS->read(full_addr);
+			}
+			else {
+				full_addr = (cBUS->read(full_addr + 1) << 8) | cBUS->read(full_addr);
+			}
+		}
+	}
+	else if constexpr (M == mode::imm) {
+		full_addr = PC - 1;
+	}
+	else if constexpr (M == mode::xind) {
+		uint16_t ptr = operand;
+		lo = cBUS->read((uint16_t)((ptr + X) & 0x00FF));
+		hi = cBUS->read((uint16_t)((ptr + X + 1) & 0x00FF));
+		full_addr = ((hi << 8) | lo) + X;
+	}
+	else if constexpr (M == mode::yind) {
+		uint16_t ptr = operand;
+		lo = cBUS->read(ptr & 0x00FF);
+		hi = cBUS->read((ptr + 1) & 0x00FF);
+		full_addr = ((hi << 8) | lo) + Y;
+		page_crossed = (full_addr & 0xFF00) != (hi << 8);
+	}
+	else if constexpr (M == mode::rel) {
+		rel_addr = operand;
+		if (rel_addr & 0x80) {
+			rel_addr |= 0xFF00;
+		}
+	}
+	else if constexpr (M == mode::zpg) {
+		full_addr = operand & 0x00FF;
+	}
+	else if constexpr (M == mode::zpgx) {
+		full_addr = (operand + X) & 0x00FF;
+	}
+	else if constexpr (M == mode::zpgy) {
+		full_addr = (operand + Y) & 0x00FF;
 	}
-	if (allinstructions[opcode].addr_mode == &cpu::acc) {
+}
+
+template<cpu::mode M>
+void cpu::load_to_data()
+{
+	if constexpr (M == mode::acc) {
 		data = A;
 	}
+	else if constexpr (M != mode::impl) {
+		data = cBUS->read(full_addr);
+	}
 }
 
 /*
@@ -94,29 +581,25 @@ void cpu::acc() {
 }
 
 void cpu::abs() {
-	lo = cBUS->cRAM.read(PC++);
-	hi = cBUS->cRAM.read(PC++);	
+	lo = cBUS->read(PC++);
+	hi = cBUS->read(PC++);	
 	full_addr = (hi << 8) | lo;
 }
 
 void cpu::absx() {
-	lo = cBUS->cRAM.read(PC++);
-	hi = cBUS->cRAM.read(PC++);
+	lo = cBUS->read(PC++);
+	hi = cBUS->read(PC++);
 	full_addr = ((hi << 8) | lo) + X;
 
-	if ((full_addr & 0xFF00) != (hi << 8)) {
-		clock_cycles++;
-	}
+	page_crossed = (full_addr & 0xFF00) != (hi << 8);
 }
 
 void cpu::absy() {
-	lo = cBUS->cRAM.read(PC++);
-	hi = cBUS->cRAM.read(PC++);
+	lo = cBUS->read(PC++);
+	hi = cBUS->read(PC++);
 	full_addr = ((hi << 8) | lo) + Y;
 
-	if ((full_addr & 0xFF00) != (hi << 8)) {
-		clock_cycles++;
-	}
+	page_crossed = (full_addr & 0xFF00) != (hi << 8);
 }
 
 void cpu::imm() {
@@ -132,8 +615,8 @@ void cpu::impl() {
 }
 
 void cpu::ind() {
-	lo = cBUS->cRAM.read(PC++);
-	hi = cBUS->cRAM.read(PC++);
+	lo = cBUS->read(PC++);
+	hi = cBUS->read(PC++);
 
 	full_addr = ((hi << 8) | lo);
 
@@ -144,41 +627,39 @@ void cpu::ind() {
 		* If LSB is at page boundry, the least significant bit is is grabbed from where you'd expect
 		* But the MSB is taken from 0x--00, where -- are the most significant bytes
 		*/
-		full_addr = ((uint16_t)cBUS->cRAM.read(full_addr & 0xFF00) << 8) | cBUS->cRAM.read(full_addr);
+		full_addr = ((uint16_t)cBUS->read(full_addr & 0xFF00) << 8) | cBUS->read(full_addr);
 	}
 	// normal behavior
 	else {
-		full_addr = (cBUS->cRAM.read(full_addr + 1) << 8) | cBUS->cRAM.read(full_addr);
+		full_addr = (cBUS->read(full_addr + 1) << 8) | cBUS->read(full_addr);
 	}
 }
 
 void cpu::xind()
 {
-	uint16_t ptr = cBUS->cRAM.read(PC++);
+	uint16_t ptr = cBUS->read(PC++);
 
-	lo = cBUS->cRAM.read(ptr + ((uint16_t)X) & 0x00FF);
-	hi = cBUS->cRAM.read((uint16_t)(ptr + (uint16_t)X + 1) & 0x00FF);
+	lo = cBUS->read((uint16_t)((ptr + X) & 0x00FF));
+	hi = cBUS->read((uint16_t)((ptr + X + 1) & 0x00FF));
 
 	full_addr = ((hi << 8) | lo) + X;
 }
 
 void cpu::yind()
 {
-	uint16_t ptr = cBUS->cRAM.read(PC++);
+	uint16_t ptr = cBUS->read(PC++);
 
-	lo = cBUS->cRAM.read(ptr & 0x00FF);
-	hi = cBUS->cRAM.read((ptr + 1) & 0x00FF);
+	lo = cBUS->read(ptr & 0x00FF);
+	hi = cBUS->read((ptr + 1) & 0x00FF);
 
 	full_addr = ((hi << 8) | lo) + Y;
 
-	if ((full_addr & 0xFF00) != (hi << 8)) {
-		clock_cycles++;
-	}
+	page_crossed = (full_addr & 0xFF00) != (hi << 8);
 }
 
 void cpu::rel()
 {
-	rel_addr = cBUS->cRAM.read(PC++);
+	rel_addr = cBUS->read(PC++);
 
 	// If the highest bit is a 1 the number is negative
 	if (rel_addr & 0x80) {
@@ -188,7 +669,7 @@ void cpu::rel()
 
 void cpu::zpg()
 {
-	full_addr = cBUS->cRAM.read(PC++);
+	full_addr = cBUS->read(PC++);
 
 	// Clears the high order bits from previous clock cycles
 	full_addr &= 0x00FF;
@@ -196,14 +677,14 @@ void cpu::zpg()
 
 void cpu::zpgx()
 {
-	full_addr = cBUS->cRAM.read(PC++) + X;
+	full_addr = cBUS->read(PC++) + X;
 	// Clears the high order bits from previous clock cycles
 	full_addr &= 0x00FF;
 }
 
 void cpu::zpgy()
 {
-	full_addr = cBUS->cRAM.read(PC++) + Y;
+	full_addr = cBUS->read(PC++) + Y;
 	// Clears the high order bits from previous clock cycles
 	full_addr &= 0x00FF;
 }
@@ -214,29 +695,32 @@ void cpu::zpgy()
 void cpu::BRK() {
 	set_flag(flag_I);
 
-	AddToStack((new_PC.get_ptr() >> 8) & 0x00FF);
-	AddToStack(new_PC.get_ptr() & 0x00FF);
+	// Return past the padding byte after BRK
+	uint16_t ret = PC + 1;
+	AddToStack((ret >> 8) & 0x00FF);
+	AddToStack(ret & 0x00FF);
 
 	set_flag(flag_B);
-	AddToStack(PF);
+	AddToStack(flags());
 	set_flag(flag_B, false);
 
-	PC = (uint16_t)cBUS->cRAM.read(0xFFFE) | ((uint16_t)cBUS->cRAM.read(0xFFFF) << 8);
+	PC = (uint16_t)cBUS->read(0xFFFE) | ((uint16_t)cBUS->read(0xFFFF) << 8);
 }
 
+template<cpu::mode M>
 void cpu::ORA()
 {
-	load_to_data();
+	load_to_data<M>();
 
 	A |= data;
-	set_flag(flag_Z, A == 0);
-	set_flag(flag_N, (A >> 7) & 0x1);
+	set_nz(A);
 	clock_cycles++;
 }
 
+template<cpu::mode M>
 void cpu::ASL()
 {
-	load_to_data();
+	load_to_data<M>();
 
 	uint16_t temp = data << 1;
 
@@ -250,12 +734,12 @@ void cpu::ASL()
 	set_flag(flag_N, (data & 0x80) >> 7);
 
 	// If accumulator is the target, set to the accumulator
-	if (allinstructions[opcode].addr_mode == &cpu::acc) {
+	if constexpr (M == mode::acc) {
 		A = temp;
 	}
 	// Else it's a var in memory, write to that
 	else {
-		cBUS->cRAM.write(full_addr, temp);
+		cBUS->write(full_addr, temp);
 	}
 
 	data = data << 1;
@@ -264,7 +748,7 @@ void cpu::ASL()
 
 void cpu::PHP()
 {
-	AddToStack(PF);
+	AddToStack(flags());
 }
 
 void cpu::BPL()
@@ -290,49 +774,49 @@ void cpu::JSR()
 	new_PC.set_ptr(full_addr);
 }
 
+template<cpu::mode M>
 void cpu::AND()
 {
-	load_to_data();
+	load_to_data<M>();
 	A &= data;
-	set_flag(flag_Z, A == 0);
-	set_flag(flag_N, (A >> 7) & 0x1);
+	set_nz(A);
 	clock_cycles++;
 }
 
+template<cpu::mode M>
 void cpu::BIT()
 {
-	load_to_data();
+	load_to_data<M>();
 
 	uint8_t result = A & data;
 
-	set_flag(flag_Z, result == 0);
+	set_nz(result);
 
 	set_flag(flag_O, (result >> 6) & 0x1);
-
-	set_flag(flag_N, (result >> 7) & 0x1);
 }
 
+template<cpu::mode M>
 void cpu::ROL()
 {
-	load_to_data();
+	load_to_data<M>();
 
 	uint8_t temp = (uint16_t)(data << 1) | get_status(flag_C);
 	set_flag(flag_C, temp & 0xFF00);
-	set_flag(flag_Z, (temp & 0x00FF) == 0);
-	set_flag(flag_N, temp & 0x80);
+	set_nz(temp);
 
-	if (allinstructions[opcode].addr_mode == &cpu::impl) {
+	if constexpr (M == mode::acc) {
 		A = temp;
 	}
 	else {
-		cBUS->cRAM.write(full_addr, temp);
+		cBUS->write(full_addr, temp);
 	}
 
 }
 
 void cpu::PLP()
 {
-	PF = RemoveFromStack();
+	set_flags(RemoveFromStack());
+	cBUS->recheck_interrupts();
 }
 
 void cpu::BMI()
@@ -352,30 +836,34 @@ void cpu::SEC()
 
 void cpu::RTI()
 {
-	PF = RemoveFromStack();
+	set_flags(RemoveFromStack());
 
 	lo = RemoveFromStack();
 	hi = RemoveFromStack();
 
 	full_addr = (hi << 8) | lo;
 	new_PC.set_ptr(full_addr);
+	PC = full_addr;
+
+	// I may have been cleared, a pending IRQ is taken before the next instruction
+	cBUS->recheck_interrupts();
 }
 
+template<cpu::mode M>
 void cpu::EOR()
 {
-	load_to_data();
+	load_to_data<M>();
 
 	A ^= data;
 
-	set_flag(flag_Z, A == 0);
-
-	set_flag(flag_N, (A >> 7) & 0x1);
+	set_nz(A);
 
 }
 
+template<cpu::mode M>
 void cpu::LSR()
 {
-	load_to_data();
+	load_to_data<M>();
 	uint8_t temp = data >> 1;
 
 	set_flag(flag_C, data & 0x1);
@@ -384,12 +872,12 @@ void cpu::LSR()
 
 
 	// If accumulator is the target, set to the accumulator
-	if (allinstructions[opcode].addr_mode == &cpu::acc) {
+	if constexpr (M == mode::acc) {
 		A = temp;
 	}
 	// Else it's a var in memory, write to that
 	else {
-		cBUS->cRAM.write(full_addr, temp);
+		cBUS->write(full_addr, temp);
 	}
 }
 
@@ -400,9 +888,6 @@ void cpu::PHA()
 
 void cpu::JMP()
 {
-	if (PC == full_addr) {
-		std::cout << "LOOPING" << std::endl;
-	}
 	PC = full_addr;
 }
 
@@ -419,6 +904,7 @@ void cpu::BVC()
 void cpu::CLI()
 {
 	set_flag(flag_I, 0);
+	cBUS->recheck_interrupts();
 }
 
 void cpu::RTS()
@@ -430,9 +916,10 @@ void cpu::RTS()
 	new_PC.set_ptr(full_addr);
 }
 
+template<cpu::mode M>
 void cpu::ADC()
 {
-	load_to_data();
+	load_to_data<M>();
 
 	uint16_t temp = (uint16_t)A + (uint16_t)data + (uint16_t)get_status(flag_C);
 
@@ -441,37 +928,36 @@ void cpu::ADC()
 	}
 
 	set_flag(flag_C, temp > 255);
-	set_flag(flag_Z, (temp & 0x00FF) == 0);
 	set_flag(flag_O, (~((uint16_t)A ^ (uint16_t)data) & ((uint16_t)A ^ (uint16_t)temp)) & 0x0080);
-	set_flag(flag_N, temp & 0x80);
+	set_nz((uint8_t)temp);
 
 	A = temp & 0x00FF;
 
 	clock_cycles++;
 }
 
+template<cpu::mode M>
 void cpu::ROR()
 {
-	load_to_data();
+	load_to_data<M>();
 
 	uint8_t temp = (uint16_t)(get_status(flag_C) << 7) | (data >> 1);
 	set_flag(flag_C, data & 0x1);
 	set_flag(flag_Z, A == 0);
 	set_flag(flag_N, temp & 0x80);
 
-	if (allinstructions[opcode].addr_mode == &cpu::impl) {
+	if constexpr (M == mode::acc) {
 		A = temp;
 	}
 	else {
-		cBUS->cRAM.write(full_addr, temp);
+		cBUS->write(full_addr, temp);
 	}
 }
 
 void cpu::PLA()
 {
 	A = RemoveFromStack();
-	set_flag(flag_Z, A == 0);
-	set_flag(flag_N, A & 0x80);
+	set_nz(A);
 }
 
 void cpu::BVS()
@@ -491,24 +977,23 @@ void cpu::SEI()
 
 void cpu::STA()
 {
-	cBUS->cRAM.write(full_addr, A);
+	cBUS->write(full_addr, A);
 }
 
 void cpu::STY()
 {
-	cBUS->cRAM.write(full_addr, Y);
+	cBUS->write(full_addr, Y);
 }
 
 void cpu::STX()
 {
-	cBUS->cRAM.write(full_addr, X);
+	cBUS->write(full_addr, X);
 }
 
 void cpu::DEY()
 {
 	Y--;
-	set_flag(flag_Z, Y == 0);
-	set_flag(flag_N, Y & 0x80);
+	set_nz(Y);
 }
 
 void cpu::TXA()
@@ -531,8 +1016,7 @@ void cpu::BCC()
 void cpu::TYA()
 {
 	A = Y;
-	set_flag(flag_Z, A == 0);
-	set_flag(flag_N, A & 0x80);
+	set_nz(A);
 }
 
 void cpu::TXS()
@@ -540,45 +1024,43 @@ void cpu::TXS()
 	new_SP.set_ptr(X);
 }
 
+template<cpu::mode M>
 void cpu::LDY()
 {
-	load_to_data();
+	load_to_data<M>();
 	Y = data;
-	set_flag(flag_Z, Y == 0);
-	set_flag(flag_N, Y & 0x80);
+	set_nz(Y);
 	clock_cycles++;
 }
 
+template<cpu::mode M>
 void cpu::LDA()
 {
-	load_to_data();
+	load_to_data<M>();
 	A = data;
-	set_flag(flag_Z, A == 0);
-	set_flag(flag_N, A & 0x80);
+	set_nz(A);
 	clock_cycles++;
 }
 
+template<cpu::mode M>
 void cpu::LDX()
 {
-	load_to_data();
+	load_to_data<M>();
 	X = data;
-	set_flag(flag_Z, X == 0);
-	set_flag(flag_N, X & 0x80);
+	set_nz(X);
 	clock_cycles++;
 }
 
 void cpu::TAY()
 {
 	Y = A;
-	set_flag(flag_Z, Y == 0);
-	set_flag(flag_N, Y & 0x80);
+	set_nz(Y);
 }
 
 void cpu::TAX()
 {
 	X = A;
-	set_flag(flag_Z, X == 0);
-	set_flag(flag_N, X & 0x80);
+	set_nz(X);
 }
 
 void cpu::BCS()
@@ -599,24 +1081,24 @@ void cpu::CLV()
 void cpu::TSX()
 {
 	X = new_SP.get_ptr();
-	set_flag(flag_Z, X == 0);
-	set_flag(flag_N, X & 0x80);
+	set_nz(X);
 }
 
+template<cpu::mode M>
 void cpu::CPY()
 {
-	load_to_data();
+	load_to_data<M>();
 
 	uint8_t comparison = (uint16_t)Y - (uint16_t)data;
 
 	set_flag(flag_C, Y >= data);
-	set_flag(flag_Z, comparison == 0);
-	set_flag(flag_N, comparison & 0x80);
+	set_nz(comparison);
 }
 
+template<cpu::mode M>
 void cpu::CMP()
 {
-	load_to_data();
+	load_to_data<M>();
 
 	uint8_t comparison = (uint16_t)A - (uint16_t)data;
 
@@ -626,30 +1108,28 @@ void cpu::CMP()
 	clock_cycles++;
 }
 
+template<cpu::mode M>
 void cpu::DEC()
 {
-	load_to_data();
+	load_to_data<M>();
 
 	data--;
 
-	set_flag(flag_Z, data == 0);
-	set_flag(flag_N, data & 0x80);
+	set_nz(data);
 
-	cBUS->cRAM.write(full_addr, data);
+	cBUS->write(full_addr, data);
 }
 
 void cpu::INY()
 {
 	Y++;
-	set_flag(flag_Z, Y == 0);
-	set_flag(flag_N, Y & 0x80);
+	set_nz(Y);
 }
 
 void cpu::DEX()
 {
 	X--;
-	set_flag(flag_Z, X == 0);
-	set_flag(flag_N, X & 0x80);
+	set_nz(X);
 }
 
 void cpu::BNE()
@@ -667,46 +1147,45 @@ void cpu::CLD()
 	set_flag(flag_D, false);
 }
 
+template<cpu::mode M>
 void cpu::CPX()
 {
-	load_to_data();
+	load_to_data<M>();
 
 	uint8_t comparison = (uint16_t)X - (uint16_t)data;
 
 	set_flag(flag_C, X >= data);
-	set_flag(flag_Z, comparison == 0);
-	set_flag(flag_N, comparison & 0x80);
+	set_nz(comparison);
 }
 
+template<cpu::mode M>
 void cpu::SBC()
 {
-	load_to_data();
+	load_to_data<M>();
 
 	uint16_t value = ((uint16_t)data) ^ 0x00FF;
 
 	uint16_t temp = (uint16_t)A + value + (uint16_t)get_status(flag_C);
 	set_flag(flag_C, temp & 0xFF00);
-	set_flag(flag_Z, ((temp & 0x00FF) == 0));
 	set_flag(flag_O, (temp ^ (uint16_t)A) & (temp ^ value) & 0x0080);
-	set_flag(flag_N, temp & 0x0080);
+	set_nz((uint8_t)temp);
 	A = temp & 0x00FF;
 
 	clock_cycles++;
 }
 
+template<cpu::mode M>
 void cpu::INC()
 {
-	load_to_data();
-	cBUS->cRAM.write(full_addr, ++data);
-	set_flag(flag_Z, data == 0);
-	set_flag(flag_N, data & 0x80);
+	load_to_data<M>();
+	cBUS->write(full_addr, ++data);
+	set_nz(data);
 }
 
 void cpu::INX()
 {
 	X++;
-	set_flag(flag_Z, X == 0);
-	set_flag(flag_N, X & 0x80);
+	set_nz(X);
 }
 
 void cpu::NOP()
@@ -727,3 +1206,201 @@ void cpu::SED()
 {
 	set_flag(flag_D);
 }
+
+#ifdef NES_SWITCH_CORE
+/*
+* Switch dispatch core
+* - Every opcode gets its own case calling its step handler directly,
+*	so the compiler can inline it and lower the whole decode to a
+*	single jump table
+*/
+void cpu::execute()
+{
+	switch (opcode) {
+	// 0
+	case 0x00: step<0x00>(); break;
+	case 0x01: step<0x01>(); break;
+	case 0x05: step<0x05>(); break;
+	case 0x06: step<0x06>(); break;
+	case 0x08: step<0x08>(); break;
+	case 0x09: step<0x09>(); break;
+	case 0x0A: step<0x0A>(); break;
+	case 0x0D: step<0x0D>(); break;
+	case 0x0E: step<0x0E>(); break;
+
+	// 1
+	case 0x10: step<0x10>(); break;
+	case 0x11: step<0x11>(); break;
+	case 0x15: step<0x15>(); break;
+	case 0x16: step<0x16>(); break;
+	case 0x18: step<0x18>(); break;
+	case 0x19: step<0x19>(); break;
+	case 0x1D: step<0x1D>(); break;
+	case 0x1E: step<0x1E>(); break;
+
+	// 2
+	case 0x20: step<0x20>(); break;
+	case 0x21: step<0x21>(); break;
+	case 0x24: step<0x24>(); break;
+	case 0x25: step<0x25>(); break;
+	case 0x26: step<0x26>(); break;
+	case 0x28: step<0x28>(); break;
+	case 0x29: step<0x29>(); break;
+	case 0x2A: step<0x2A>(); break;
+	case 0x2C: step<0x2C>(); break;
+	case 0x2D: step<0x2D>(); break;
+	case 0x2E: step<0x2E>(); break;
+
+	// 3
+	case 0x30: step<0x30>(); break;
+	case 0x31: step<0x31>(); break;
+	case 0x35: step<0x35>(); break;
+	case 0x36: step<0x36>(); break;
+	case 0x38: step<0x38>(); break;
+	case 0x39: step<0x39>(); break;
+	case 0x3D: step<0x3D>(); break;
+	case 0x3E: step<0x3E>(); break;
+
+	// 4
+	case 0x40: step<0x40>(); break;
+	case 0x41: step<0x41>(); break;
+	case 0x45: step<0x45>(); break;
+	case 0x46: step<0x46>(); break;
+	case 0x48: step<0x48>(); break;
+	case 0x49: step<0x49>(); break;
+	case 0x4A: step<0x4A>(); break;
+	case 0x4C: step<0x4C>(); break;
+	case 0x4D: step<0x4D>(); break;
+	case 0x4E: step<0x4E>(); break;
+
+	// 5
+	case 0x50: step<0x50>(); break;
+	case 0x51: step<0x51>(); break;
+	case 0x55: step<0x55>(); break;
+	case 0x56: step<0x56>(); break;
+	case 0x58: step<0x58>(); break;
+	case 0x59: step<0x59>(); break;
+	case 0x5D: step<0x5D>(); break;
+	case 0x5E: step<0x5E>(); break;
+
+	// 6
+	case 0x60: step<0x60>(); break;
+	case 0x61: step<0x61>(); break;
+	case 0x65: step<0x65>(); break;
+	case 0x66: step<0x66>(); break;
+	case 0x68: step<0x68>(); break;
+	case 0x69: step<0x69>(); break;
+	case 0x6A: step<0x6A>(); break;
+	case 0x6C: step<0x6C>(); break;
+	case 0x6D: step<0x6D>(); break;
+	case 0x6E: step<0x6E>(); break;
+
+	// 7
+	case 0x70: step<0x70>(); break;
+	case 0x71: step<0x71>(); break;
+	case 0x75: step<0x75>(); break;
+	case 0x76: step<0x76>(); break;
+	case 0x78: step<0x78>(); break;
+	case 0x79: step<0x79>(); break;
+	case 0x7D: step<0x7D>(); break;
+	case 0x7E: step<0x7E>(); break;
+
+	// 8
+	case 0x81: step<0x81>(); break;
+	case 0x84: step<0x84>(); break;
+	case 0x85: step<0x85>(); break;
+	case 0x86: step<0x86>(); break;
+	case 0x88: step<0x88>(); break;
+	case 0x8A: step<0x8A>(); break;
+	case 0x8C: step<0x8C>(); break;
+	case 0x8D: step<0x8D>(); break;
+	case 0x8E: step<0x8E>(); break;
+
+	// 9
+	case 0x90: step<0x90>(); break;
+	case 0x91: step<0x91>(); break;
+	case 0x94: step<0x94>(); break;
+	case 0x95: step<0x95>(); break;
+	case 0x96: step<0x96>(); break;
+	case 0x98: step<0x98>(); break;
+	case 0x99: step<0x99>(); break;
+	case 0x9A: step<0x9A>(); break;
+	case 0x9D: step<0x9D>(); break;
+
+	// A
+	case 0xA0: step<0xA0>(); break;
+	case 0xA1: step<0xA1>(); break;
+	case 0xA2: step<0xA2>(); break;
+	case 0xA4: step<0xA4>(); break;
+	case 0xA5: step<0xA5>(); break;
+	case 0xA6: step<0xA6>(); break;
+	case 0xA8: step<0xA8>(); break;
+	case 0xA9: step<0xA9>(); break;
+	case 0xAA: step<0xAA>(); break;
+	case 0xAC: step<0xAC>(); break;
+	case 0xAD: step<0xAD>(); break;
+	case 0xAE: step<0xAE>(); break;
+
+	// B
+	case 0xB0: step<0xB0>(); break;
+	case 0xB1: step<0xB1>(); break;
+	case 0xB4: step<0xB4>(); break;
+	case 0xB5: step<0xB5>(); break;
+	case 0xB6: step<0xB6>(); break;
+	case 0xB8: step<0xB8>(); break;
+	case 0xB9: step<0xB9>(); break;
+	case 0xBA: step<0xBA>(); break;
+	case 0xBC: step<0xBC>(); break;
+	case 0xBD: step<0xBD>(); break;
+	case 0xBE: step<0xBE>(); break;
+
+	// C
+	case 0xC0: step<0xC0>(); break;
+	case 0xC1: step<0xC1>(); break;
+	case 0xC4: step<0xC4>(); break;
+	case 0xC5: step<0xC5>(); break;
+	case 0xC6: step<0xC6>(); break;
+	case 0xC8: step<0xC8>(); break;
+	case 0xC9: step<0xC9>(); break;
+	case 0xCA: step<0xCA>(); break;
+	case 0xCC: step<0xCC>(); break;
+	case 0xCD: step<0xCD>(); break;
+	case 0xCE: step<0xCE>(); break;
+
+	// D
+	case 0xD0: step<0xD0>(); break;
+	case 0xD1: step<0xD1>(); break;
+	case 0xD5: step<0xD5>(); break;
+	case 0xD6: step<0xD6>(); break;
+	case 0xD8: step<0xD8>(); break;
+	case 0xD9: step<0xD9>(); break;
+	case 0xDD: step<0xDD>(); break;
+	case 0xDE: step<0xDE>(); break;
+
+	// E
+	case 0xE0: step<0xE0>(); break;
+	case 0xE1: step<0xE1>(); break;
+	case 0xE4: step<0xE4>(); break;
+	case 0xE5: step<0xE5>(); break;
+	case 0xE6: step<0xE6>(); break;
+	case 0xE8: step<0xE8>(); break;
+	case 0xE9: step<0xE9>(); break;
+	case 0xEA: step<0xEA>(); break;
+	case 0xEC: step<0xEC>(); break;
+	case 0xED: step<0xED>(); break;
+	case 0xEE: step<0xEE>(); break;
+
+	// F
+	case 0xF0: step<0xF0>(); break;
+	case 0xF1: step<0xF1>(); break;
+	case 0xF5: step<0xF5>(); break;
+	case 0xF6: step<0xF6>(); break;
+	case 0xF8: step<0xF8>(); break;
+	case 0xF9: step<0xF9>(); break;
+	case 0xFD: step<0xFD>(); break;
+	case 0xFE: step<0xFE>(); break;
+
+	default: break;
+	}
+}
+#endif
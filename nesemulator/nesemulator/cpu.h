@@ -1,8 +1,16 @@
 #pragma once
 #include <cstdint>
-#include <string>
+#include "state.h"
+
+#ifdef NES_PROFILE
+#include "profiler.h"
+#endif
+#ifdef NES_TRACE
+#include "tracer.h"
+#endif
 
 class bus; // Forward declared to avoid circular dependency
+class block_cache;
 
 /*
 * Addressable ranges
@@ -34,6 +42,7 @@ private:
 	uint16_t lo;
 	uint16_t full_addr;
 	uint16_t rel_addr;	// Used in branch instructions
+	bool page_crossed;	// Set by indexed address modes that crossed a page
 
 public:
 	/*
@@ -111,7 +120,7 @@ public:
 	/*
 	* Registers
 	*/
-	const enum flag {
+	enum flag {
 		Empty_Flag = 0,
 		flag_C = 0x1,		// Carry
 		flag_Z = 0x1 << 1,	// Zero
@@ -130,7 +139,42 @@ public:
 
 	uint8_t PF; // Processor Flags
 	inline void set_flag(flag, bool);
+	inline void set_nz(uint8_t inValue);	// N and Z from one result
 	inline bool get_status(flag);
+
+	/*
+	* Lazy flags
+	* ---
+	* Build with NES_LAZY_FLAGS defined to keep N, Z, C and V out of PF.
+	* Operations store what decides each flag instead, usually just the
+	* result, and the flag is worked out when a branch, PHP, BRK, an
+	* interrupt or a save state reads it. PF still holds the other flags,
+	* so code outside the cpu reads and writes the flags through flags()
+	* and set_flags() in both builds
+	*/
+#ifdef NES_LAZY_FLAGS
+	uint8_t lazy_Z;	// Z is set when this is 0
+	uint8_t lazy_N;	// N is bit 7 of this
+	bool lazy_C;
+	bool lazy_V;
+
+	uint8_t flags() const
+	{
+		return (PF & ~(flag_N | flag_Z | flag_C | flag_O)) | (lazy_N & flag_N)
+			| (lazy_Z ? 0 : flag_Z) | (lazy_C ? flag_C : 0) | (lazy_V ? flag_O : 0);
+	}
+	void set_flags(uint8_t inFlags)
+	{
+		PF = inFlags;
+		lazy_Z = !(inFlags & flag_Z);
+		lazy_N = inFlags & flag_N;
+		lazy_C = inFlags & flag_C;
+		lazy_V = inFlags & flag_O;
+	}
+#else
+	uint8_t flags() const { return PF; }
+	void set_flags(uint8_t inFlags) { PF = inFlags; }
+#endif
 	inline void AddToStack(uint8_t);
 	inline uint8_t RemoveFromStack();
 
@@ -141,258 +185,343 @@ public:
 
 public:
 	uint8_t clock_cycles;
+	uint64_t total_cycles;	// Cycles run since reset
 	uint8_t opcode;
 	void clock();
-	void load_to_data();
+
+	/*
+	* Run the interrupt sequence at the current instruction boundary. The
+	* bus decides when from the cycles its interrupt sources scheduled
+	*/
+	void nmi();
+	void irq();
+	bool irq_enabled() const { return !(PF & flag_I); }
+
+	void save_state(state_writer&) const;
+	void load_state(state_reader&);
+
+private:
+	void interrupt(uint16_t inVector);
+
+public:
+
+#ifdef NES_TRACE
+	tracer trace;	// Call trace.enable() to start recording
+#endif
+
+#ifdef NES_PROFILE
+	profiler profile;	// Call profile.enable() to start counting
+#endif
+
+#ifdef NES_SWITCH_CORE
+	/*
+	* Build with NES_SWITCH_CORE defined to replace the member function
+	* pointer lookups in clock() with one switch over the opcode
+	*/
+	void execute();
+#endif
 
 public:
 	uint8_t data;
-	struct instruction {
-		std::string title = "";			// Title of Pperation
-		void (cpu::* operation)() = nullptr;	// Pointer to operation method
-		void (cpu::* addr_mode)() = nullptr;	// Pointer to address mode method
-		uint8_t bytes = 0;				// Instruction bytes
-		uint8_t MC = 0;					// Machine cycles
+
+	/*
+	* Address modes and operations as plain values so the opcode table
+	* below can be read by the compiler
+	*/
+	enum class mode : uint8_t {
+		none, acc, abs, absx, absy, imm, impl, ind, xind, yind, rel, zpg, zpgx, zpgy
+	};
+	enum class op : uint8_t {
+		none, BRK, ORA, ASL, PHP, BPL, CLC, JSR,
+		AND, BIT, ROL, PLP, BMI, SEC, RTI, EOR,
+		LSR, PHA, JMP, BVC, CLI, RTS, ADC, ROR,
+		PLA, BVS, SEI, STA, STY, STX, DEY, TXA,
+		BCC, TYA, TXS, LDY, LDA, LDX, TAY, TAX,
+		BCS, CLV, TSX, CPY, CMP, DEC, INY, DEX,
+		BNE, CLD, CPX, SBC, INC, INX, NOP, BEQ,
+		SED
+	};
+	struct opcode_info {
+		op operation;		// Operation to run, also indexes the mnemonic table
+		mode addressing;	// Address mode used to find its data
+		uint8_t bytes;		// Instruction bytes
+		uint8_t cycles;		// Base machine cycles
+		bool page_cross;	// Add a cycle when indexing crosses a page
 	};
 	/*
-	* the instruction struct holds all the relevant data for each instruction
-	* including pointers to the address mode and op methods
+	* Compile time description of every opcode, shared by all cpus.
+	* Each step<opcode>() is generated from its entry, so the hot path
+	* never reads this table. Mnemonics live apart in mnemonic() as
+	* only tracing and disassembly need them
 	*/
-	// This is where all the instrucitons are stored
-	instruction allinstructions[0xFF]
+	static constexpr opcode_info opcode_table[0x100]
 	{
-		{"BRK", &cpu::BRK, &cpu::impl, 1, 7 },	// 0
-		{"ORA", &cpu::ORA, &cpu::xind, 2, 6 },
+		{ op::BRK, mode::impl, 1, 7, false },	// 0
+		{ op::ORA, mode::xind, 2, 6, false },
 		{}, {}, {},
-		{"ORA", &cpu::ORA, &cpu::zpg, 2, 3 },
-		{"ASL", &cpu::ASL, &cpu::zpg, 2, 5 },
+		{ op::ORA, mode::zpg, 2, 3, false },
+		{ op::ASL, mode::zpg, 2, 5, false },
 		{},
-		{"PHP", &cpu::PHP, &cpu::impl, 1, 3 },
-		{"ORA", &cpu::ORA, &cpu::imm, 2, 2 },
-		{"ASL", &cpu::ASL, &cpu::acc, 1, 2 },
+		{ op::PHP, mode::impl, 1, 3, false },
+		{ op::ORA, mode::imm, 2, 2, false },
+		{ op::ASL, mode::acc, 1, 2, false },
 		{}, {},
-		{"ORA", &cpu::ORA, &cpu::abs, 3, 4 },
-		{"ASL", &cpu::ASL, &cpu::abs, 3, 6 },
+		{ op::ORA, mode::abs, 3, 4, false },
+		{ op::ASL, mode::abs, 3, 6, false },
 		{},
 
-		{"BPL", &cpu::BPL, &cpu::rel, 2, 2 },	// 1
-		{"ORA", &cpu::ORA, &cpu::yind, 2, 5 },
+		{ op::BPL, mode::rel, 2, 2, false },	// 1
+		{ op::ORA, mode::yind, 2, 5, true },
 		{}, {}, {},
-		{"ORA", &cpu::ORA, &cpu::zpgx, 2, 4 },
-		{"ASL", &cpu::ASL, &cpu::zpgx, 2, 6 },
+		{ op::ORA, mode::zpgx, 2, 4, false },
+		{ op::ASL, mode::zpgx, 2, 6, false },
 		{},
-		{"CLC", &cpu::CLC, &cpu::impl, 1, 2 },
-		{"ORA", &cpu::ORA, &cpu::absy, 3, 4 },
+		{ op::CLC, mode::impl, 1, 2, false },
+		{ op::ORA, mode::absy, 3, 4, true },
 		{}, {}, {},
-		{"ORA", &cpu::ORA, &cpu::absx, 3, 4 },
-		{"ASL", &cpu::ASL, &cpu::absx, 3, 7 },
+		{ op::ORA, mode::absx, 3, 4, true },
+		{ op::ASL, mode::absx, 3, 7, false },
 		{},
 
-		{"JSR", &cpu::JSR, &cpu::abs, 3, 6 },	// 2
-		{"AND", &cpu::AND, &cpu::xind, 2, 6 },
+		{ op::JSR, mode::abs, 3, 6, false },	// 2
+		{ op::AND, mode::xind, 2, 6, false },
 		{}, {},
-		{"BIT", &cpu::BIT, &cpu::zpg, 2, 3 },
-		{"AND", &cpu::AND, &cpu::zpg, 2, 3 },
-		{"ROL", &cpu::ROL, &cpu::zpg, 2, 5 },
+		{ op::BIT, mode::zpg, 2, 3, false },
+		{ op::AND, mode::zpg, 2, 3, false },
+		{ op::ROL, mode::zpg, 2, 5, false },
 		{},
-		{"PLP", &cpu::PLP, &cpu::impl, 1, 4 },
-		{"AND", &cpu::AND, &cpu::imm, 2, 2 },
-		{"ROL", &cpu::ROL, &cpu::acc, 1, 2 },
+		{ op::PLP, mode::impl, 1, 4, false },
+		{ op::AND, mode::imm, 2, 2, false },
+		{ op::ROL, mode::acc, 1, 2, false },
 		{},
-		{"BIT", &cpu::BIT, &cpu::abs, 3, 4 },
-		{"AND", &cpu::AND, &cpu::abs, 3, 4 },
-		{"ROL", &cpu::ROL, &cpu::abs, 3, 6 },
+		{ op::BIT, mode::abs, 3, 4, false },
+		{ op::AND, mode::abs, 3, 4, false },
+		{ op::ROL, mode::abs, 3, 6, false },
 		{},
 
-		{"BMI", &cpu::BMI, &cpu::rel, 2, 2 },	// 3
-		{"AND", &cpu::AND, &cpu::yind, 2, 5 },
+		{ op::BMI, mode::rel, 2, 2, false },	// 3
+		{ op::AND, mode::yind, 2, 5, true },
 		{}, {}, {},
-		{"AND", &cpu::AND, &cpu::zpgx, 2, 4 },
-		{"ROL", &cpu::ROL, &cpu::zpgx, 2, 6 },
+		{ op::AND, mode::zpgx, 2, 4, false },
+		{ op::ROL, mode::zpgx, 2, 6, false },
 		{},
-		{"SEC", &cpu::SEC, &cpu::impl, 1, 2 },
-		{"AND", &cpu::AND, &cpu::absy, 3, 4 },
+		{ op::SEC, mode::impl, 1, 2, false },
+		{ op::AND, mode::absy, 3, 4, true },
 		{}, {}, {},
-		{"AND", &cpu::AND, &cpu::absx, 3, 4 },
-		{"ROL", &cpu::ROL, &cpu::absx, 3, 7 },
+		{ op::AND, mode::absx, 3, 4, true },
+		{ op::ROL, mode::absx, 3, 7, false },
 		{},
 
-		{"RTI", &cpu::RTI, &cpu::impl, 1, 6 },	// 4
-		{"EOR", &cpu::EOR, &cpu::xind, 2, 6 },
+		{ op::RTI, mode::impl, 1, 6, false },	// 4
+		{ op::EOR, mode::xind, 2, 6, false },
 		{}, {}, {},
-		{"EOR", &cpu::EOR, &cpu::zpg, 2, 3 },
-		{"LSR", &cpu::LSR, &cpu::zpg, 2, 5 },
+		{ op::EOR, mode::zpg, 2, 3, false },
+		{ op::LSR, mode::zpg, 2, 5, false },
 		{},
-		{"PHA", &cpu::PHA, &cpu::impl, 1, 3 },
-		{"EOR", &cpu::EOR, &cpu::imm, 2, 2 },
-		{"LSR", &cpu::LSR, &cpu::acc, 1, 2 },
+		{ op::PHA, mode::impl, 1, 3, false },
+		{ op::EOR, mode::imm, 2, 2, false },
+		{ op::LSR, mode::acc, 1, 2, false },
 		{},
-		{"JMP", &cpu::JMP, &cpu::abs, 3, 3 },
-		{"EOR", &cpu::EOR, &cpu::abs, 3, 4 },
-		{"LSR", &cpu::LSR, &cpu::abs, 3, 6 },
+		{ op::JMP, mode::abs, 3, 3, false },
+		{ op::EOR, mode::abs, 3, 4, false },
+		{ op::LSR, mode::abs, 3, 6, false },
 		{},
 
-		{"BVC", &cpu::BVC, &cpu::rel, 2, 2 },	// 5
-		{"EOR", &cpu::EOR, &cpu::yind, 2, 5 },
+		{ op::BVC, mode::rel, 2, 2, false },	// 5
+		{ op::EOR, mode::yind, 2, 5, true },
 		{}, {}, {},
-		{"EOR", &cpu::EOR, &cpu::zpgx, 2, 4 },
-		{"LSR", &cpu::LSR, &cpu::zpgx, 2, 6 },
+		{ op::EOR, mode::zpgx, 2, 4, false },
+		{ op::LSR, mode::zpgx, 2, 6, false },
 		{},
-		{"CLI", &cpu::CLI, &cpu::impl, 1, 2 },
-		{"EOR", &cpu::EOR, &cpu::absy, 3, 4 },
+		{ op::CLI, mode::impl, 1, 2, false },
+		{ op::EOR, mode::absy, 3, 4, true },
 		{}, {}, {},
-		{"EOR", &cpu::EOR, &cpu::absx, 3, 4 },
-		{"LSR", &cpu::LSR, &cpu::absx, 3, 7 },
+		{ op::EOR, mode::absx, 3, 4, true },
+		{ op::LSR, mode::absx, 3, 7, false },
 		{},
 
-		{"RTS", &cpu::RTS, &cpu::impl, 1, 6 },	// 6
-		{"ADC", &cpu::ADC, &cpu::xind, 2, 6 },
+		{ op::RTS, mode::impl, 1, 6, false },	// 6
+		{ op::ADC, mode::xind, 2, 6, false },
 		{}, {}, {},
-		{"ADC", &cpu::ADC, &cpu::zpg, 2, 3 },
-		{"ROR", &cpu::ROR, &cpu::zpg, 2, 5 },
+		{ op::ADC, mode::zpg, 2, 3, false },
+		{ op::ROR, mode::zpg, 2, 5, false },
 		{},
-		{"PLA", &cpu::PLA, &cpu::impl, 1, 4 },
-		{"ADC", &cpu::ADC, &cpu::imm, 2, 2 },
-		{"ROR", &cpu::ROR, &cpu::acc, 1, 2 },
+		{ op::PLA, mode::impl, 1, 4, false },
+		{ op::ADC, mode::imm, 2, 2, false },
+		{ op::ROR, mode::acc, 1, 2, false },
 		{},
-		{"JMP", &cpu::JMP, &cpu::ind, 3, 5 },
-		{"ADC", &cpu::ADC, &cpu::abs, 3, 4 },
-		{"ROR", &cpu::ROR, &cpu::abs, 3, 6 },
+		{ op::JMP, mode::ind, 3, 5, false },
+		{ op::ADC, mode::abs, 3, 4, false },
+		{ op::ROR, mode::abs, 3, 6, false },
 		{},
 
-		{"BVS", &cpu::BVS, &cpu::rel, 2, 2 },	// 7
-		{"ADC", &cpu::ADC, &cpu::yind, 2, 5 },
+		{ op::BVS, mode::rel, 2, 2, false },	// 7
+		{ op::ADC, mode::yind, 2, 5, true },
 		{}, {}, {},
-		{"ADC", &cpu::ADC, &cpu::zpgx, 2, 4 },
-		{"ROR", &cpu::ROR, &cpu::zpgx, 2, 6 },
+		{ op::ADC, mode::zpgx, 2, 4, false },
+		{ op::ROR, mode::zpgx, 2, 6, false },
 		{},
-		{"SEI", &cpu::SEI, &cpu::impl, 1, 2 },
-		{"ADC", &cpu::ADC, &cpu::absy, 3, 4 },
+		{ op::SEI, mode::impl, 1, 2, false },
+		{ op::ADC, mode::absy, 3, 4, true },
 		{}, {}, {},
-		{"ADC", &cpu::ADC, &cpu::absx, 3, 4 },
-		{"ROR", &cpu::ROR, &cpu::absx, 3, 7 },
+		{ op::ADC, mode::absx, 3, 4, true },
+		{ op::ROR, mode::absx, 3, 7, false },
 		{},
 
-		{},										// 8
-		{"STA", &cpu::STA, &cpu::xind, 2, 6 },
+		{},	// 8
+		{ op::STA, mode::xind, 2, 6, false },
 		{}, {},
-		{"STY", &cpu::STY, &cpu::zpg, 2, 3 },
-		{"STA", &cpu::STA, &cpu::zpg, 2, 3 },
-		{"STX", &cpu::STX, &cpu::zpg, 2, 3 },
+		{ op::STY, mode::zpg, 2, 3, false },
+		{ op::STA, mode::zpg, 2, 3, false },
+		{ op::STX, mode::zpg, 2, 3, false },
 		{},
-		{"DEY", &cpu::DEY, &cpu::impl, 1, 2 },
+		{ op::DEY, mode::impl, 1, 2, false },
 		{},
-		{"TXA", &cpu::TXA, &cpu::impl, 1, 2 },
+		{ op::TXA, mode::impl, 1, 2, false },
 		{},
-		{"STY", &cpu::STY, &cpu::abs, 3, 4 },
-		{"STA", &cpu::STA, &cpu::abs, 3, 4 },
-		{"STX", &cpu::STX, &cpu::abs, 3, 4 },
+		{ op::STY, mode::abs, 3, 4, false },
+		{ op::STA, mode::abs, 3, 4, false },
+		{ op::STX, mode::abs, 3, 4, false },
 		{},
 
-		{"BCC", &cpu::BCC, &cpu::rel, 2, 2 },	// 9
-		{"STA", &cpu::STA, &cpu::yind, 2, 6 },
+		{ op::BCC, mode::rel, 2, 2, false },	// 9
+		{ op::STA, mode::yind, 2, 6, false },
 		{}, {},
-		{"STY", &cpu::STY, &cpu::zpgx, 2, 4 },
-		{"STA", &cpu::STA, &cpu::zpgx, 2, 4 },
-		{"STX", &cpu::STX, &cpu::zpgy, 2, 4 },
+		{ op::STY, mode::zpgx, 2, 4, false },
+		{ op::STA, mode::zpgx, 2, 4, false },
+		{ op::STX, mode::zpgy, 2, 4, false },
 		{},
-		{"TYA", &cpu::TYA, &cpu::impl, 1, 2 },
-		{"STA", &cpu::STA, &cpu::absy, 3, 5 },
-		{"TXS", &cpu::TXS, &cpu::impl, 1, 2 },
+		{ op::TYA, mode::impl, 1, 2, false },
+		{ op::STA, mode::absy, 3, 5, false },
+		{ op::TXS, mode::impl, 1, 2, false },
 		{}, {},
-		{"STA", &cpu::STA, &cpu::absx, 3, 5 },
+		{ op::STA, mode::absx, 3, 5, false },
 		{}, {},
 
-		{"LDY", &cpu::LDY, &cpu::imm, 2, 2 },	// A
-		{"LDA", &cpu::LDA, &cpu::xind, 2, 6 },
-		{"LDX", &cpu::LDX, &cpu::imm, 2, 2 },
+		{ op::LDY, mode::imm, 2, 2, false },	// A
+		{ op::LDA, mode::xind, 2, 6, false },
+		{ op::LDX, mode::imm, 2, 2, false },
 		{},
-		{"LDY", &cpu::LDY, &cpu::zpg, 2, 3 },
-		{"LDA", &cpu::LDA, &cpu::zpg, 2, 3 },
-		{"LDX", &cpu::LDX, &cpu::zpg, 2, 3 },
+		{ op::LDY, mode::zpg, 2, 3, false },
+		{ op::LDA, mode::zpg, 2, 3, false },
+		{ op::LDX, mode::zpg, 2, 3, false },
 		{},
-		{"TAY", &cpu::TAY, &cpu::impl, 1, 2 },
-		{"LDA", &cpu::LDA, &cpu::imm, 2, 2 },
-		{"TAX", &cpu::TAX, &cpu::impl, 1, 2 },
+		{ op::TAY, mode::impl, 1, 2, false },
+		{ op::LDA, mode::imm, 2, 2, false },
+		{ op::TAX, mode::impl, 1, 2, false },
 		{},
-		{"LDY", &cpu::LDY, &cpu::abs, 3, 4 },
-		{"LDA", &cpu::LDA, &cpu::abs, 3, 4 },
-		{"LDX", &cpu::LDX, &cpu::abs, 3, 4 },
+		{ op::LDY, mode::abs, 3, 4, false },
+		{ op::LDA, mode::abs, 3, 4, false },
+		{ op::LDX, mode::abs, 3, 4, false },
 		{},
 
-		{"BCS", &cpu::BCS, &cpu::rel, 2, 2 },	// B
-		{"LDA", &cpu::LDA, &cpu::yind, 2, 5 },
+		{ op::BCS, mode::rel, 2, 2, false },	// B
+		{ op::LDA, mode::yind, 2, 5, true },
 		{}, {},
-		{"LDY", &cpu::LDY, &cpu::zpgx, 2, 4 },
-		{"LDA", &cpu::LDA, &cpu::zpgx, 2, 4 },
-		{"LDX", &cpu::LDX, &cpu::zpgy, 2, 4 },
+		{ op::LDY, mode::zpgx, 2, 4, false },
+		{ op::LDA, mode::zpgx, 2, 4, false },
+		{ op::LDX, mode::zpgy, 2, 4, false },
 		{},
-		{"CLV", &cpu::CLV, &cpu::impl, 1, 2 },
-		{"LDA", &cpu::LDA, &cpu::absy, 3, 4 },
-		{"TSX", &cpu::TSX, &cpu::impl, 1, 2 },
+		{ op::CLV, mode::impl, 1, 2, false },
+		{ op::LDA, mode::absy, 3, 4, true },
+		{ op::TSX, mode::impl, 1, 2, false },
 		{},
-		{"LDY", &cpu::LDY, &cpu::absx, 3, 4 },
-		{"LDA", &cpu::LDA, &cpu::absx, 3, 4 },
-		{"LDX", &cpu::LDX, &cpu::absy, 3, 4 },
+		{ op::LDY, mode::absx, 3, 4, true },
+		{ op::LDA, mode::absx, 3, 4, true },
+		{ op::LDX, mode::absy, 3, 4, true },
 		{},
 
-		{"CPY", &cpu::CPY, &cpu::imm, 2, 2 },	// C
-		{"CMP", &cpu::CMP, &cpu::xind, 2, 6 },
+		{ op::CPY, mode::imm, 2, 2, false },	// C
+		{ op::CMP, mode::xind, 2, 6, false },
 		{}, {},
-		{"CPY", &cpu::CPY, &cpu::zpg, 2, 3 },
-		{"CMP", &cpu::CMP, &cpu::zpg, 2, 3 },
-		{"DEC", &cpu::DEC, &cpu::zpg, 2, 5 },
+		{ op::CPY, mode::zpg, 2, 3, false },
+		{ op::CMP, mode::zpg, 2, 3, false },
+		{ op::DEC, mode::zpg, 2, 5, false },
 		{},
-		{"INY", &cpu::INY, &cpu::impl, 1, 2 },
-		{"CMP", &cpu::CMP, &cpu::imm, 2, 2 },
-		{"DEX", &cpu::DEX, &cpu::impl, 1, 2 },
+		{ op::INY, mode::impl, 1, 2, false },
+		{ op::CMP, mode::imm, 2, 2, false },
+		{ op::DEX, mode::impl, 1, 2, false },
 		{},
-		{"CPY", &cpu::CPY, &cpu::abs, 3, 4 },
-		{"CMP", &cpu::CMP, &cpu::abs, 3, 4 },
-		{"DEC", &cpu::DEC, &cpu::abs, 3, 6 },
+		{ op::CPY, mode::abs, 3, 4, false },
+		{ op::CMP, mode::abs, 3, 4, false },
+		{ op::DEC, mode::abs, 3, 6, false },
 		{},
 
-		{"BNE", &cpu::BNE, &cpu::rel, 2, 2 },	// D
-		{"CMP", &cpu::CMP, &cpu::yind, 2, 5 },
+		{ op::BNE, mode::rel, 2, 2, false },	// D
+		{ op::CMP, mode::yind, 2, 5, true },
 		{}, {}, {},
-		{"CMP", &cpu::CMP, &cpu::zpgx, 2, 4 },
-		{"DEC", &cpu::DEC, &cpu::zpgx, 2, 6 },
+		{ op::CMP, mode::zpgx, 2, 4, false },
+		{ op::DEC, mode::zpgx, 2, 6, false },
 		{},
-		{"CLD", &cpu::CLD, &cpu::impl, 1, 2 },
-		{"CMP", &cpu::CMP, &cpu::absy, 3, 4 },
+		{ op::CLD, mode::impl, 1, 2, false },
+		{ op::CMP, mode::absy, 3, 4, true },
 		{}, {}, {},
-		{"CMP", &cpu::CMP, &cpu::absx, 3, 4 },
-		{"DEC", &cpu::DEC, &cpu::absx, 3, 7 },
+		{ op::CMP, mode::absx, 3, 4, true },
+		{ op::DEC, mode::absx, 3, 7, false },
 		{},
 
-		{"CPX", &cpu::CPX, &cpu::imm, 2, 2 },	// E
-		{"SBC", &cpu::SBC, &cpu::xind, 2, 6 },
+		{ op::CPX, mode::imm, 2, 2, false },	// E
+		{ op::SBC, mode::xind, 2, 6, false },
 		{}, {},
-		{"CPX", &cpu::CPX, &cpu::zpg, 2, 3 },
-		{"SBC", &cpu::SBC, &cpu::zpg, 2, 3 },
-		{"INC", &cpu::INC, &cpu::zpg, 2, 5 },
+		{ op::CPX, mode::zpg, 2, 3, false },
+		{ op::SBC, mode::zpg, 2, 3, false },
+		{ op::INC, mode::zpg, 2, 5, false },
 		{},
-		{"INX", &cpu::INX, &cpu::impl, 1, 2 },
-		{"SBC", &cpu::SBC, &cpu::imm, 2, 2 },
-		{"NOP", &cpu::NOP, &cpu::impl, 1, 2 },
+		{ op::INX, mode::impl, 1, 2, false },
+		{ op::SBC, mode::imm, 2, 2, false },
+		{ op::NOP, mode::impl, 1, 2, false },
 		{},
-		{"CPX", &cpu::CPX, &cpu::abs, 3, 4 },
-		{"SBC", &cpu::SBC, &cpu::abs, 3, 4 },
-		{"INC", &cpu::INC, &cpu::abs, 3, 6 },
+		{ op::CPX, mode::abs, 3, 4, false },
+		{ op::SBC, mode::abs, 3, 4, false },
+		{ op::INC, mode::abs, 3, 6, false },
 		{},
 
-		{"BEQ", &cpu::BEQ, &cpu::rel, 2, 2 },	// F
-		{"SBC", &cpu::SBC, &cpu::yind, 2, 5 },
+		{ op::BEQ, mode::rel, 2, 2, false },	// F
+		{ op::SBC, mode::yind, 2, 5, true },
 		{}, {}, {},
-		{"SBC", &cpu::SBC, &cpu::zpgx, 2, 4 },
-		{"INC", &cpu::INC, &cpu::zpgx, 2, 6 },
+		{ op::SBC, mode::zpgx, 2, 4, false },
+		{ op::INC, mode::zpgx, 2, 6, false },
 		{},
-		{"SED", &cpu::SED, &cpu::impl, 1, 2 },
-		{"SBC", &cpu::SBC, &cpu::absy, 3, 4 },
+		{ op::SED, mode::impl, 1, 2, false },
+		{ op::SBC, mode::absy, 3, 4, true },
 		{}, {}, {},
-		{"SBC", &cpu::SBC, &cpu::absx, 3, 4 },
-		{"INC", &cpu::INC, &cpu::absx, 3, 7 },
+		{ op::SBC, mode::absx, 3, 4, true },
+		{ op::INC, mode::absx, 3, 7, false },
+		{},
 	};
+	static const char* mnemonic(op);
+
+	/*
+	* Opcode handlers
+	* - One fully specialised function per opcode with the address mode,
+	*	operation and cycle count resolved at compile time
+	*/
+	using handler = void (cpu::*)();
+	template<uint8_t OPC> void step();
+
+	/*
+	* Decoded instructions
+	* - What the block cache stores per instruction. The handler takes the
+	*	operand bytes from the entry instead of the bus and runs one opcode,
+	*	or for a superinstruction the run of entries its sequence matched.
+	*	It returns how many entries it ran, stopping early wherever
+	*	run_blocks would have stopped between them
+	*/
+	struct decoded;
+	using decoded_handler = uint32_t (cpu::*)(const decoded* inOps, const uint64_t& inEnd, const uint32_t& inGeneration);
+	struct decoded {
+		decoded_handler run;
+		uint16_t pc;
+		uint16_t operand;	// Operand bytes, little endian
+		uint8_t opcode;
+	};
+	template<uint8_t... OPS> uint32_t run_decoded(const decoded* inOps, const uint64_t& inEnd, const uint32_t& inGeneration);
+	static decoded_handler handler_for(uint8_t inOpcode);
+	// Longest superinstruction the opcodes start with, nullptr if none
+	static decoded_handler fused_handler(const uint8_t* inOpcodes, uint32_t inCount, uint32_t& outLength);
+
+	// Run cached blocks until total_cycles reaches inEnd, which may move while running
+	void run_blocks(block_cache&, const uint64_t& inEnd);
 
 	/*
 	* Addressing modes
@@ -414,6 +543,16 @@ public:
 	void zpgx();	// Zeropage X
 	void zpgy();	// Zerpage Y
 
+private:
+	uint16_t operand;	// Predecoded operand bytes for step_decoded
+
+	template<uint8_t OPC> void step_decoded(const decoded& inOp);
+
+	template<mode M> void address();		// Calls the address mode method for M
+	template<mode M> void address_decoded();	// address() taking the operand bytes from operand
+	template<mode M> void load_to_data();	// Reads the operand for M into data
+	template<op O, mode M> void operate();	// Calls the operation for O
+
 private:
 	/*
 	* operations
@@ -421,28 +560,28 @@ private:
 	* http://archive.6502.org/datasheets/rockwell_r650x_r651x.pdf
 	*/
 	void BRK();		// Force Break
-	void ORA();		// Or with Accumulator
-	void ASL();		// Arithmetic Shift Left
+	template<mode M> void ORA();		// Or with Accumulator
+	template<mode M> void ASL();		// Arithmetic Shift Left
 	void PHP();		// Push Processor Status
 	void BPL();		// Branch if Positive
 	void CLC();		// Clear Carry Flag
 	void JSR();		// Jump to Subroutine
-	void AND();		// Bitwise and. Don't store result
-	void BIT();		// Bit test
-	void ROL();		// Rotate Left
+	template<mode M> void AND();		// Bitwise and. Don't store result
+	template<mode M> void BIT();		// Bit test
+	template<mode M> void ROL();		// Rotate Left
 	void PLP();		// Pull Processor Status
 	void BMI();		// Branch if Minus
 	void SEC();		// Set carry flag
 	void RTI();		// Return from Interrupt
-	void EOR();		// Exclusive or
-	void LSR();		// Logical shift right
+	template<mode M> void EOR();		// Exclusive or
+	template<mode M> void LSR();		// Logical shift right
 	void PHA();		// Push Accumulator to stack
 	void JMP();		// Jump to address
 	void BVC();		// Branch if Overflow Clear
 	void CLI();		// Clear Interrupt Disable
 	void RTS();		// Return from Subroutine
-	void ADC();		// Add with carry
-	void ROR();		// Rotate right
+	template<mode M> void ADC();		// Add with carry
+	template<mode M> void ROR();		// Rotate right
 	void PLA();		// Pull from stack into accumulator
 	void BVS();		// Branch if Overflow set
 	void SEI();		// Set interrupt disable
@@ -454,24 +593,24 @@ private:
 	void BCC();		// Branch if carry clear
 	void TYA();		// Transfer Accululator to Y
 	void TXS();		// Transfer X to stack
-	void LDY();		// Load accumulator with Y
-	void LDA();		// Load accumulator with A
-	void LDX();		// Load accumulator with X
+	template<mode M> void LDY();		// Load accumulator with Y
+	template<mode M> void LDA();		// Load accumulator with A
+	template<mode M> void LDX();		// Load accumulator with X
 	void TAY();		// Transfer accumulator to Y
 	void TAX();		// Transfer accumulator to X
 	void BCS();		// Branch if carry flag set
 	void CLV();		// Clear overflow flag
 	void TSX();		// Transfer stack pointer to X
-	void CPY();		// Compare Y register to read in data
-	void CMP();		// Compare A register to read in data
-	void DEC();		// Decrement from value held at mem address
+	template<mode M> void CPY();		// Compare Y register to read in data
+	template<mode M> void CMP();		// Compare A register to read in data
+	template<mode M> void DEC();		// Decrement from value held at mem address
 	void INY();		// Increment Y register
 	void DEX();		// Decrement X register
 	void BNE();		// Branch if not equal
 	void CLD();		// Clear decimal mode
-	void CPX();		// Compare X register
-	void SBC();		// Subtract with carry
-	void INC();		// Increment Memory
+	template<mode M> void CPX();		// Compare X register
+	template<mode M> void SBC();		// Subtract with carry
+	template<mode M> void INC();		// Increment Memory
 	void INX();		// Increment X register
 	void NOP();		// No operation. Does nothing.
 	void BEQ();		// Branch if equal
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstdint>
+#include "state.h"
+
+/*
+* Anything mapped into the address space that isn't plain memory
+* (PPU and APU registers, controllers, mapper registers)
+*/
+class bus_device
+{
+public:
+	virtual ~bus_device() = default;
+	virtual uint8_t read(uint16_t) = 0;
+	virtual void write(uint16_t, uint8_t) = 0;
+
+	// Read without side effects, used by tracing and debugging
+	virtual uint8_t peek(uint16_t inAddr) { return (uint8_t)(inAddr >> 8); }
+};
+
+/*
+* Anything with its own clock (PPU, APU). Components don't run in lockstep
+* with the CPU: each remembers how far it has run and the bus catches it
+* up to the master clock only when it must, so it runs in large batches
+*/
+class clocked_device
+{
+public:
+	uint64_t synced_cycle = 0;	// Master cycle the component has run up to
+
+	virtual ~clocked_device() = default;
+
+	// Run from synced_cycle up to inCycle, called through bus::catch_up
+	virtual void run_until(uint64_t inCycle) = 0;
+
+	// Earliest cycle it has to be caught up at by itself (IRQ, vblank), UINT64_MAX for none
+	virtual uint64_t next_sync() { return UINT64_MAX; }
+
+	// Registers for save states, synced_cycle is saved by the bus
+	virtual void save_state(state_writer&) const {}
+	virtual void load_state(state_reader&) {}
+};
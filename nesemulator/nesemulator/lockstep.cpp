@@ -0,0 +1,632 @@
+#include "lockstep.h"
+#include "bus.h"
+
+#include <algorithm>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+/*
+* Vector of lane bytes
+* ---
+* The few byte wise ops the kernels need, on the widest instruction set
+* the file was compiled for. Masks are 0xFF / 0x00 per lane.
+*/
+#if defined(__AVX2__)
+struct vec {
+	__m256i v;
+	static constexpr size_t width = 32;
+
+	static vec load(const uint8_t* inData) { return { _mm256_loadu_si256((const __m256i*)inData) }; }
+	void store(uint8_t* outData) const { _mm256_storeu_si256((__m256i*)outData, v); }
+	static vec splat(uint8_t inValue) { return { _mm256_set1_epi8((char)inValue) }; }
+
+	friend vec operator+(vec a, vec b) { return { _mm256_add_epi8(a.v, b.v) }; }
+	friend vec operator-(vec a, vec b) { return { _mm256_sub_epi8(a.v, b.v) }; }
+	friend vec operator&(vec a, vec b) { return { _mm256_and_si256(a.v, b.v) }; }
+	friend vec operator|(vec a, vec b) { return { _mm256_or_si256(a.v, b.v) }; }
+	friend vec operator^(vec a, vec b) { return { _mm256_xor_si256(a.v, b.v) }; }
+	friend vec andnot(vec m, vec a) { return { _mm256_andnot_si256(m.v, a.v) }; }	// ~m & a
+	friend vec eq(vec a, vec b) { return { _mm256_cmpeq_epi8(a.v, b.v) }; }
+	friend vec max_u(vec a, vec b) { return { _mm256_max_epu8(a.v, b.v) }; }
+	friend vec shr1(vec a) { return { _mm256_and_si256(_mm256_srli_epi16(a.v, 1), _mm256_set1_epi8(0x7F)) }; }
+	friend vec select(vec m, vec a, vec b) { return { _mm256_blendv_epi8(b.v, a.v, m.v) }; }
+	bool any() const { return _mm256_movemask_epi8(v) != 0; }
+};
+#elif defined(__SSE2__)
+struct vec {
+	__m128i v;
+	static constexpr size_t width = 16;
+
+	static vec load(const uint8_t* inData) { return { _mm_loadu_si128((const __m128i*)inData) }; }
+	void store(uint8_t* outData) const { _mm_storeu_si128((__m128i*)outData, v); }
+	static vec splat(uint8_t inValue) { return { _mm_set1_epi8((char)inValue) }; }
+
+	friend vec operator+(vec a, vec b) { return { _mm_add_epi8(a.v, b.v) }; }
+	friend vec operator-(vec a, vec b) { return { _mm_sub_epi8(a.v, b.v) }; }
+	friend vec operator&(vec a, vec b) { return { _mm_and_si128(a.v, b.v) }; }
+	friend vec operator|(vec a, vec b) { return { _mm_or_si128(a.v, b.v) }; }
+	friend vec operator^(vec a, vec b) { return { _mm_xor_si128(a.v, b.v) }; }
+	friend vec andnot(vec m, vec a) { return { _mm_andnot_si128(m.v, a.v) }; }
+	friend vec eq(vec a, vec b) { return { _mm_cmpeq_epi8(a.v, b.v) }; }
+	friend vec max_u(vec a, vec b) { return { _mm_max_epu8(a.v, b.v) }; }
+	friend vec shr1(vec a) { return { _mm_and_si128(_mm_srli_epi16(a.v, 1), _mm_set1_epi8(0x7F)) }; }
+	friend vec select(vec m, vec a, vec b) { return { _mm_or_si128(_mm_and_si128(m.v, a.v), _mm_andnot_si128(m.v, b.v)) }; }
+	bool any() const { return _mm_movemask_epi8(v) != 0; }
+};
+#else
+struct vec {
+	uint8_t v[16];
+	static constexpr size_t width = 16;
+
+	template<typename F>
+	static vec map(F inF) { vec r; for (size_t i = 0; i < width; i++) { r.v[i] = (uint8_t)inF(i); } return r; }
+
+	static vec load(const uint8_t* inData) { return map([&](size_t i) { return inData[i]; }); }
+	void store(uint8_t* outData) const { std::copy(v, v + width, outData); }
+	static vec splat(uint8_t inValue) { return map([&](size_t) { return inValue; }); }
+
+	friend vec operator+(vec a, vec b) { return map([&](size_t i) { return a.v[i] + b.v[i]; }); }
+	friend vec operator-(vec a, vec b) { return map([&](size_t i) { return a.v[i] - b.v[i]; }); }
+	friend vec operator&(vec a, vec b) { return map([&](size_t i) { return a.v[i] & b.v[i]; }); }
+	friend vec operator|(vec a, vec b) { return map([&](size_t i) { return a.v[i] | b.v[i]; }); }
+	friend vec operator^(vec a, vec b) { return map([&](size_t i) { return a.v[i] ^ b.v[i]; }); }
+	friend vec andnot(vec m, vec a) { return map([&](size_t i) { return ~m.v[i] & a.v[i]; }); }
+	friend vec eq(vec a, vec b) { return map([&](size_t i) { return a.v[i] == b.v[i] ? 0xFF : 0x00; }); }
+	friend vec max_u(vec a, vec b) { return map([&](size_t i) { return std::max(a.v[i], b.v[i]); }); }
+	friend vec shr1(vec a) { return map([&](size_t i) { return a.v[i] >> 1; }); }
+	friend vec select(vec m, vec a, vec b) { return map([&](size_t i) { return m.v[i] ? a.v[i] : b.v[i]; }); }
+	bool any() const { return std::any_of(v, v + width, [](uint8_t b) { return b != 0; }); }
+};
+#endif
+
+inline vec operator~(vec a) { return a ^ vec::splat(0xFF); }
+inline vec is_zero(vec a) { return eq(a, vec::splat(0)); }
+inline vec ge_u(vec a, vec b) { return eq(max_u(a, b), a); }
+inline vec carried(vec inSum, vec inAddend) { return ~ge_u(inSum, inAddend); }	// An 8 bit add wrapped
+
+// Set or clear inFlag in every lane by a mask
+inline vec with_flag(vec inPF, uint8_t inFlag, vec inSet)
+{
+	vec bit = vec::splat(inFlag);
+	return andnot(bit, inPF) | (inSet & bit);
+}
+
+// Z from value == 0, N from bit 7, as most operations set them
+inline vec with_nz(vec inPF, vec inValue)
+{
+	vec p = andnot(vec::splat(cpu::flag_Z | cpu::flag_N), inPF);
+	return p | (is_zero(inValue) & vec::splat(cpu::flag_Z)) | (inValue & vec::splat(cpu::flag_N));
+}
+
+inline vec has(vec inPF, uint8_t inFlag) { return ~is_zero(inPF & vec::splat(inFlag)); }
+
+using op = cpu::op;
+using mode = cpu::mode;
+
+bool is_direct(mode inMode)
+{
+	switch (inMode) {
+	case mode::imm: case mode::zpg: case mode::zpgx: case mode::zpgy:
+	case mode::abs: case mode::absx: case mode::absy:
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool is_store(op inOp)
+{
+	return inOp == op::STA || inOp == op::STX || inOp == op::STY;
+}
+
+bool is_branch(op inOp)
+{
+	switch (inOp) {
+	case op::BPL: case op::BMI: case op::BVC: case op::BVS:
+	case op::BCC: case op::BCS: case op::BNE: case op::BEQ:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Opcodes the vector group can run, everything else goes scalar
+bool has_vector_form(const cpu::opcode_info& inInfo)
+{
+	switch (inInfo.operation) {
+	case op::ORA: case op::AND: case op::EOR: case op::ADC: case op::SBC:
+	case op::CMP: case op::CPX: case op::CPY:
+	case op::LDA: case op::LDX: case op::LDY:
+	case op::STA: case op::STX: case op::STY:
+		return is_direct(inInfo.addressing);
+	case op::ASL: case op::LSR: case op::ROL: case op::ROR:
+		return inInfo.addressing == mode::acc;
+	case op::TAX: case op::TAY: case op::TXA: case op::TYA:
+	case op::INX: case op::INY: case op::DEX: case op::DEY:
+	case op::CLC: case op::SEC: case op::CLD: case op::SED: case op::CLV:
+	case op::NOP:
+		return true;
+	case op::JMP:
+		return inInfo.addressing == mode::abs;
+	default:
+		return is_branch(inInfo.operation);
+	}
+}
+
+// Operations that add a cycle of their own on top of the table's
+bool adds_cycle(op inOp)
+{
+	switch (inOp) {
+	case op::ORA: case op::AND: case op::ADC: case op::SBC:
+	case op::CMP: case op::LDA: case op::LDX: case op::LDY:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+* One vector of lanes through inOp with operand d. Mirrors the cpu
+* operations, including what they do differently from a real 6502:
+* ADC adds the carry twice, CMP sets Z from the result equalling the
+* operand, LSR sets Z for a non zero result, ASL and ROR take Z from A
+* before the shift, ROL always clears C, BVC branches on N and TXA
+* takes N from A & 80 decimal.
+*/
+void execute(op inOp, vec& a, vec& x, vec& y, vec& p, vec d, vec& taken)
+{
+	const vec one = vec::splat(1);
+	const vec sign = vec::splat(0x80);
+
+	switch (inOp) {
+	case op::ORA: a = a | d; p = with_nz(p, a); break;
+	case op::AND: a = a & d; p = with_nz(p, a); break;
+	case op::EOR: a = a ^ d; p = with_nz(p, a); break;
+	case op::LDA: a = d; p = with_nz(p, a); break;
+	case op::LDX: x = d; p = with_nz(p, x); break;
+	case op::LDY: y = d; p = with_nz(p, y); break;
+
+	case op::ADC: {
+		vec c = p & one;
+		vec s1 = a + d;
+		vec s2 = s1 + c;
+		vec s3 = s2 + c;
+		vec carry = carried(s1, a) | carried(s2, s1) | carried(s3, s2);
+		vec overflow = has(andnot(a ^ d, a ^ s3), 0x80);
+		p = with_flag(p, cpu::flag_C, carry);
+		p = with_flag(p, cpu::flag_O, overflow);
+		a = s3;
+		p = with_nz(p, a);
+		break;
+	}
+	case op::SBC: {
+		vec value = ~d;
+		vec s1 = a + value;
+		vec s2 = s1 + (p & one);
+		vec carry = carried(s1, a) | carried(s2, s1);
+		vec overflow = has((s2 ^ a) & (s2 ^ value), 0x80);
+		p = with_flag(p, cpu::flag_C, carry);
+		p = with_flag(p, cpu::flag_O, overflow);
+		a = s2;
+		p = with_nz(p, a);
+		break;
+	}
+	case op::CMP: {
+		vec comparison = a - d;
+		p = with_flag(p, cpu::flag_C, ge_u(a, d));
+		p = with_flag(p, cpu::flag_Z, eq(comparison, d));
+		p = with_flag(p, cpu::flag_N, has(comparison, 0x80));
+		break;
+	}
+	case op::CPX: p = with_flag(with_nz(p, x - d), cpu::flag_C, ge_u(x, d)); break;
+	case op::CPY: p = with_flag(with_nz(p, y - d), cpu::flag_C, ge_u(y, d)); break;
+
+	case op::ASL:
+		p = with_flag(p, cpu::flag_C, has(a, 0x80));
+		p = with_flag(p, cpu::flag_Z, is_zero(a));
+		p = with_flag(p, cpu::flag_N, has(a, 0x80));
+		a = a + a;
+		break;
+	case op::LSR: {
+		vec temp = shr1(a);
+		p = with_flag(p, cpu::flag_C, has(a, 0x01));
+		p = with_flag(p, cpu::flag_Z, ~is_zero(temp));
+		p = with_flag(p, cpu::flag_N, vec::splat(0));
+		a = temp;
+		break;
+	}
+	case op::ROL:
+		a = (a + a) | (p & one);
+		p = with_flag(p, cpu::flag_C, vec::splat(0));
+		p = with_flag(p, cpu::flag_Z, is_zero(a));
+		p = with_flag(p, cpu::flag_N, has(a, 0x80));
+		break;
+	case op::ROR: {
+		vec temp = shr1(a) | (has(p, cpu::flag_C) & sign);
+		p = with_flag(p, cpu::flag_C, has(a, 0x01));
+		p = with_flag(p, cpu::flag_Z, is_zero(a));
+		p = with_flag(p, cpu::flag_N, has(temp, 0x80));
+		a = temp;
+		break;
+	}
+
+	case op::TAX: x = a; p = with_nz(p, x); break;
+	case op::TAY: y = a; p = with_nz(p, y); break;
+	case op::TYA: a = y; p = with_nz(p, a); break;
+	case op::TXA:
+		a = x;
+		p = with_flag(p, cpu::flag_Z, is_zero(a));
+		p = with_flag(p, cpu::flag_N, has(a, 80));
+		break;
+	case op::INX: x = x + one; p = with_nz(p, x); break;
+	case op::INY: y = y + one; p = with_nz(p, y); break;
+	case op::DEX: x = x - one; p = with_nz(p, x); break;
+	case op::DEY: y = y - one; p = with_nz(p, y); break;
+
+	case op::CLC: p = andnot(vec::splat(cpu::flag_C), p); break;
+	case op::SEC: p = p | vec::splat(cpu::flag_C); break;
+	case op::CLD: p = andnot(vec::splat(cpu::flag_D), p); break;
+	case op::SED: p = p | vec::splat(cpu::flag_D); break;
+	case op::CLV: p = andnot(vec::splat(cpu::flag_O), p); break;
+
+	case op::BPL: taken = is_zero(p & sign); break;
+	case op::BMI: taken = has(p, cpu::flag_N); break;
+	case op::BVC: taken = has(p, cpu::flag_N); break;
+	case op::BVS: taken = has(p, cpu::flag_O); break;
+	case op::BCC: taken = is_zero(p & one); break;
+	case op::BCS: taken = has(p, cpu::flag_C); break;
+	case op::BNE: taken = ~has(p, cpu::flag_Z); break;
+	case op::BEQ: taken = has(p, cpu::flag_Z); break;
+
+	default:
+		break;
+	}
+}
+
+}
+
+/*
+* lockstep
+*/
+lockstep::lockstep(size_t inLanes)
+	: count(inLanes), padded((inLanes + vec::width - 1) / vec::width * vec::width)
+{
+	for (size_t i = 0; i < count; i++) {
+		machines.emplace_back(new bus());
+	}
+	for (std::vector<uint8_t>* lanes : { &A, &X, &Y, &PF, &SP, &active, &operand, &crossed, &taken }) {
+		lanes->assign(padded, 0);
+	}
+	PC.assign(padded, 0);
+	cycles.assign(padded, 0);
+	due.assign(padded, 0);
+	remaining.assign(padded, 0);
+	members.reserve(count);
+}
+
+lockstep::~lockstep() = default;
+
+const char* lockstep::isa()
+{
+#if defined(__AVX2__)
+	return "AVX2";
+#elif defined(__SSE2__)
+	return "SSE2";
+#else
+	return "scalar";
+#endif
+}
+
+void lockstep::push(size_t inLane)
+{
+	cpu& lane_cpu = machines[inLane]->cCPU;
+	lane_cpu.A = A[inLane];
+	lane_cpu.X = X[inLane];
+	lane_cpu.Y = Y[inLane];
+	lane_cpu.set_flags(PF[inLane]);
+	lane_cpu.new_SP.set_ptr(SP[inLane]);
+	lane_cpu.PC = PC[inLane];
+	lane_cpu.total_cycles = cycles[inLane];
+}
+
+void lockstep::pull(size_t inLane)
+{
+	cpu& lane_cpu = machines[inLane]->cCPU;
+	A[inLane] = lane_cpu.A;
+	X[inLane] = lane_cpu.X;
+	Y[inLane] = lane_cpu.Y;
+	PF[inLane] = lane_cpu.flags();
+	SP[inLane] = (uint8_t)lane_cpu.new_SP.get_ptr();
+	PC[inLane] = lane_cpu.PC;
+	cycles[inLane] = lane_cpu.total_cycles;
+	due[inLane] = machines[inLane]->next_event;
+}
+
+void lockstep::start()
+{
+	for (size_t i = 0; i < count; i++) {
+		pull(i);
+	}
+}
+
+void lockstep::finish()
+{
+	for (size_t i = 0; i < count; i++) {
+		push(i);
+	}
+}
+
+void lockstep::step_scalar(size_t inLane)
+{
+	push(inLane);
+	machines[inLane]->step();
+	pull(inLane);
+	scalar_instructions++;
+}
+
+/*
+* Whether a lane sees the instruction bytes inCode at inPC through plain
+* memory. Lanes sharing a ROM image share its pages, so the common case
+* only compares the page pointer
+*/
+bool lockstep::same_code(size_t inLane, const uint8_t* inFirstPage, uint16_t inPC, const uint8_t* inCode, uint8_t inBytes) const
+{
+	const bus& lane_bus = *machines[inLane];
+	const uint8_t* page = lane_bus.read_pages[inPC >> 8];
+	if (page == inFirstPage && (inPC & 0xFF) <= 0x100 - inBytes) {
+		return true;
+	}
+
+	for (uint8_t i = 0; i < inBytes; i++) {
+		uint16_t addr = (uint16_t)(inPC + i);
+		page = lane_bus.read_pages[addr >> 8];
+		if (!page || page[addr & 0xFF] != inCode[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Decodes the instruction at inPC from inLane's memory, nullptr if it has no vector form
+static const cpu::opcode_info* vector_code(const bus& inLane, uint16_t inPC, uint8_t* outCode)
+{
+	outCode[0] = outCode[1] = outCode[2] = 0;
+
+	// Code behind a device is left to the scalar cpus, reads there can have side effects
+	const uint8_t* page = inLane.read_pages[inPC >> 8];
+	if (!page) {
+		return nullptr;
+	}
+	outCode[0] = page[inPC & 0xFF];
+	const cpu::opcode_info* info = &cpu::opcode_table[outCode[0]];
+	if (!has_vector_form(*info)) {
+		return nullptr;
+	}
+	for (uint8_t i = 1; i < info->bytes; i++) {
+		uint16_t addr = (uint16_t)(inPC + i);
+		const uint8_t* next = inLane.read_pages[addr >> 8];
+		if (!next) {
+			return nullptr;
+		}
+		outCode[i] = next[addr & 0xFF];
+	}
+	return info;
+}
+
+void lockstep::run(uint64_t inInstructions)
+{
+	std::fill(remaining.begin(), remaining.end(), inInstructions);
+
+	for (;;) {
+		// One pass over the lanes: the lowest PC, the lanes at it and the lowest PC of the others
+		uint32_t pc = UINT32_MAX;
+		uint32_t ahead = UINT32_MAX;
+		uint64_t left = UINT64_MAX;
+		members.clear();
+		for (size_t i = 0; i < count; i++) {
+			if (!remaining[i]) {
+				continue;
+			}
+			uint32_t lane_pc = PC[i];
+			if (lane_pc < pc) {
+				ahead = std::min(ahead, pc);
+				pc = lane_pc;
+				left = UINT64_MAX;
+				members.clear();
+			}
+			if (lane_pc == pc) {
+				members.push_back((uint32_t)i);
+				left = std::min(left, remaining[i]);
+			}
+			else {
+				ahead = std::min(ahead, lane_pc);
+			}
+		}
+		if (pc == UINT32_MAX) {
+			break;
+		}
+
+		// A lane alone at the lowest PC runs on its cpu until it is level with the others
+		if (members.size() == 1) {
+			size_t lane = members[0];
+			cpu& lane_cpu = machines[lane]->cCPU;
+			push(lane);
+			while (remaining[lane] && lane_cpu.PC < ahead) {
+				machines[lane]->step();
+				remaining[lane]--;
+				scalar_instructions++;
+			}
+			pull(lane);
+			continue;
+		}
+
+		const bus& first = *machines[members[0]];
+		uint8_t code[3];
+		const cpu::opcode_info* info = vector_code(first, (uint16_t)pc, code);
+
+		// Lanes at pc whose code differs drop out and run in a later round, being the lowest PC left
+		if (info) {
+			const uint8_t* page = first.read_pages[pc >> 8];
+			members.erase(std::remove_if(members.begin() + 1, members.end(), [&](uint32_t inLane) {
+				return !same_code(inLane, page, (uint16_t)pc, code, info->bytes);
+			}), members.end());
+		}
+		if (!info || members.size() < 2) {
+			for (uint32_t lane : members) {
+				step_scalar(lane);
+				remaining[lane]--;
+			}
+			continue;
+		}
+
+		/*
+		* Keep the group going while it stays together. Lanes sharing the
+		* page pointer see the same code anywhere in the page, the others
+		* are compared per instruction. A store can switch banks, so the
+		* pointers are looked at again after one
+		*/
+		for (uint32_t lane : members) {
+			active[lane] = 0xFF;
+		}
+		const uint8_t* page = first.read_pages[pc >> 8];
+		auto same_page = [&](uint32_t inLane) {
+			return machines[inLane]->read_pages[pc >> 8] == page;
+		};
+		bool shared = std::all_of(members.begin(), members.end(), same_page);
+		for (;;) {
+			bool store = is_store(info->operation);
+			uint32_t next = run_vector(code);
+			vector_instructions += members.size();
+			if (--left == 0 || next >= ahead || (next >> 8) != (pc >> 8)) {
+				break;
+			}
+			pc = next;
+			info = vector_code(first, (uint16_t)pc, code);
+			if (!info || (pc & 0xFF) > 0x100u - info->bytes) {
+				break;
+			}
+			if (store) {
+				page = first.read_pages[pc >> 8];
+				shared = std::all_of(members.begin(), members.end(), same_page);
+			}
+			if (!shared && !std::all_of(members.begin() + 1, members.end(), [&](uint32_t inLane) {
+				return same_code(inLane, page, (uint16_t)pc, code, info->bytes);
+			})) {
+				break;
+			}
+		}
+		for (uint32_t lane : members) {
+			active[lane] = 0x00;
+		}
+	}
+}
+
+/*
+* Run the instruction in inCode on every active lane. Operands are read
+* and stores written lane by lane at the cycle the instruction starts,
+* as the cpu does, then the registers go through the vector kernel and
+* PC and cycles are advanced per lane for branches and page crossings.
+*/
+uint32_t lockstep::run_vector(const uint8_t* inCode)
+{
+	const cpu::opcode_info& info = cpu::opcode_table[inCode[0]];
+	const op operation = info.operation;
+	const uint16_t lo = inCode[1];
+	const uint16_t hi = inCode[2];
+	const uint16_t base = (hi << 8) | lo;
+	const bool memory = info.addressing != mode::imm && is_direct(info.addressing);
+
+	if (memory) {
+		for (uint32_t i : members) {
+			uint16_t addr = 0;
+			switch (info.addressing) {
+			case mode::zpg: addr = lo; break;
+			case mode::zpgx: addr = (lo + X[i]) & 0x00FF; break;
+			case mode::zpgy: addr = (lo + Y[i]) & 0x00FF; break;
+			case mode::abs: addr = base; break;
+			case mode::absx: addr = base + X[i]; break;
+			case mode::absy: addr = base + Y[i]; break;
+			default: break;
+			}
+			crossed[i] = (addr & 0xFF00) != (hi << 8);
+
+			bus& lane_bus = *machines[i];
+			lane_bus.cCPU.total_cycles = cycles[i];
+			switch (operation) {
+			case op::STA: lane_bus.write(addr, A[i]); break;
+			case op::STX: lane_bus.write(addr, X[i]); break;
+			case op::STY: lane_bus.write(addr, Y[i]); break;
+			default: operand[i] = lane_bus.read(addr); break;
+			}
+			due[i] = lane_bus.next_event;
+		}
+	}
+
+	if (!is_store(operation) && operation != op::JMP && operation != op::NOP) {
+		const vec immediate = vec::splat((uint8_t)lo);
+		for (size_t i = 0; i < padded; i += vec::width) {
+			vec mask = vec::load(&active[i]);
+			if (!mask.any()) {
+				continue;
+			}
+
+			vec a = vec::load(&A[i]), x = vec::load(&X[i]), y = vec::load(&Y[i]), p = vec::load(&PF[i]);
+			vec branch = vec::splat(0);
+			vec d = memory ? vec::load(&operand[i]) : immediate;
+			execute(operation, a, x, y, p, d, branch);
+
+			select(mask, a, vec::load(&A[i])).store(&A[i]);
+			select(mask, x, vec::load(&X[i])).store(&X[i]);
+			select(mask, y, vec::load(&Y[i])).store(&Y[i]);
+			select(mask, p, vec::load(&PF[i])).store(&PF[i]);
+			branch.store(&taken[i]);
+		}
+	}
+
+	const uint8_t fixed = info.cycles + adds_cycle(operation);
+	const bool branch = is_branch(operation);
+	const uint16_t rel = (lo & 0x80) ? (lo | 0xFF00) : lo;
+	uint32_t together = (uint16_t)(PC[members[0]] + info.bytes);
+	if (branch && taken[members[0]]) {
+		together = (uint16_t)(together + rel);
+	}
+	else if (operation == op::JMP) {
+		together = base;
+	}
+	for (uint32_t i : members) {
+		uint16_t next = PC[i] + info.bytes;
+		uint8_t clock_cycles = fixed;
+		if (info.page_cross) {
+			clock_cycles += crossed[i];
+		}
+		if (branch && taken[i]) {
+			clock_cycles++;
+			uint16_t from = next;
+			next += rel;
+			if ((from & 0xFF00) < (next & 0xFF00)) {
+				clock_cycles++;
+			}
+		}
+		else if (operation == op::JMP) {
+			next = base;
+		}
+		PC[i] = next;
+		cycles[i] += clock_cycles;
+
+		// The bus is only touched when an event fell due, keeps the loop on the lane arrays
+		if (cycles[i] >= due[i]) {
+			push(i);
+			machines[i]->poll_events();
+			pull(i);
+		}
+		remaining[i]--;
+		if (PC[i] != together) {
+			together = UINT32_MAX;
+		}
+	}
+	return together;
+}
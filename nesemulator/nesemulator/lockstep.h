@@ -0,0 +1,82 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+class bus;
+
+/*
+* Lockstep engine
+* ---
+* Steps many machines running the same program side by side, e.g. one
+* ROM under different inputs. A, X, Y, PF, SP, PC and the cycle count of
+* every lane are kept in struct of arrays form. Each round the lanes at
+* the lowest PC run their next instruction together, 16 lanes per SSE2
+* op (32 if the whole build targets AVX2, which measures slower for the
+* per lane loops around it), while lanes further ahead wait. Lanes that
+* branched apart thereby meet again where their paths join, the ones
+* that skipped ahead waiting for the ones that took the long way. A
+* group keeps running without looking at the other lanes again while
+* it stays together on one page and below the next lane ahead of it,
+* and a lane that is the only one at the lowest PC runs on its own cpu
+* until it reaches the others.
+*
+* Only register, immediate, accumulator, branch and directly addressed
+* load / store / arithmetic opcodes have a vector form. Their memory
+* accesses still go through each lane's bus one lane at a time. Stack,
+* read-modify-write and indirect opcodes run scalar on every lane. The
+* vector forms follow the cpu operations flag for flag, quirks included,
+* so a lane ends in the same architectural state as a cpu running alone.
+* Each lane keeps its own bus for memory, devices and scheduled events.
+*/
+class lockstep
+{
+private:
+	size_t count;
+	size_t padded;	// count rounded up to a whole number of vectors
+	std::vector<std::unique_ptr<bus>> machines;
+
+	// Registers by lane, padding lanes are never active
+	std::vector<uint8_t> A, X, Y, PF, SP;
+	std::vector<uint16_t> PC;
+	std::vector<uint64_t> cycles;
+	std::vector<uint64_t> due;			// Copy of each lane bus's next_event
+	std::vector<uint64_t> remaining;	// Instructions left in the current run
+
+	// Per round scratch
+	std::vector<uint32_t> members;	// Lanes in the group, in lane order
+	std::vector<uint8_t> active;	// 0xFF for lanes in the vector group
+	std::vector<uint8_t> operand;	// Memory operand read by each lane
+	std::vector<uint8_t> crossed;	// Indexing crossed a page
+	std::vector<uint8_t> taken;		// Branch taken
+
+	bool same_code(size_t inLane, const uint8_t* inFirstPage, uint16_t inPC, const uint8_t* inCode, uint8_t inBytes) const;
+	// Returns the PC all members went on to, UINT32_MAX if they went apart
+	uint32_t run_vector(const uint8_t* inCode);
+	void step_scalar(size_t inLane);
+	void push(size_t inLane);
+	void pull(size_t inLane);
+
+public:
+	explicit lockstep(size_t inLanes);
+	~lockstep();
+
+	size_t lanes() const { return count; }
+
+	// Set a lane's program up through its bus before start()
+	bus& lane(size_t inLane) { return *machines[inLane]; }
+
+	// Take the registers from the lane cpus
+	void start();
+	// Run inInstructions instructions on every lane
+	void run(uint64_t inInstructions);
+	// Hand the registers back to the lane cpus
+	void finish();
+
+	uint64_t vector_instructions = 0;	// Lane instructions run in a vector group
+	uint64_t scalar_instructions = 0;
+
+	// Instruction set the vector ops were built for: "AVX2", "SSE2" or "scalar"
+	static const char* isa();
+};
@@ -1,53 +1,75 @@
 #include "main.h"
 #include "bus.h"
-#include <bitset>
-#include <sstream>
+#include "tracer.h"
 #include <fstream>
-#include <vector>
-#include <filesystem>
+#include <memory>
+#include <string>
 
-std::vector<uint8_t> LoadBinaryFile(const char* filename)
+/*
+* Load a program into nBUS. iNES files are inserted as a cartridge, anything
+* else is treated as a raw 64KB image (e.g. 6502_functional_test.bin)
+* starting at $0000 and run from inStart
+*/
+bool load_program(bus& nBUS, const char* inPath, uint16_t inStart)
 {
-	// open the file:
-	std::basic_ifstream<uint8_t> file(filename, std::ios::binary);
-
-	// read the data:
-	return std::vector<uint8_t>((std::istreambuf_iterator<uint8_t>(file)), std::istreambuf_iterator<uint8_t>());
-}
+	std::shared_ptr<const mapped_file> file = mapped_file::open(inPath);
+	if (!file) {
+		std::cout << "Could not open " << inPath << std::endl;
+		return false;
+	}
 
-std::vector<uint8_t> load_rom_from_path(std::string instr)
-{
-	using namespace std::filesystem;
+	if (rom::is_ines(file->data(), file->size())) {
+		std::string error;
+		std::shared_ptr<const rom> cartridge = rom::load(inPath, &error);
+		if (!cartridge) {
+			std::cout << inPath << ": " << error << std::endl;
+			return false;
+		}
+		if (!nBUS.insert_cartridge(cartridge)) {
+			std::cout << inPath << ": mapper " << cartridge->mapper << " with " << cartridge->prg_size / 1024 << " KB PRG and "
+				<< cartridge->chr_size / 1024 << " KB CHR is not supported" << std::endl;
+			return false;
+		}
+		return true;
+	}
 
-	path ReadPath;
+	for (size_t i = 0; i < file->size() && i <= MAXRAMSIZE; i++) {
+		nBUS.write((uint16_t)i, file->data()[i]);
+	}
+	nBUS.cCPU.PC = inStart;
+	return true;
+}
 
-	// If argument is not a full path append the string to the current path
-	if (instr.find(':') && exists(instr)) {
-		ReadPath = path(instr);
+int main(int argc, char** argv){
+	// Render a binary trace dump, like those of nesbench --trace, as text: nesemulator --decode-trace <file>
+	if (argc == 3 && std::string(argv[1]) == "--decode-trace") {
+		std::ifstream dump(argv[2], std::ios::binary);
+		tracer::decode(dump, std::cout);
+		return 0;
 	}
 
-	// Load the chip8 binary
-	std::vector<uint8_t> program = LoadBinaryFile(ReadPath.string().c_str());
+	bus nBUS;
 
-	return program;
-}
+	// nesemulator <file> runs an iNES file or a raw binary, otherwise a small test loop
+	if (argc == 2) {
+		if (!load_program(nBUS, argv[1], 0x0400)) {
+			return 1;
+		}
+	}
+	else {
+		int program[] = { 
+			0xA2, 0x0A, 0x8E, 0x00, 0x00, 0xA2 , 0x03 , 0x8E , 0x01 , 0x00 , 0xAC , 0x00 , 0x00 , 0xA9 , 0x00 , 0x18 , 0x6D , 0x01 , 0x00 , 0x88 , 0xD0 , 0xFA , 0x8D , 0x02 , 0x00 , 0xEA , 0xEA , 0xEA
+		};
 
-int main(){
-	bus nBUS;
-	
-	//std::vector<uint8_t> program = load_rom_from_path("C:\\Users\\hayde\\Downloads\\6502_functional_test.bin");
-	int program[] = { 
-		0xA2, 0x0A, 0x8E, 0x00, 0x00, 0xA2 , 0x03 , 0x8E , 0x01 , 0x00 , 0xAC , 0x00 , 0x00 , 0xA9 , 0x00 , 0x18 , 0x6D , 0x01 , 0x00 , 0x88 , 0xD0 , 0xFA , 0x8D , 0x02 , 0x00 , 0xEA , 0xEA , 0xEA
-	};
-
-	// Write the binary into memory
-	uint16_t WritePtr = 0x0200;
-	for (auto& instr : program) {
-		nBUS.cRAM.write(WritePtr++, instr);
+		// Write the binary into memory
+		uint16_t WritePtr = 0x0200;
+		for (auto& instr : program) {
+			nBUS.write(WritePtr++, instr);
+		}
 	}
 
 	while (true) {
-		nBUS.cCPU.clock();
+		nBUS.run_frame();
 	}
 
 	return 1;
@@ -0,0 +1,429 @@
+#include "mapper.h"
+
+#include <algorithm>
+
+/*
+* mapper
+*/
+mapper::mapper(bus* inBus, std::shared_ptr<const rom> inCartridge)
+	: cBUS(inBus), cartridge(std::move(inCartridge)), mirror(cartridge->mirror)
+{
+	// NES 2.0 RAM can be as small as 128 bytes, the bus mirrors whole pages so it fills the window instead
+	if (cartridge->prg_ram_size) {
+		prg_ram.resize(std::max<uint32_t>(cartridge->prg_ram_size, 0x2000));
+	}
+	if (!cartridge->chr_size) {
+		chr_ram.resize(std::max<uint32_t>(cartridge->chr_ram_size, 0x2000));
+	}
+}
+
+bool mapper::supported(const rom& inCartridge)
+{
+	// map_prg and map_chr divide by the number of banks that fit, smaller images have none
+	bool fits = inCartridge.prg_size >= 0x2000 && (!inCartridge.chr_size || inCartridge.chr_size >= 0x2000);
+	return inCartridge.mapper <= 4 && fits;
+}
+
+std::unique_ptr<mapper> mapper::create(bus* inBus, std::shared_ptr<const rom> inCartridge)
+{
+	if (!supported(*inCartridge)) {
+		return nullptr;
+	}
+	switch (inCartridge->mapper) {
+	case 0: return std::unique_ptr<mapper>(new nrom(inBus, std::move(inCartridge)));
+	case 1: return std::unique_ptr<mapper>(new mmc1(inBus, std::move(inCartridge)));
+	case 2: return std::unique_ptr<mapper>(new uxrom(inBus, std::move(inCartridge)));
+	case 3: return std::unique_ptr<mapper>(new cnrom(inBus, std::move(inCartridge)));
+	case 4: return std::unique_ptr<mapper>(new mmc3(inBus, std::move(inCartridge)));
+	default: return nullptr;
+	}
+}
+
+void mapper::reset()
+{
+	mirror = cartridge->mirror;
+	ppu_version++;
+	cBUS->clear_irq(bus::irq_source::mapper);
+
+	if (!prg_ram.empty()) {
+		cBUS->map_memory(0x60, 0x20, prg_ram.data(), (uint32_t)prg_ram.size());
+	}
+	else {
+		cBUS->unmap(0x60, 0x20);
+	}
+	map_chr(0x0000, 0x2000, 0);
+}
+
+void mapper::add_regions()
+{
+	if (!prg_ram.empty()) {
+		cBUS->add_region(prg_ram.data(), (uint32_t)prg_ram.size());
+	}
+	// The PPU writes CHR-RAM without going through the page table
+	if (!chr_ram.empty()) {
+		cBUS->add_region(chr_ram.data(), (uint32_t)chr_ram.size(), false);
+	}
+}
+
+void mapper::save_state(state_writer& inState) const
+{
+	inState.write(mirror);
+}
+
+void mapper::load_state(state_reader& inState)
+{
+	inState.read(mirror);
+	ppu_version++;
+}
+
+void mapper::map_prg(uint16_t inAddr, uint32_t inSize, int inBank)
+{
+	// Images smaller than the window (16KB NROM) are mirrored by the bus
+	uint32_t size = std::min(inSize, cartridge->prg_size);
+	int count = (int)(cartridge->prg_size / size);
+	int bank = ((inBank % count) + count) % count;
+
+	cBUS->map_rom((uint8_t)(inAddr >> 8), (uint16_t)(inSize >> 8), cartridge->prg + (uint32_t)bank * size, size, this);
+}
+
+void mapper::map_chr(uint16_t inAddr, uint32_t inSize, int inBank)
+{
+	bool writable = !chr_ram.empty();
+	const uint8_t* base = writable ? chr_ram.data() : cartridge->chr;
+	uint32_t total = writable ? (uint32_t)chr_ram.size() : cartridge->chr_size;
+
+	int count = (int)(total / inSize);
+	int bank = ((inBank % count) + count) % count;
+	uint32_t offset = (uint32_t)bank * inSize;
+
+	for (uint32_t i = 0; i < inSize; i += 0x400) {
+		uint32_t slot = ((inAddr + i) >> 10) & 7;
+		chr_pages[slot] = base + offset + i;
+		chr_write_pages[slot] = writable ? chr_ram.data() + offset + i : nullptr;
+	}
+	ppu_version++;
+}
+
+void mapper::catch_up_ppu()
+{
+	cBUS->catch_up(cBUS->cPPU);
+}
+
+/*
+* NROM
+*/
+void nrom::reset()
+{
+	mapper::reset();
+	map_prg(0x8000, 0x8000, 0);
+}
+
+/*
+* MMC1
+* ---
+* Registers are loaded one bit at a time through a 5 bit shift register,
+* the address of the fifth write picks the register
+*/
+void mmc1::reset()
+{
+	mapper::reset();
+	shift = 0x10;
+	control = 0x0C;
+	chr_bank[0] = chr_bank[1] = 0;
+	prg_bank = 0;
+	apply_banks();
+}
+
+void mmc1::write(uint16_t inAddr, uint8_t inData)
+{
+	if (inData & 0x80) {
+		catch_up_ppu();
+		shift = 0x10;
+		control |= 0x0C;
+		apply_banks();
+		return;
+	}
+
+	bool full = shift & 0x01;
+	shift = (shift >> 1) | ((inData & 0x01) << 4);
+	if (!full) {
+		return;
+	}
+
+	catch_up_ppu();
+	switch ((inAddr >> 13) & 0x03) {
+	case 0: control = shift; break;
+	case 1: chr_bank[0] = shift; break;
+	case 2: chr_bank[1] = shift; break;
+	case 3: prg_bank = shift; break;
+	}
+	shift = 0x10;
+	apply_banks();
+}
+
+void mmc1::save_state(state_writer& inState) const
+{
+	mapper::save_state(inState);
+	inState.write(shift);
+	inState.write(control);
+	inState.write(chr_bank);
+	inState.write(prg_bank);
+}
+
+void mmc1::load_state(state_reader& inState)
+{
+	mapper::load_state(inState);
+	inState.read(shift);
+	inState.read(control);
+	inState.read(chr_bank);
+	inState.read(prg_bank);
+	apply_banks();
+}
+
+void mmc1::apply_banks()
+{
+	switch (control & 0x03) {
+	case 0: mirror = rom::mirroring::single_lower; break;
+	case 1: mirror = rom::mirroring::single_upper; break;
+	case 2: mirror = rom::mirroring::vertical; break;
+	case 3: mirror = rom::mirroring::horizontal; break;
+	}
+	ppu_version++;
+
+	// 512KB boards (SUROM) select the 256KB half with a CHR bank bit, in 16KB banks
+	int outer = (cartridge->prg_size > 0x40000 && (chr_bank[0] & 0x10)) ? 0x10 : 0;
+	int bank = prg_bank & 0x0F;
+
+	switch ((control >> 2) & 0x03) {
+	case 0:
+	case 1:
+		map_prg(0x8000, 0x4000, outer + (bank & 0x0E));
+		map_prg(0xC000, 0x4000, outer + (bank | 0x01));
+		break;
+	case 2:
+		map_prg(0x8000, 0x4000, outer);
+		map_prg(0xC000, 0x4000, outer + bank);
+		break;
+	case 3:
+		map_prg(0x8000, 0x4000, outer + bank);
+		map_prg(0xC000, 0x4000, outer + 0x0F);
+		break;
+	}
+
+	if (control & 0x10) {
+		map_chr(0x0000, 0x1000, chr_bank[0]);
+		map_chr(0x1000, 0x1000, chr_bank[1]);
+	}
+	else {
+		map_chr(0x0000, 0x2000, chr_bank[0] >> 1);
+	}
+}
+
+/*
+* UxROM
+*/
+void uxrom::reset()
+{
+	mapper::reset();
+	bank = 0;
+	map_prg(0x8000, 0x4000, bank);
+	map_prg(0xC000, 0x4000, -1);
+}
+
+void uxrom::write(uint16_t, uint8_t inData)
+{
+	bank = inData;
+	map_prg(0x8000, 0x4000, bank);
+}
+
+void uxrom::save_state(state_writer& inState) const
+{
+	mapper::save_state(inState);
+	inState.write(bank);
+}
+
+void uxrom::load_state(state_reader& inState)
+{
+	mapper::load_state(inState);
+	inState.read(bank);
+	map_prg(0x8000, 0x4000, bank);
+}
+
+/*
+* CNROM
+*/
+void cnrom::reset()
+{
+	mapper::reset();
+	bank = 0;
+	map_prg(0x8000, 0x8000, 0);
+}
+
+void cnrom::write(uint16_t, uint8_t inData)
+{
+	catch_up_ppu();
+	bank = inData;
+	map_chr(0x0000, 0x2000, bank);
+}
+
+void cnrom::save_state(state_writer& inState) const
+{
+	mapper::save_state(inState);
+	inState.write(bank);
+}
+
+void cnrom::load_state(state_reader& inState)
+{
+	mapper::load_state(inState);
+	inState.read(bank);
+	map_chr(0x0000, 0x2000, bank);
+}
+
+/*
+* MMC3
+* ---
+* Registers are decoded from A15-A13 and A0. A bank data write only
+* remaps the window it targets, a bank select write remaps everything
+* as it can swap the PRG and CHR layouts
+*/
+void mmc3::reset()
+{
+	mapper::reset();
+	bank_select = 0;
+	const uint8_t initial[8] = { 0, 2, 4, 5, 6, 7, 0, 1 };
+	std::copy(initial, initial + 8, registers);
+	irq_latch = 0;
+	irq_counter = 0;
+	irq_reload = false;
+	irq_enabled = false;
+	counts_scanlines = true;
+	apply_prg();
+	apply_chr();
+}
+
+void mmc3::write(uint16_t inAddr, uint8_t inData)
+{
+	switch (inAddr & 0xE001) {
+	case 0x8000:
+		catch_up_ppu();
+		bank_select = inData;
+		apply_prg();
+		apply_chr();
+		break;
+	case 0x8001:
+		registers[bank_select & 0x07] = inData;
+		if ((bank_select & 0x07) < 6) {
+			catch_up_ppu();
+			map_chr_register(bank_select & 0x07);
+		}
+		else {
+			map_prg_register(bank_select & 0x07);
+		}
+		break;
+	case 0xA000:
+		if (cartridge->mirror != rom::mirroring::four_screen) {
+			catch_up_ppu();
+			mirror = (inData & 0x01) ? rom::mirroring::horizontal : rom::mirroring::vertical;
+			ppu_version++;
+		}
+		break;
+	case 0xA001:
+		// PRG-RAM protect, left unemulated like most boards' software expects
+		break;
+	case 0xC000:
+		irq_latch = inData;
+		break;
+	case 0xC001:
+		irq_counter = 0;
+		irq_reload = true;
+		break;
+	case 0xE000:
+		irq_enabled = false;
+		cBUS->clear_irq(bus::irq_source::mapper);
+		break;
+	case 0xE001:
+		irq_enabled = true;
+		break;
+	}
+}
+
+void mmc3::save_state(state_writer& inState) const
+{
+	mapper::save_state(inState);
+	inState.write(bank_select);
+	inState.write(registers);
+	inState.write(irq_latch);
+	inState.write(irq_counter);
+	inState.write(irq_reload);
+	inState.write(irq_enabled);
+}
+
+void mmc3::load_state(state_reader& inState)
+{
+	mapper::load_state(inState);
+	inState.read(bank_select);
+	inState.read(registers);
+	inState.read(irq_latch);
+	inState.read(irq_counter);
+	inState.read(irq_reload);
+	inState.read(irq_enabled);
+	apply_prg();
+	apply_chr();
+}
+
+void mmc3::apply_prg()
+{
+	map_prg_register(6);
+	map_prg_register(7);
+
+	// Bit 6 swaps the switchable $8000 bank with the fixed second to last one at $C000
+	map_prg((bank_select & 0x40) ? 0x8000 : 0xC000, 0x2000, -2);
+	map_prg(0xE000, 0x2000, -1);
+}
+
+void mmc3::apply_chr()
+{
+	for (uint8_t index = 0; index < 6; index++) {
+		map_chr_register(index);
+	}
+}
+
+void mmc3::map_prg_register(uint8_t inIndex)
+{
+	uint16_t swap = (bank_select & 0x40) ? 0x4000 : 0;
+
+	if (inIndex == 6) {
+		map_prg(0x8000 ^ swap, 0x2000, registers[6] & 0x3F);
+	}
+	else {
+		map_prg(0xA000, 0x2000, registers[7] & 0x3F);
+	}
+}
+
+void mmc3::map_chr_register(uint8_t inIndex)
+{
+	// Bit 7 swaps the 2KB and 1KB halves of the pattern tables
+	uint16_t inversion = (bank_select & 0x80) ? 0x1000 : 0;
+
+	if (inIndex < 2) {
+		map_chr((inIndex * 0x0800) ^ inversion, 0x0800, registers[inIndex] >> 1);
+	}
+	else {
+		map_chr((0x1000 + (inIndex - 2) * 0x0400) ^ inversion, 0x0400, registers[inIndex]);
+	}
+}
+
+void mmc3::scanline(uint64_t inCycle)
+{
+	if (irq_counter == 0 || irq_reload) {
+		irq_counter = irq_latch;
+		irq_reload = false;
+	}
+	else {
+		irq_counter--;
+	}
+
+	if (irq_counter == 0 && irq_enabled) {
+		cBUS->set_irq(bus::irq_source::mapper, inCycle);
+	}
+}
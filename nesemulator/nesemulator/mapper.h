@@ -0,0 +1,156 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "bus.h"
+#include "rom.h"
+#include "state.h"
+
+/*
+* Cartridge mappers
+* ---
+* A mapper owns the per instance cartridge state (PRG-RAM, CHR-RAM and
+* its registers) and decides which part of the rom image each window of
+* the address space shows. Bank switching never copies data: it points
+* the bus pages for a PRG window, or the entries of chr_pages for a CHR
+* window, at a different offset in the image. Reads stay on the bus's
+* direct pointer path; only writes to $8000-$FFFF reach the mapper.
+*/
+class mapper : public bus_device
+{
+protected:
+	bus* cBUS;
+	std::shared_ptr<const rom> cartridge;
+	std::vector<uint8_t> prg_ram;
+	std::vector<uint8_t> chr_ram;
+
+	/*
+	* Point inSize bytes at inAddr to bank inBank of that size.
+	* Negative banks count back from the end of the image
+	*/
+	void map_prg(uint16_t inAddr, uint32_t inSize, int inBank);
+	void map_chr(uint16_t inAddr, uint32_t inSize, int inBank);
+
+	// Before a register write changes CHR banks or mirroring, so the pixels before it keep the old ones
+	void catch_up_ppu();
+
+public:
+	/*
+	* PPU side of the cartridge: one pointer per 1KB of pattern table
+	* space ($0000-$1FFF). chr_write_pages is only set for CHR-RAM
+	*/
+	const uint8_t* chr_pages[8] = {};
+	uint8_t* chr_write_pages[8] = {};
+	rom::mirroring mirror;
+	uint32_t ppu_version = 0;	// Bumped whenever any of the above change, so the PPU only copies them then
+	bool counts_scanlines = false;	// The PPU then syncs on every rendered line for scanline()
+
+public:
+	mapper(bus*, std::shared_ptr<const rom>);
+
+	// Build a mapper for the cartridge, nullptr if it isn't supported
+	static std::unique_ptr<mapper> create(bus*, std::shared_ptr<const rom>);
+	// The cartridge's mapper is implemented and its PRG and CHR fill the windows reset() maps
+	static bool supported(const rom&);
+
+	// Map the power on banks
+	virtual void reset();
+
+	// Register PRG-RAM and CHR-RAM as bus memory regions so snapshots carry them
+	void add_regions();
+	// Empty for CHR-ROM cartridges
+	const std::vector<uint8_t>& chr_memory() const { return chr_ram; }
+
+	// Registers only, loading remaps the banks they select
+	virtual void save_state(state_writer&) const;
+	virtual void load_state(state_reader&);
+
+	// Register writes, $8000-$FFFF
+	void write(uint16_t, uint8_t) override {}
+	// Only reached for unbacked pages, returns open bus
+	uint8_t read(uint16_t inAddr) override { return (uint8_t)(inAddr >> 8); }
+
+	// Called by the PPU for each rendered scanline with the cycle it ends at, drives scanline IRQs
+	virtual void scanline(uint64_t) {}
+};
+
+// Mapper 0
+class nrom : public mapper
+{
+public:
+	using mapper::mapper;
+	void reset() override;
+};
+
+// Mapper 1
+class mmc1 : public mapper
+{
+private:
+	uint8_t shift = 0x10;	// Bit 4 reaching bit 0 marks the fifth write
+	uint8_t control = 0x0C;
+	uint8_t chr_bank[2] = {};
+	uint8_t prg_bank = 0;
+
+	void apply_banks();
+
+public:
+	using mapper::mapper;
+	void reset() override;
+	void write(uint16_t, uint8_t) override;
+	void save_state(state_writer&) const override;
+	void load_state(state_reader&) override;
+};
+
+// Mapper 2
+class uxrom : public mapper
+{
+private:
+	uint8_t bank = 0;
+
+public:
+	using mapper::mapper;
+	void reset() override;
+	void write(uint16_t, uint8_t) override;
+	void save_state(state_writer&) const override;
+	void load_state(state_reader&) override;
+};
+
+// Mapper 3
+class cnrom : public mapper
+{
+private:
+	uint8_t bank = 0;
+
+public:
+	using mapper::mapper;
+	void reset() override;
+	void write(uint16_t, uint8_t) override;
+	void save_state(state_writer&) const override;
+	void load_state(state_reader&) override;
+};
+
+// Mapper 4
+class mmc3 : public mapper
+{
+private:
+	uint8_t bank_select = 0;
+	uint8_t registers[8] = {};
+	uint8_t irq_latch = 0;
+	uint8_t irq_counter = 0;
+	bool irq_reload = false;
+	bool irq_enabled = false;
+
+	void apply_prg();
+	void apply_chr();
+	// Only the window bank register inIndex selects: 0-5 CHR, 6-7 PRG
+	void map_prg_register(uint8_t inIndex);
+	void map_chr_register(uint8_t inIndex);
+
+public:
+	using mapper::mapper;
+	void reset() override;
+	void write(uint16_t, uint8_t) override;
+	void scanline(uint64_t inCycle) override;
+	void save_state(state_writer&) const override;
+	void load_state(state_reader&) override;
+};
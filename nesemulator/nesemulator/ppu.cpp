@@ -0,0 +1,628 @@
+#include "ppu.h"
+#include "bus.h"
+#include "mapper.h"
+#include "render_thread.h"
+
+#include <algorithm>
+#include <cstring>
+
+/*
+* Frame layout
+* ---
+* 262 lines of 341 dots. Bus frames start at scanline 241, the first
+* line of vblank, so line r of a bus frame is scanline (r + 241) % 262:
+* vblank, then the pre-render line 261, then the visible lines 0-239
+* and the idle line 240.
+*/
+static constexpr uint32_t LINE_DOTS = 341;
+static constexpr uint32_t LINES = 262;
+static constexpr uint32_t VBLANK_LINE = 241;
+static constexpr uint32_t PRERENDER_LINE = 261;
+static constexpr uint32_t SCANLINE_TICK = 260;	// Dot mappers see a rendered line end at
+static_assert(bus::FRAME_DOTS == LINE_DOTS * LINES, "the bus frame is a PPU frame");
+
+// First cycle at or after inDot, when something that happened on it is visible to the CPU
+static inline uint64_t cycle_of(uint64_t inDot)
+{
+	return (inDot + 2) / 3;
+}
+
+// Earliest cycle a catch-up has to reach for inDot to have run
+static inline uint64_t cycle_after(uint64_t inDot)
+{
+	return inDot / 3 + 1;
+}
+
+ppu::ppu(bus* inBus) : kernels(&sprite_kernels::get()), cBUS(inBus)
+{
+}
+
+ppu::~ppu() = default;
+
+void ppu::reset()
+{
+	ctrl = mask = status = oam_addr = 0;
+	v = t = 0;
+	fine_x = 0;
+	w = false;
+	read_buffer = latch = 0;
+	line_x = line_v = 0;
+	sprites_ready = false;
+	frames_rendered = 0;
+	tiles.clear();
+	mapper_followed = false;
+
+	memset(vram, 0, sizeof(vram));
+	memset(oam, 0, sizeof(oam));
+	memset(palette, 0, sizeof(palette));
+	memset(framebuffer, 0, sizeof(framebuffer));
+	if (cRENDER) {
+		resync_needed = resync::picture;
+	}
+}
+
+/*
+* Render thread
+*/
+void ppu::enable_render_thread(bool inEnable)
+{
+	if (inEnable == (cRENDER != nullptr)) {
+		return;
+	}
+	cRENDER.reset(inEnable ? new render_thread() : nullptr);
+	resync_needed = inEnable ? resync::picture : resync::none;
+}
+
+void ppu::flush()
+{
+	if (cRENDER) {
+		cRENDER->drain();
+	}
+}
+
+uint64_t ppu::picture_end(uint64_t inFrame)
+{
+	return inFrame * bus::FRAME_DOTS + (PRERENDER_LINE - VBLANK_LINE + 1 + HEIGHT) * LINE_DOTS;
+}
+
+const uint8_t* ppu::picture(uint64_t inFrame)
+{
+	return cRENDER ? cRENDER->picture(inFrame) : framebuffer;
+}
+
+// The render thread gets whatever changed since the last call, and a fresh copy of everything first if needed
+void ppu::follow_mapper()
+{
+	const mapper& cartridge = *cBUS->cMAPPER;
+	if (mapper_followed && mapper_version == cartridge.ppu_version && resync_needed == resync::none) {
+		return;
+	}
+	memcpy(chr, cartridge.chr_pages, sizeof(chr));
+	memcpy(chr_write, cartridge.chr_write_pages, sizeof(chr_write));
+	mirror = cartridge.mirror;
+	mapper_followed = true;
+	mapper_version = cartridge.ppu_version;
+
+	if (cRENDER) {
+		if (resync_needed != resync::none) {
+			cRENDER->resync(*this, cartridge.chr_memory(), resync_needed == resync::picture);
+			resync_needed = resync::none;
+		}
+		cRENDER->map(chr, chr_write, mirror);
+	}
+}
+
+bool ppu::drawing() const
+{
+	return !cBUS || (cBUS->output_enabled && !cRENDER);
+}
+
+/*
+* Rendering
+*/
+void ppu::run_until(uint64_t inCycle)
+{
+	if (cBUS) {
+		follow_mapper();
+	}
+
+	uint64_t dot = synced_cycle * 3;
+	uint64_t end = inCycle * 3;
+
+	while (dot < end) {
+		uint64_t in_frame = dot % bus::FRAME_DOTS;
+		uint32_t line = (uint32_t)(in_frame / LINE_DOTS);
+		uint32_t from = (uint32_t)(in_frame % LINE_DOTS);
+		uint32_t to = (uint32_t)std::min<uint64_t>(LINE_DOTS, from + (end - dot));
+
+		run_line((line + VBLANK_LINE) % LINES, from, to, dot - from);
+		dot += to - from;
+	}
+
+	if (cRENDER) {
+		cRENDER->ran(inCycle, status);
+	}
+}
+
+// Dots [inFrom, inTo) of a scanline starting at dot inLineDot
+void ppu::run_line(uint32_t inLine, uint32_t inFrom, uint32_t inTo, uint64_t inLineDot)
+{
+	auto crosses = [&](uint32_t inDot) { return inFrom <= inDot && inDot < inTo; };
+
+	if (inLine < HEIGHT) {
+		if (inFrom == 0) {
+			line_x = (uint16_t)((v & 0x400) >> 2 | (v & 0x1F) << 3 | fine_x);
+			line_v = v;
+		}
+		if (!sprites_ready) {
+			evaluate_sprites(inLine);
+		}
+
+		// Pixel x comes out on dot x + 1
+		uint32_t first = std::max<uint32_t>(inFrom, 1);
+		uint32_t last = std::min<uint32_t>(inTo, WIDTH + 1);
+		if (first < last) {
+			render_pixels(inLine, first - 1, last - 1);
+		}
+
+		if (rendering() && crosses(256)) {
+			increment_y();
+			v = (v & ~0x41F) | (t & 0x41F);
+		}
+		if (inTo == LINE_DOTS) {
+			sprites_ready = false;
+		}
+	}
+	else if (inLine == VBLANK_LINE) {
+		if (crosses(1)) {
+			status |= 0x80;
+			frames_rendered++;
+			if (cBUS && (ctrl & 0x80)) {
+				cBUS->schedule_nmi(cycle_of(inLineDot + 1));
+			}
+		}
+	}
+	else if (inLine == PRERENDER_LINE) {
+		if (crosses(1)) {
+			status &= 0x1F;
+		}
+		if (rendering() && crosses(256)) {
+			v = (v & ~0x41F) | (t & 0x41F);
+		}
+		if (rendering() && crosses(280)) {
+			v = (v & 0x41F) | (t & ~0x41F);
+		}
+	}
+
+	if (cBUS && (inLine < HEIGHT || inLine == PRERENDER_LINE) && rendering() && crosses(SCANLINE_TICK)) {
+		cBUS->cMAPPER->scanline(cycle_of(inLineDot + SCANLINE_TICK));
+	}
+}
+
+void ppu::increment_y()
+{
+	if ((v & 0x7000) != 0x7000) {
+		v += 0x1000;
+		return;
+	}
+
+	v &= ~0x7000;
+	uint16_t y = (v & 0x3E0) >> 5;
+	if (y == 29) {
+		y = 0;
+		v ^= 0x800;
+	}
+	else if (y == 31) {
+		y = 0;
+	}
+	else {
+		y++;
+	}
+	v = (uint16_t)((v & ~0x3E0) | y << 5);
+}
+
+/*
+* The first 8 sprites in OAM order that cover the line, drawn into
+* sprite_line back to front so the lowest index wins each pixel. A
+* sprite's Y is one less than its first line
+*/
+void ppu::evaluate_sprites(uint32_t inLine)
+{
+	memset(sprite_line, 0, sizeof(sprite_line));
+	sprite_zero_on_line = false;
+	sprites_ready = true;
+	if (!rendering()) {
+		return;
+	}
+
+	tiles.map(chr);
+	uint32_t height = (ctrl & 0x20) ? 16 : 8;
+	uint8_t found[8];
+	uint32_t count = kernels->evaluate(oam, inLine - 1, height, found);
+	if (count > 8) {
+		status |= 0x20;
+		count = 8;
+	}
+
+	while (count--) {
+		const uint8_t* sprite = oam + found[count] * 4;
+		uint8_t attributes = sprite[2];
+		uint32_t row = inLine - 1 - sprite[0];
+		if (attributes & 0x80) {
+			row = height - 1 - row;
+		}
+
+		uint16_t addr;
+		if (height == 16) {
+			addr = (uint16_t)((sprite[1] & 0x01) << 12 | ((sprite[1] & 0xFE) + (row >> 3)) << 4 | (row & 7));
+		}
+		else {
+			addr = (uint16_t)((ctrl & 0x08) << 9 | sprite[1] << 4 | row);
+		}
+		const uint8_t* pixels = tiles.row(addr) + ((attributes & 0x40) ? 8 : 0);
+
+		uint8_t base = (uint8_t)(0x10 | (attributes & 0x03) << 2 | ((attributes & 0x20) ? SPRITE_BEHIND : 0) | (found[count] == 0 ? SPRITE_ZERO : 0));
+		kernels->draw(sprite_line + sprite[3], pixels, base);
+		sprite_zero_on_line |= found[count] == 0;
+	}
+}
+
+void ppu::render_pixels(uint32_t inLine, uint32_t inFrom, uint32_t inTo)
+{
+	// Frames nobody sees, and the CPU thread's side of a render thread, only need the pixels that can set sprite 0 hit
+	if (!drawing() && !(sprite_zero_on_line && !(status & 0x40))) {
+		return;
+	}
+
+	uint8_t* out = framebuffer + inLine * WIDTH;
+	uint8_t grey = (mask & 0x01) ? 0x30 : 0x3F;
+	if (!rendering()) {
+		memset(out + inFrom, palette[0] & grey, inTo - inFrom);
+		return;
+	}
+
+	// Background, a tile at a time
+	if (mask & 0x08) {
+		map_nametables();
+		tiles.map(chr);
+		uint16_t table = (uint16_t)((ctrl & 0x10) << 8);
+		uint32_t fine_y = line_v >> 12;
+		uint32_t coarse_y = (line_v >> 5) & 0x1F;
+		uint32_t x = inFrom;
+
+		while (x < inTo) {
+			uint32_t scroll = (line_x + x) & 0x1FF;
+			uint32_t coarse_x = (scroll >> 3) & 0x1F;
+			const uint8_t* nametable = nametables[(line_v >> 10 & 0x02) | scroll >> 8];
+
+			uint8_t tile = nametable[coarse_y << 5 | coarse_x];
+			uint8_t attribute = nametable[0x3C0 | (coarse_y >> 2) << 3 | coarse_x >> 2];
+			uint8_t colour = (uint8_t)((attribute >> ((coarse_y & 0x02) << 1 | (coarse_x & 0x02)) & 0x03) << 2);
+			const uint8_t* pixels = tiles.row((uint16_t)(table | tile << 4 | fine_y)) + (scroll & 7);
+
+			uint32_t count = std::min(8 - (scroll & 7), inTo - x);
+			for (uint32_t i = 0; i < count; i++) {
+				background_line[x + i] = pixels[i] ? colour | pixels[i] : 0;
+			}
+			x += count;
+		}
+		if (!(mask & 0x02)) {
+			for (x = inFrom; x < std::min<uint32_t>(inTo, 8); x++) {
+				background_line[x] = 0;
+			}
+		}
+	}
+	else {
+		memset(background_line + inFrom, 0, inTo - inFrom);
+	}
+
+	// Each pixel is only rendered once, so hidden sprite pixels can be cleared in place
+	if (!(mask & 0x10)) {
+		memset(sprite_line + inFrom, 0, inTo - inFrom);
+	}
+	else if (!(mask & 0x04)) {
+		for (uint32_t x = inFrom; x < std::min<uint32_t>(inTo, 8); x++) {
+			sprite_line[x] = 0;
+		}
+	}
+
+	// Sprite 0 can't hit on the last pixel
+	uint32_t last = std::min<uint32_t>(inTo, WIDTH - 1);
+	if (inFrom < last && kernels->composite(out + inFrom, background_line + inFrom, sprite_line + inFrom, last - inFrom, palette, grey)) {
+		status |= (mask & 0x18) == 0x18 ? 0x40 : 0;
+	}
+	if (inTo == WIDTH) {
+		kernels->composite(out + WIDTH - 1, background_line + WIDTH - 1, sprite_line + WIDTH - 1, 1, palette, grey);
+	}
+}
+
+/*
+* PPU address space
+*/
+void ppu::map_nametables()
+{
+	static const uint8_t layouts[5][4] = {
+		{ 0, 0, 1, 1 },	// horizontal
+		{ 0, 1, 0, 1 },	// vertical
+		{ 0, 1, 2, 3 },	// four_screen
+		{ 0, 0, 0, 0 },	// single_lower
+		{ 1, 1, 1, 1 }	// single_upper
+	};
+	const uint8_t* layout = layouts[(size_t)mirror];
+	for (int i = 0; i < 4; i++) {
+		nametables[i] = vram + layout[i] * 0x400;
+	}
+}
+
+uint8_t ppu::read_chr(uint16_t inAddr) const
+{
+	return chr[(inAddr >> 10) & 7][inAddr & 0x3FF];
+}
+
+// Palette entry 0 of each sprite palette is the one of the background palette under it
+static inline uint8_t palette_index(uint16_t inAddr)
+{
+	uint8_t index = inAddr & 0x1F;
+	return (index & 0x13) == 0x10 ? index & 0x0F : index;
+}
+
+uint8_t ppu::read_memory(uint16_t inAddr)
+{
+	inAddr &= 0x3FFF;
+	if (inAddr < 0x2000) {
+		return read_chr(inAddr);
+	}
+	if (inAddr < 0x3F00) {
+		map_nametables();
+		return nametables[(inAddr >> 10) & 3][inAddr & 0x3FF];
+	}
+	return palette[palette_index(inAddr)];
+}
+
+void ppu::write_memory(uint16_t inAddr, uint8_t inData)
+{
+	inAddr &= 0x3FFF;
+	if (inAddr < 0x2000) {
+		uint8_t* page = chr_write[inAddr >> 10];
+		if (page) {
+			page[inAddr & 0x3FF] = inData;
+			tiles.write(page + (inAddr & 0x3FF));
+		}
+	}
+	else if (inAddr < 0x3F00) {
+		map_nametables();
+		nametables[(inAddr >> 10) & 3][inAddr & 0x3FF] = inData;
+	}
+	else {
+		palette[palette_index(inAddr)] = inData & 0x3F;
+	}
+}
+
+/*
+* Registers
+*/
+uint8_t ppu::read(uint16_t inAddr)
+{
+	if (inAddr >= 0x4000) {
+		return cBUS->cINPUT.read(inAddr);
+	}
+
+	cBUS->catch_up(*this);
+	uint8_t reg = inAddr & 0x07;
+	if (reg == 7) {
+		follow_mapper();
+	}
+	// A $2002 read that finds the toggle and the vblank flag clear changes nothing, as in polling loops
+	bool changes = reg == 7 || (reg == 2 && (w || (status & 0x80)));
+	uint8_t data = read_register(reg);
+	if (cRENDER && changes) {
+		cRENDER->push({ 0, nullptr, render_thread::entry_kind::read, reg, 0 });
+	}
+	return data;
+}
+
+uint8_t ppu::read_register(uint8_t inRegister)
+{
+	switch (inRegister) {
+	case 2:
+		latch = (status & 0xE0) | (latch & 0x1F);
+		status &= 0x7F;
+		w = false;
+		break;
+	case 4:
+		latch = oam[oam_addr];
+		break;
+	case 7:
+		if ((v & 0x3FFF) < 0x3F00) {
+			latch = read_buffer;
+			read_buffer = read_memory(v);
+		}
+		else {
+			// Palette reads come straight back, the buffer gets the nametable byte under them
+			latch = (latch & 0xC0) | read_memory(v);
+			read_buffer = read_memory(v - 0x1000);
+		}
+		v = (v + ((ctrl & 0x04) ? 32 : 1)) & 0x7FFF;
+		break;
+	}
+	return latch;
+}
+
+uint8_t ppu::peek(uint16_t inAddr)
+{
+	if (inAddr >= 0x4000) {
+		return cBUS->cINPUT.peek(inAddr);
+	}
+
+	switch (inAddr & 0x07) {
+	case 2: return (status & 0xE0) | (latch & 0x1F);
+	case 4: return oam[oam_addr];
+	case 7: return read_buffer;
+	default: return latch;
+	}
+}
+
+void ppu::write(uint16_t inAddr, uint8_t inData)
+{
+	if (inAddr >= 0x4000) {
+		if (inAddr == 0x4014) {
+			oam_dma(inData);
+		}
+		else {
+			cBUS->cINPUT.write(inAddr, inData);
+		}
+		return;
+	}
+
+	cBUS->catch_up(*this);
+	uint8_t reg = inAddr & 0x07;
+	if (reg == 7) {
+		follow_mapper();
+	}
+	write_register(reg, inData);
+	if (cRENDER) {
+		cRENDER->push({ 0, nullptr, render_thread::entry_kind::write, reg, inData });
+	}
+}
+
+void ppu::write_register(uint8_t inRegister, uint8_t inData)
+{
+	latch = inData;
+	switch (inRegister) {
+	case 0:
+		// Enabling NMI during vblank raises one straight away
+		if (cBUS && !(ctrl & 0x80) && (inData & 0x80) && (status & 0x80)) {
+			cBUS->schedule_nmi(cBUS->cCPU.total_cycles);
+		}
+		ctrl = inData;
+		t = (uint16_t)((t & ~0x0C00) | (inData & 0x03) << 10);
+		break;
+	case 1:
+		mask = inData;
+		if (cBUS) {
+			cBUS->reschedule();
+		}
+		break;
+	case 3:
+		oam_addr = inData;
+		break;
+	case 4:
+		oam[oam_addr++] = inData;
+		break;
+	case 5:
+		if (!w) {
+			t = (uint16_t)((t & ~0x001F) | inData >> 3);
+			fine_x = inData & 0x07;
+		}
+		else {
+			t = (uint16_t)((t & ~0x73E0) | (inData & 0x07) << 12 | (inData & 0xF8) << 2);
+		}
+		w = !w;
+		break;
+	case 6:
+		if (!w) {
+			t = (uint16_t)((t & 0x00FF) | (inData & 0x3F) << 8);
+		}
+		else {
+			t = (uint16_t)((t & 0xFF00) | inData);
+			v = t;
+
+			// Mid-line the rest of the line continues from the new address
+			uint64_t in_frame = synced_cycle * 3 % bus::FRAME_DOTS;
+			uint32_t line = (uint32_t)(in_frame / LINE_DOTS + VBLANK_LINE) % LINES;
+			uint32_t dot = (uint32_t)(in_frame % LINE_DOTS);
+			if (line < HEIGHT && dot > 0 && dot <= WIDTH) {
+				line_x = (uint16_t)(((v & 0x400) >> 2 | (v & 0x1F) << 3 | fine_x) - (dot - 1)) & 0x1FF;
+				line_v = v;
+			}
+		}
+		w = !w;
+		break;
+	case 7:
+		write_memory(v, inData);
+		v = (v + ((ctrl & 0x04) ? 32 : 1)) & 0x7FFF;
+		break;
+	}
+}
+
+/*
+* 256 bytes from CPU page inPage into OAM. The CPU is stalled 513
+* cycles, 514 when the write lands on an odd cycle
+*/
+void ppu::oam_dma(uint8_t inPage)
+{
+	cBUS->catch_up(*this);
+	for (uint32_t i = 0; i < 0x100; i++) {
+		uint8_t data = cBUS->read((uint16_t)(inPage << 8 | i));
+		oam[(oam_addr + i) & 0xFF] = data;
+		// 256 $2004 writes leave the replica's oam_addr where it was too
+		if (cRENDER) {
+			cRENDER->push({ 0, nullptr, render_thread::entry_kind::write, 4, data });
+		}
+	}
+	cBUS->cCPU.total_cycles += 513 + (cBUS->cCPU.total_cycles & 1);
+}
+
+/*
+* The next vblank start, or with rendering on for a mapper that counts
+* scanlines, the next rendered line's tick if that comes first
+*/
+uint64_t ppu::next_sync()
+{
+	// Dots before synced_cycle * 3 have run
+	uint64_t dot = synced_cycle * 3;
+	uint64_t in_frame = dot % bus::FRAME_DOTS;
+	uint64_t frame_start = dot - in_frame;
+	uint64_t next = frame_start + (in_frame <= 1 ? 1 : bus::FRAME_DOTS + 1);
+
+	if (rendering() && cBUS->cMAPPER->counts_scanlines) {
+		// Rendered scanlines 261 and 0-239 are lines 20-260 of the bus frame
+		const uint64_t first = PRERENDER_LINE - VBLANK_LINE;
+		const uint64_t last = first + HEIGHT;
+		uint64_t line = std::max(in_frame / LINE_DOTS + (in_frame % LINE_DOTS > SCANLINE_TICK ? 1 : 0), first);
+		uint64_t tick = line <= last ? frame_start + line * LINE_DOTS + SCANLINE_TICK :
+			frame_start + bus::FRAME_DOTS + first * LINE_DOTS + SCANLINE_TICK;
+		next = std::min(next, tick);
+	}
+	return cycle_after(next);
+}
+
+void ppu::save_state(state_writer& inState) const
+{
+	inState.write(ctrl);
+	inState.write(mask);
+	inState.write(status);
+	inState.write(oam_addr);
+	inState.write(v);
+	inState.write(t);
+	inState.write(fine_x);
+	inState.write(w);
+	inState.write(read_buffer);
+	inState.write(latch);
+	inState.write(line_x);
+	inState.write(line_v);
+}
+
+void ppu::load_state(state_reader& inState)
+{
+	inState.read(ctrl);
+	inState.read(mask);
+	inState.read(status);
+	inState.read(oam_addr);
+	inState.read(v);
+	inState.read(t);
+	inState.read(fine_x);
+	inState.read(w);
+	inState.read(read_buffer);
+	inState.read(latch);
+	inState.read(line_x);
+	inState.read(line_v);
+	sprites_ready = false;
+	// CHR-RAM may hold different tiles now, CHR-ROM pages are checked against the mapper's by tiles.map()
+	if (cBUS && cBUS->cMAPPER && !cBUS->cMAPPER->chr_memory().empty()) {
+		tiles.clear();
+	}
+	if (cRENDER && resync_needed == resync::none) {
+		resync_needed = resync::state;
+	}
+}
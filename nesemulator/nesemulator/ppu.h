@@ -0,0 +1,156 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include "device.h"
+#include "rom.h"
+#include "sprite_kernels.h"
+#include "state.h"
+#include "tile_cache.h"
+
+class bus;
+class render_thread;
+
+/*
+* Picture processing unit
+* ---
+* Not a per dot state machine: the PPU is a clocked component the bus
+* catches up, and it renders everything between the dot it stopped at
+* and the catch-up point in one go. Without register accesses that is
+* whole scanlines; an access in the middle of a line first renders the
+* pixels up to it, so raster effects that change the scroll, pattern
+* tables or mask mid-line still land on the right pixel. Pixels are 6
+* bit palette indices in framebuffer, one contiguous 256x240 array the
+* frontend converts to colours.
+*
+* Frames as counted by the bus start at the start of vblank, so after
+* bus::run_frame() the picture in framebuffer is complete. Vblank and
+* the NMI come from next_sync, so they are exact to the CPU cycle.
+* Sprite 0 hit is found while rendering the pixel it happens on; since
+* reads of $2002 catch the PPU up first, a game polling it sees the flag
+* on the same instruction it would on hardware. Mappers that count
+* scanlines (MMC3) get a sync at dot 260 of every rendered line.
+*
+* Registers are mirrored over $2000-$3FFF. The PPU also takes the $40xx
+* page for OAM DMA at $4014 and passes every other access there on to
+* the controllers.
+*
+* enable_render_thread() moves the pixels to a second core, see
+* render_thread.h. framebuffer is then scratch space of the CPU thread
+* and pictures come from picture().
+*/
+class ppu : public bus_device, public clocked_device
+{
+public:
+	static constexpr uint32_t WIDTH = 256;
+	static constexpr uint32_t HEIGHT = 240;
+
+	uint8_t framebuffer[WIDTH * HEIGHT] = {};
+	uint64_t frames_rendered = 0;	// Pictures completed, at the start of each vblank
+
+	tile_cache tiles;	// Pattern tiles the renderer reads, decoded
+	const sprite_kernels* kernels;	// Sprite evaluation and compositing, the best the host runs by default
+
+	/*
+	* Memory, registered as bus regions so snapshots carry it.
+	* 4KB of nametable RAM so four screen cartridges need nothing extra
+	*/
+	uint8_t vram[0x1000] = {};
+	uint8_t oam[0x100] = {};
+	uint8_t palette[0x20] = {};
+
+private:
+	friend class render_thread;
+
+	bus* cBUS;	// nullptr for the replica a render thread draws with
+	std::unique_ptr<render_thread> cRENDER;
+	enum class resync : uint8_t {
+		none,
+		state,		// Registers and memory changed under the render thread
+		picture		// And the picture, on reset or when it starts
+	} resync_needed = resync::none;
+
+	// The mapper's pattern pages and mirroring, as of the last catch-up or $2007 access
+	bool mapper_followed = false;	// Up to the mapper's ppu_version below
+	uint32_t mapper_version = 0;
+	const uint8_t* chr[8] = {};
+	uint8_t* chr_write[8] = {};
+	rom::mirroring mirror = rom::mirroring::horizontal;
+
+	uint8_t ctrl = 0;		// $2000
+	uint8_t mask = 0;		// $2001
+	uint8_t status = 0;		// $2002
+	uint8_t oam_addr = 0;	// $2003
+	uint16_t v = 0;			// Current VRAM address
+	uint16_t t = 0;			// Temporary VRAM address, the scroll the next line or frame starts from
+	uint8_t fine_x = 0;
+	bool w = false;			// $2005 / $2006 write toggle
+	uint8_t read_buffer = 0;	// $2007 reads below the palette are delayed by one
+	uint8_t latch = 0;		// Last value on the PPU data bus, what unused bits read as
+
+	// Background scroll of the line being rendered
+	uint16_t line_x = 0;	// Scroll position of pixel 0, 0-511 across two nametables
+	uint16_t line_v = 0;	// v at the start of the line, for the vertical scroll
+
+	/*
+	* Sprites of the line being rendered, evaluated when it starts
+	* - One entry per pixel, 0 for none, otherwise 0x10 | palette << 2 | pixel
+	*   plus SPRITE_BEHIND and SPRITE_ZERO. Sprites are drawn 8 pixels
+	*   at a time, so there is room for one at X 255
+	*/
+	uint8_t sprite_line[WIDTH + 8] = {};
+	uint8_t background_line[WIDTH] = {};
+	bool sprites_ready = false;
+	bool sprite_zero_on_line = false;
+
+	uint8_t* nametables[4] = {};	// $2000, $2400, $2800 and $2C00 after mirroring
+
+	void follow_mapper();
+	void run_line(uint32_t inLine, uint32_t inFrom, uint32_t inTo, uint64_t inLineDot);
+	void evaluate_sprites(uint32_t inLine);
+	void render_pixels(uint32_t inLine, uint32_t inFrom, uint32_t inTo);
+	void increment_y();
+	void map_nametables();
+
+	uint8_t read_chr(uint16_t inAddr) const;
+	uint8_t read_memory(uint16_t inAddr);
+	void write_memory(uint16_t inAddr, uint8_t inData);
+	void oam_dma(uint8_t inPage);
+	uint8_t read_register(uint8_t inRegister);
+	void write_register(uint8_t inRegister, uint8_t inData);
+
+	bool rendering() const { return (mask & 0x18) != 0; }
+	// Whether all pixels are wanted, not only those that can set sprite 0 hit
+	bool drawing() const;
+
+public:
+	ppu(bus*);
+	~ppu();
+
+	// Power on state, also clears the picture
+	void reset();
+
+	void enable_render_thread(bool inEnable);
+	render_thread* renderer() const { return cRENDER.get(); }
+	// Wait for the render thread to draw everything run so far, before memory it reads goes away
+	void flush();
+
+	// First dot after the last visible line of bus frame inFrame
+	static uint64_t picture_end(uint64_t inFrame);
+
+	/*
+	* The picture of bus frame inFrame. With a render thread this waits for
+	* it, see render_thread::picture(); without one it is framebuffer, and
+	* only the last frame run is there
+	*/
+	const uint8_t* picture(uint64_t inFrame);
+
+	uint8_t read(uint16_t) override;
+	void write(uint16_t, uint8_t) override;
+	uint8_t peek(uint16_t) override;
+
+	void run_until(uint64_t inCycle) override;
+	uint64_t next_sync() override;
+
+	void save_state(state_writer&) const override;
+	void load_state(state_reader&) override;
+};
@@ -0,0 +1,269 @@
+#include "profiler.h"
+#include "cpu.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+* Dump layout
+* ---
+* 4 byte magic, the node size and node count as little endian uint32,
+* then the per PC counts and cycles, the per opcode counts and cycles,
+* all uint64, and the call tree nodes in the order they were added, so
+* a node always comes after its parent
+*/
+static const char profile_magic[4] = { 'N', 'P', 'R', 'F' };
+
+void profiler::enable(size_t inNodes, uint32_t inMaxDepth)
+{
+	pc_counts.reset(new uint64_t[0x10000]());
+	pc_cycles.reset(new uint64_t[0x10000]());
+	memset(opcode_counts, 0, sizeof(opcode_counts));
+	memset(opcode_cycles, 0, sizeof(opcode_cycles));
+
+	node_capacity = (uint32_t)std::max<size_t>(inNodes, 1);
+	nodes.reset(new call_node[node_capacity]());
+	node_count = 1;
+	current = 0;
+	depth = 0;
+	max_depth = inMaxDepth;
+	overflow_depth = 0;
+}
+
+void profiler::disable()
+{
+	pc_counts.reset();
+	pc_cycles.reset();
+	nodes.reset();
+	node_count = node_capacity = current = depth = max_depth = overflow_depth = 0;
+}
+
+void profiler::enter(uint16_t inEntry)
+{
+	if (depth == max_depth) {
+		overflow_depth++;
+		return;
+	}
+
+	uint32_t child = nodes[current].first_child;
+	while (child && nodes[child].entry != inEntry) {
+		child = nodes[child].next_sibling;
+	}
+
+	if (!child) {
+		if (node_count == node_capacity) {
+			overflow_depth++;
+			return;
+		}
+		child = node_count++;
+		nodes[child].parent = current;
+		nodes[child].entry = inEntry;
+		nodes[child].next_sibling = nodes[current].first_child;
+		nodes[current].first_child = child;
+	}
+
+	nodes[child].calls++;
+	current = child;
+	depth++;
+}
+
+void profiler::leave()
+{
+	if (overflow_depth) {
+		overflow_depth--;
+	}
+	// Returning from the top level, a stack trick, stays there
+	else if (depth) {
+		current = nodes[current].parent;
+		depth--;
+	}
+}
+
+void profiler::interrupt(uint16_t inHandler, uint8_t inCycles)
+{
+	enter(inHandler);
+	nodes[current].cycles += inCycles;
+}
+
+void profiler::dump(std::ostream& out) const
+{
+	uint32_t node_size = sizeof(call_node);
+
+	out.write(profile_magic, sizeof(profile_magic));
+	out.write((const char*)&node_size, sizeof(node_size));
+	out.write((const char*)&node_count, sizeof(node_count));
+	if (!enabled()) {
+		return;
+	}
+	out.write((const char*)pc_counts.get(), 0x10000 * sizeof(uint64_t));
+	out.write((const char*)pc_cycles.get(), 0x10000 * sizeof(uint64_t));
+	out.write((const char*)opcode_counts, sizeof(opcode_counts));
+	out.write((const char*)opcode_cycles, sizeof(opcode_cycles));
+	out.write((const char*)nodes.get(), (std::streamsize)node_count * sizeof(call_node));
+}
+
+/*
+* Dumps read back for the reports
+*/
+struct profile_dump {
+	std::vector<uint64_t> pc_counts = std::vector<uint64_t>(0x10000);
+	std::vector<uint64_t> pc_cycles = std::vector<uint64_t>(0x10000);
+	uint64_t opcode_counts[0x100];
+	uint64_t opcode_cycles[0x100];
+	std::vector<profiler::call_node> nodes;
+
+	bool read(std::istream& in)
+	{
+		char magic[4];
+		uint32_t node_size = 0;
+		uint32_t node_count = 0;
+
+		in.read(magic, sizeof(magic));
+		in.read((char*)&node_size, sizeof(node_size));
+		in.read((char*)&node_count, sizeof(node_count));
+		if (!in || memcmp(magic, profile_magic, sizeof(magic)) != 0 || node_size != sizeof(profiler::call_node) || !node_count) {
+			return false;
+		}
+
+		nodes.resize(node_count);
+		in.read((char*)pc_counts.data(), pc_counts.size() * sizeof(uint64_t));
+		in.read((char*)pc_cycles.data(), pc_cycles.size() * sizeof(uint64_t));
+		in.read((char*)opcode_counts, sizeof(opcode_counts));
+		in.read((char*)opcode_cycles, sizeof(opcode_cycles));
+		in.read((char*)nodes.data(), (std::streamsize)node_count * sizeof(profiler::call_node));
+		return (bool)in;
+	}
+
+	// "top" for the root, the entry address otherwise
+	static void name(char* out, size_t len, const profiler::call_node& inNode, bool inRoot)
+	{
+		if (inRoot) {
+			snprintf(out, len, "top");
+		}
+		else {
+			snprintf(out, len, "$%04X", inNode.entry);
+		}
+	}
+};
+
+// Indices of the inTop largest values, largest first
+static std::vector<uint32_t> heaviest(const uint64_t* inValues, uint32_t inCount, size_t inTop)
+{
+	std::vector<uint32_t> order;
+	for (uint32_t i = 0; i < inCount; i++) {
+		if (inValues[i]) {
+			order.push_back(i);
+		}
+	}
+	size_t keep = std::min(inTop, order.size());
+	std::partial_sort(order.begin(), order.begin() + keep, order.end(), [&](uint32_t a, uint32_t b) {
+		return inValues[a] > inValues[b];
+	});
+	order.resize(keep);
+	return order;
+}
+
+bool profiler::report(std::istream& in, std::ostream& out, size_t inTop)
+{
+	profile_dump profile;
+	if (!profile.read(in)) {
+		return false;
+	}
+
+	uint64_t instructions = 0;
+	uint64_t cycles = 0;
+	for (const call_node& node : profile.nodes) {
+		instructions += node.instructions;
+		cycles += node.cycles;
+	}
+	double percent = cycles ? 100.0 / cycles : 0;
+
+	char line[160];
+	snprintf(line, sizeof(line), "%llu instructions, %llu cycles, %zu call stacks\n",
+		(unsigned long long)instructions, (unsigned long long)cycles, profile.nodes.size());
+	out << line;
+
+	out << "\nHot PCs\n      PC        count       cycles  cycles%\n";
+	for (uint32_t pc : heaviest(profile.pc_cycles.data(), 0x10000, inTop)) {
+		snprintf(line, sizeof(line), "   $%04X %12llu %12llu  %6.2f%%\n", pc,
+			(unsigned long long)profile.pc_counts[pc], (unsigned long long)profile.pc_cycles[pc], profile.pc_cycles[pc] * percent);
+		out << line;
+	}
+
+	out << "\nOpcodes\n  opcode        count       cycles  cycles%\n";
+	for (uint32_t opcode : heaviest(profile.opcode_cycles, 0x100, inTop)) {
+		snprintf(line, sizeof(line), "  $%02X %s %12llu %12llu  %6.2f%%\n", opcode, cpu::mnemonic(cpu::opcode_table[opcode].operation),
+			(unsigned long long)profile.opcode_counts[opcode], (unsigned long long)profile.opcode_cycles[opcode], profile.opcode_cycles[opcode] * percent);
+		out << line;
+	}
+
+	// Inclusive cycles per node, children always come after their parent
+	std::vector<uint64_t> inclusive(profile.nodes.size());
+	for (size_t i = profile.nodes.size(); i-- > 0;) {
+		inclusive[i] += profile.nodes[i].cycles;
+		if (i) {
+			inclusive[profile.nodes[i].parent] += inclusive[i];
+		}
+	}
+
+	// By subroutine over every stack it ran in, a recursive call isn't counted twice
+	std::vector<uint64_t> self(0x10000), total(0x10000), calls(0x10000);
+	for (size_t i = 1; i < profile.nodes.size(); i++) {
+		const call_node& node = profile.nodes[i];
+		self[node.entry] += node.cycles;
+		calls[node.entry] += node.calls;
+
+		bool nested = false;
+		for (uint32_t up = node.parent; up && !nested; up = profile.nodes[up].parent) {
+			nested = profile.nodes[up].entry == node.entry;
+		}
+		if (!nested) {
+			total[node.entry] += inclusive[i];
+		}
+	}
+
+	out << "\nSubroutines\n   entry        calls    inclusive  incl%         self  self%\n";
+	for (uint32_t entry : heaviest(total.data(), 0x10000, inTop)) {
+		snprintf(line, sizeof(line), "   $%04X %12llu %12llu %6.2f%% %12llu %6.2f%%\n", entry, (unsigned long long)calls[entry],
+			(unsigned long long)total[entry], total[entry] * percent, (unsigned long long)self[entry], self[entry] * percent);
+		out << line;
+	}
+	return true;
+}
+
+bool profiler::folded(std::istream& in, std::ostream& out)
+{
+	profile_dump profile;
+	if (!profile.read(in)) {
+		return false;
+	}
+
+	char name[16];
+	std::vector<uint32_t> stack;
+	for (uint32_t i = 0; i < profile.nodes.size(); i++) {
+		if (!profile.nodes[i].cycles) {
+			continue;
+		}
+
+		stack.clear();
+		for (uint32_t up = i; up; up = profile.nodes[up].parent) {
+			stack.push_back(up);
+		}
+		stack.push_back(0);
+
+		std::string line;
+		for (size_t depth = stack.size(); depth-- > 0;) {
+			profile_dump::name(name, sizeof(name), profile.nodes[stack[depth]], stack[depth] == 0);
+			line += name;
+			line += depth ? ";" : " ";
+		}
+		line += std::to_string(profile.nodes[i].cycles);
+		out << line << '\n';
+	}
+	return true;
+}
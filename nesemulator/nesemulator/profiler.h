@@ -0,0 +1,91 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <iosfwd>
+#include <memory>
+
+/*
+* Instruction profiler
+* ---
+* Build with NES_PROFILE defined to compile the hooks in cpu::clock()
+* and cpu::interrupt(). Without it the profiler is never touched and
+* costs nothing.
+*
+* enable() allocates everything once: execution counts and cycles per PC
+* and per opcode in flat arrays, and a fixed pool of call tree nodes.
+* Each node is one call stack. JSR and interrupts move to a child of the
+* current node, keyed by the subroutine or handler address, and RTS and
+* RTI move back to its parent. Recording an instruction is then a few
+* increments, plus a walk over the current node's children on JSR. Calls
+* past the depth limit, or made once the pool is full, are charged to the
+* node they were made from. Code that JSRs without ever returning thus
+* still ends up with a bounded tree.
+*
+* dump() writes the counters out as binary. report() turns a dump into
+* hot spot tables by PC, opcode and subroutine, and folded() into a
+* flamegraph.pl compatible folded stack file.
+*/
+class profiler
+{
+public:
+	struct call_node {
+		uint32_t parent;
+		uint32_t first_child;	// 0 when there is none, node 0 is the root
+		uint32_t next_sibling;
+		uint16_t entry;			// Subroutine or handler address
+		uint64_t calls;
+		uint64_t instructions;	// Run in this node itself, not its children
+		uint64_t cycles;
+	};
+
+private:
+	std::unique_ptr<uint64_t[]> pc_counts;
+	std::unique_ptr<uint64_t[]> pc_cycles;
+	uint64_t opcode_counts[0x100];
+	uint64_t opcode_cycles[0x100];
+
+	std::unique_ptr<call_node[]> nodes;
+	uint32_t node_count = 0;
+	uint32_t node_capacity = 0;
+	uint32_t current = 0;
+	uint32_t depth = 0;
+	uint32_t max_depth = 0;
+	uint32_t overflow_depth = 0;	// Calls made past max_depth or with the pool full
+
+	void enter(uint16_t inEntry);
+	void leave();
+
+public:
+	// Allocate the tables with room for inNodes call stacks up to inMaxDepth calls deep and start counting from zero
+	void enable(size_t inNodes = 0x10000, uint32_t inMaxDepth = 64);
+	void disable();
+	bool enabled() const { return nodes != nullptr; }
+
+	// Only call while enabled(). inTarget is the address a JSR calls
+	inline void record(uint16_t inPC, uint8_t inOpcode, uint8_t inCycles, uint16_t inTarget)
+	{
+		pc_counts[inPC]++;
+		pc_cycles[inPC] += inCycles;
+		opcode_counts[inOpcode]++;
+		opcode_cycles[inOpcode] += inCycles;
+		nodes[current].instructions++;
+		nodes[current].cycles += inCycles;
+
+		if (inOpcode == 0x20) {			// JSR
+			enter(inTarget);
+		}
+		else if (inOpcode == 0x60 || inOpcode == 0x40) {	// RTS, RTI
+			leave();
+		}
+	}
+
+	// An interrupt started the handler at inHandler, its cycles are the handler's
+	void interrupt(uint16_t inHandler, uint8_t inCycles);
+
+	void dump(std::ostream&) const;
+
+	// Hot spot tables of a dump, the inTop heaviest entries of each. False if it isn't a dump
+	static bool report(std::istream&, std::ostream&, size_t inTop);
+	// One "top;$C000;$C123 cycles" line per call stack that ran anything
+	static bool folded(std::istream&, std::ostream&);
+};
@@ -1,16 +1,12 @@
 #include "ram.h"
-#pragma warning( disable : 6385 )
 
+// memory covers every uint16_t address, so no bounds checks are needed
 uint8_t ram::read(uint16_t inAddr)
 {
-	if (inAddr <= MAXRAMSIZE) {
-		return memory[inAddr];
-	}
+	return memory[inAddr];
 }
 
 void ram::write(uint16_t inAddr, uint8_t inData)
 {
-	if (inAddr <= MAXRAMSIZE) {
-		memory[inAddr] = inData;
-	}
+	memory[inAddr] = inData;
 }
@@ -3,12 +3,16 @@
 
 #define MAXRAMSIZE 0xFFFF
 
+/*
+* Backing store for the flat 64KB address space. The bus maps its pages,
+* so the CPU reads and writes it through bus::read and bus::write
+*/
 class ram
 {
 private:
-	uint8_t memory[MAXRAMSIZE];
+	uint8_t memory[MAXRAMSIZE + 1];
 public:
 	uint8_t read(uint16_t);
 	void write(uint16_t, uint8_t);
+	uint8_t* data() { return memory; }
 };
-
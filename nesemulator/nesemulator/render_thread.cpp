@@ -0,0 +1,244 @@
+#include "render_thread.h"
+#include "bus.h"
+
+#include <cstring>
+
+render_thread::render_thread() : log(LOG_SIZE), replica(nullptr)
+{
+	worker = std::thread([this] { run(); });
+}
+
+render_thread::~render_thread()
+{
+	{
+		std::lock_guard<std::mutex> hold(lock);
+		stopping = true;
+	}
+	wake_up.notify_one();
+	worker.join();
+}
+
+/*
+* CPU thread
+*/
+void render_thread::append(const entry& inEntry)
+{
+	uint64_t next = head.load(std::memory_order_relaxed);
+	if (next - tail.load(std::memory_order_acquire) >= LOG_SIZE) {
+		wake();
+		while (next - tail.load(std::memory_order_acquire) >= LOG_SIZE) {
+			std::this_thread::yield();
+		}
+	}
+	log[next & (LOG_SIZE - 1)] = inEntry;
+	head.store(next + 1, std::memory_order_release);
+}
+
+void render_thread::flush_run()
+{
+	if (run_pending) {
+		run_pending = false;
+		append(pending_run);
+	}
+}
+
+void render_thread::push(const entry& inEntry)
+{
+	flush_run();
+	append(inEntry);
+}
+
+void render_thread::ran(uint64_t inCycle, uint8_t inStatus)
+{
+	pending_run = { inCycle, nullptr, entry_kind::run, 0, inStatus };
+	run_pending = true;
+
+	// Wake the thread for each picture that can now be drawn to the end, or when a quarter of the log waits
+	bool finished = false;
+	while (inCycle * 3 >= ppu::picture_end(logged_picture)) {
+		logged_picture++;
+		finished = true;
+	}
+	if (finished) {
+		flush_run();
+		wake();
+	}
+	else if (head.load(std::memory_order_relaxed) - tail.load(std::memory_order_relaxed) >= LOG_SIZE / 4) {
+		wake();
+	}
+}
+
+void render_thread::map(const uint8_t* const inChr[8], uint8_t* const inChrWrite[8], rom::mirroring inMirror)
+{
+	for (uint8_t slot = 0; slot < 8; slot++) {
+		if (sent_chr[slot] != inChr[slot]) {
+			sent_chr[slot] = inChr[slot];
+			push({ 0, inChr[slot], entry_kind::chr, slot, 0 });
+		}
+		if (sent_chr_write[slot] != inChrWrite[slot]) {
+			sent_chr_write[slot] = inChrWrite[slot];
+			push({ 0, inChrWrite[slot], entry_kind::chr_write, slot, 0 });
+		}
+	}
+	if (sent_mirror != inMirror) {
+		sent_mirror = inMirror;
+		push({ 0, nullptr, entry_kind::mirror, 0, (uint8_t)inMirror });
+	}
+}
+
+/*
+* The thread may be deciding to sleep: either it sees the new head or
+* this sees it sleeping, and it only waits while holding the lock
+*/
+void render_thread::wake()
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleeping.load(std::memory_order_relaxed)) {
+		std::lock_guard<std::mutex> hold(lock);
+		wake_up.notify_one();
+	}
+}
+
+void render_thread::drain()
+{
+	flush_run();
+	wake();
+	uint64_t end = head.load(std::memory_order_relaxed);
+	while (tail.load(std::memory_order_acquire) != end) {
+		std::this_thread::yield();
+	}
+}
+
+void render_thread::resync(const ppu& inPrimary, const std::vector<uint8_t>& inChrRam, bool inPicture)
+{
+	// The thread is idle until the next entry, so the replica can be written from here
+	drain();
+
+	replica.ctrl = inPrimary.ctrl;
+	replica.mask = inPrimary.mask;
+	replica.status = inPrimary.status;
+	replica.oam_addr = inPrimary.oam_addr;
+	replica.v = inPrimary.v;
+	replica.t = inPrimary.t;
+	replica.fine_x = inPrimary.fine_x;
+	replica.w = inPrimary.w;
+	replica.read_buffer = inPrimary.read_buffer;
+	replica.latch = inPrimary.latch;
+	replica.line_x = inPrimary.line_x;
+	replica.line_v = inPrimary.line_v;
+	replica.sprites_ready = inPrimary.sprites_ready;
+	replica.sprite_zero_on_line = inPrimary.sprite_zero_on_line;
+	replica.synced_cycle = inPrimary.synced_cycle;
+	replica.kernels = inPrimary.kernels;
+	memcpy(replica.sprite_line, inPrimary.sprite_line, sizeof(replica.sprite_line));
+	memcpy(replica.background_line, inPrimary.background_line, sizeof(replica.background_line));
+	memcpy(replica.vram, inPrimary.vram, sizeof(replica.vram));
+	memcpy(replica.oam, inPrimary.oam, sizeof(replica.oam));
+	memcpy(replica.palette, inPrimary.palette, sizeof(replica.palette));
+	if (inPicture) {
+		memcpy(replica.framebuffer, inPrimary.framebuffer, sizeof(replica.framebuffer));
+	}
+
+	chr_ram = inChrRam;
+	source_chr_ram = inChrRam.data();
+	replica.tiles.clear();
+	for (uint32_t slot = 0; slot < 8; slot++) {
+		sent_chr[slot] = inPrimary.chr[slot];
+		sent_chr_write[slot] = inPrimary.chr_write[slot];
+		replica.chr[slot] = local(inPrimary.chr[slot]);
+		replica.chr_write[slot] = (uint8_t*)local(inPrimary.chr_write[slot]);
+	}
+	sent_mirror = replica.mirror = inPrimary.mirror;
+
+	// Pictures already past their last line can't be drawn any more
+	uint64_t frame = inPrimary.synced_cycle * 3 / bus::FRAME_DOTS;
+	next_picture = logged_picture = first_picture = inPrimary.synced_cycle * 3 >= ppu::picture_end(frame) ? frame + 1 : frame;
+	completed.store(next_picture, std::memory_order_release);
+}
+
+const uint8_t* render_thread::picture(uint64_t inFrame)
+{
+	if (inFrame < first_picture || inFrame >= logged_picture || inFrame + 2 < completed.load(std::memory_order_acquire)) {
+		return nullptr;
+	}
+	if (completed.load(std::memory_order_acquire) <= inFrame) {
+		wake();
+		std::unique_lock<std::mutex> hold(lock);
+		picture_done.wait(hold, [&] { return completed.load(std::memory_order_acquire) > inFrame; });
+	}
+	return pictures[inFrame & 1];
+}
+
+/*
+* Render thread
+*/
+void render_thread::run()
+{
+	uint64_t next = tail.load(std::memory_order_relaxed);
+	for (;;) {
+		uint64_t end = head.load(std::memory_order_acquire);
+		if (next == end) {
+			std::unique_lock<std::mutex> hold(lock);
+			sleeping.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			wake_up.wait(hold, [&] { return stopping || head.load(std::memory_order_acquire) != next; });
+			sleeping.store(false, std::memory_order_relaxed);
+			if (stopping) {
+				return;
+			}
+			continue;
+		}
+
+		for (; next != end; next++) {
+			replay(log[next & (LOG_SIZE - 1)]);
+			tail.store(next + 1, std::memory_order_release);
+		}
+	}
+}
+
+void render_thread::replay(const entry& inEntry)
+{
+	switch (inEntry.kind) {
+	case entry_kind::run:
+		replica.run_until(inEntry.cycle);
+		replica.synced_cycle = inEntry.cycle;
+
+		checks.fetch_add(1, std::memory_order_relaxed);
+		if ((replica.status ^ inEntry.data) & 0xE0) {
+			mispredictions.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		while (inEntry.cycle * 3 >= ppu::picture_end(next_picture)) {
+			memcpy(pictures[next_picture & 1], replica.framebuffer, sizeof(replica.framebuffer));
+			next_picture++;
+			{
+				std::lock_guard<std::mutex> hold(lock);
+				completed.store(next_picture, std::memory_order_release);
+			}
+			picture_done.notify_all();
+		}
+		break;
+	case entry_kind::write:
+		replica.write_register(inEntry.addr, inEntry.data);
+		break;
+	case entry_kind::read:
+		replica.read_register(inEntry.addr);
+		break;
+	case entry_kind::chr:
+		replica.chr[inEntry.addr] = local(inEntry.pointer);
+		break;
+	case entry_kind::chr_write:
+		replica.chr_write[inEntry.addr] = (uint8_t*)local(inEntry.pointer);
+		break;
+	case entry_kind::mirror:
+		replica.mirror = (rom::mirroring)inEntry.data;
+		break;
+	}
+}
+
+// CHR-RAM pages map to the replica's copy, CHR-ROM is read in place
+const uint8_t* render_thread::local(const uint8_t* inPage) const
+{
+	uintptr_t offset = (uintptr_t)inPage - (uintptr_t)source_chr_ram;
+	return inPage && offset < chr_ram.size() ? chr_ram.data() + offset : inPage;
+}
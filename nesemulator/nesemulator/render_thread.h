@@ -0,0 +1,127 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ppu.h"
+#include "rom.h"
+
+/*
+* PPU render thread
+* ---
+* Pixels drawn on a second core. The bus's PPU keeps everything the CPU
+* can observe: registers, PPU memory, vblank and the NMI, scanline ticks,
+* sprite overflow and sprite 0 hit, the last found the way run-ahead
+* frames find it, from the pixels of sprite 0's lines only. Everything
+* that decides pixels goes into a log with the cycle it happened on: each
+* catch-up point, register writes, the $2002 and $2007 reads that move
+* the address toggle or v, and the mapper's pattern pages and mirroring.
+* Catch-ups with nothing else in between, like those of a loop polling
+* $2002, go in as one.
+*
+* The thread replays the log into a replica PPU that draws every pixel,
+* so it produces the same pictures, one frame behind the CPU at most. At
+* each catch-up point it compares the replica's $2002 bits with the ones
+* the CPU thread saw; mispredictions counts where they differ, which
+* would mean the two have drifted apart.
+*
+* The log is single producer, single consumer and lock free. The thread
+* sleeps when it has caught up and is woken once a picture's last line
+* is logged, or when the log fills up, not on every entry.
+*/
+class render_thread
+{
+public:
+	enum class entry_kind : uint8_t {
+		run,		// Catch up to cycle, data is $2002 on the CPU thread there
+		write,		// Register addr written with data
+		read,		// Register addr read
+		chr,		// Pattern slot addr reads from pointer
+		chr_write,	// Pattern slot addr writes to pointer
+		mirror		// Nametable mirroring data
+	};
+
+	struct entry {
+		uint64_t cycle;
+		const uint8_t* pointer;
+		entry_kind kind;
+		uint8_t addr;
+		uint8_t data;
+	};
+
+	// Catch-up points checked and those where the replica's $2002 differed
+	std::atomic<uint64_t> checks{ 0 };
+	std::atomic<uint64_t> mispredictions{ 0 };
+
+private:
+	static constexpr uint64_t LOG_SIZE = 1 << 15;
+
+	std::vector<entry> log;
+	std::atomic<uint64_t> head{ 0 };	// Entries logged
+	std::atomic<uint64_t> tail{ 0 };	// Entries replayed
+
+	// Render thread side
+	ppu replica;
+	std::vector<uint8_t> chr_ram;	// The replica's copy of CHR-RAM
+	const uint8_t* source_chr_ram = nullptr;
+	uint64_t next_picture = 0;
+	uint8_t pictures[2][ppu::WIDTH * ppu::HEIGHT];	// The last two completed, by frame parity
+	std::atomic<uint64_t> completed{ 0 };	// Frame of the next picture to complete
+
+	// CPU thread side: what the replica was last told, the first picture not logged yet and the first one drawn
+	const uint8_t* sent_chr[8] = {};
+	uint8_t* sent_chr_write[8] = {};
+	rom::mirroring sent_mirror = rom::mirroring::horizontal;
+	uint64_t logged_picture = 0;
+	uint64_t first_picture = 0;
+	entry pending_run = {};		// Catch-ups with nothing logged between them are replayed as one
+	bool run_pending = false;
+
+	std::mutex lock;
+	std::condition_variable wake_up;
+	std::condition_variable picture_done;
+	std::atomic<bool> sleeping{ false };
+	bool stopping = false;
+	std::thread worker;
+
+	void run();
+	void replay(const entry&);
+	void append(const entry&);
+	void flush_run();
+	void wake();
+	const uint8_t* local(const uint8_t* inPage) const;
+
+public:
+	render_thread();
+	~render_thread();
+
+	void push(const entry& inEntry);
+
+	// A catch-up to inCycle, with the CPU thread's $2002 there
+	void ran(uint64_t inCycle, uint8_t inStatus);
+
+	// Log pattern page and mirroring changes since the last call
+	void map(const uint8_t* const inChr[8], uint8_t* const inChrWrite[8], rom::mirroring inMirror);
+
+	// Wait until everything logged has been replayed
+	void drain();
+
+	/*
+	* Make the replica a copy of inPrimary, after a reset, loaded state or
+	* new cartridge. inPicture also copies its framebuffer, the start of
+	* the picture being drawn
+	*/
+	void resync(const ppu& inPrimary, const std::vector<uint8_t>& inChrRam, bool inPicture);
+
+	/*
+	* The picture of bus frame inFrame, waiting for the thread to finish it.
+	* nullptr if that frame hasn't run yet, was drawn before the last
+	* resync or has been overwritten: it stays valid until the CPU has run
+	* two more frames
+	*/
+	const uint8_t* picture(uint64_t inFrame);
+
+	uint64_t replayed() const { return tail.load(std::memory_order_relaxed); }
+};
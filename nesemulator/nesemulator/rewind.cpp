@@ -0,0 +1,192 @@
+#include "rewind.h"
+#include "bus.h"
+
+#include <cstring>
+
+rewind_buffer::rewind_buffer(size_t inBudget, uint32_t inKeyframeInterval)
+	: budget(inBudget), keyframe_interval(inKeyframeInterval ? inKeyframeInterval : 1)
+{
+}
+
+static void write_varint(std::vector<uint8_t>& outData, size_t inValue)
+{
+	while (inValue >= 0x80) {
+		outData.push_back((uint8_t)(inValue | 0x80));
+		inValue >>= 7;
+	}
+	outData.push_back((uint8_t)inValue);
+}
+
+static bool read_varint(const uint8_t*& ioPos, const uint8_t* inEnd, size_t& outValue)
+{
+	outValue = 0;
+	for (int shift = 0; ioPos < inEnd && shift < 64; shift += 7) {
+		uint8_t byte = *ioPos++;
+		outValue |= (size_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+* Encoding
+* ---
+* A list of (zero run, literal count, literal bytes) tokens over the XOR
+* of inState and inBase. Literals swallow zero gaps shorter than a token
+* would cost. A null inBase means a base of all zeros
+*/
+void rewind_buffer::encode(const uint8_t* inState, const uint8_t* inBase, size_t inSize, std::vector<uint8_t>& outData)
+{
+	outData.clear();
+
+	auto diff = [&](size_t i) -> uint8_t { return inBase ? inState[i] ^ inBase[i] : inState[i]; };
+
+	size_t i = 0;
+	while (i < inSize) {
+		// Zero run, 8 bytes at a time while it lasts
+		size_t run_start = i;
+		while (i + 8 <= inSize) {
+			uint64_t a, b = 0;
+			memcpy(&a, inState + i, 8);
+			if (inBase) {
+				memcpy(&b, inBase + i, 8);
+			}
+			if (a != b) {
+				break;
+			}
+			i += 8;
+		}
+		while (i < inSize && diff(i) == 0) {
+			i++;
+		}
+		if (i == inSize) {
+			break;
+		}
+
+		// Literal run, up to the next gap of 4 or more zeros
+		size_t literal_start = i;
+		size_t zeros = 0;
+		while (i < inSize && zeros < 4) {
+			zeros = diff(i) ? 0 : zeros + 1;
+			i++;
+		}
+		size_t literal_end = i - zeros;
+
+		write_varint(outData, literal_start - run_start);
+		write_varint(outData, literal_end - literal_start);
+		for (size_t j = literal_start; j < literal_end; j++) {
+			outData.push_back(diff(j));
+		}
+		i = literal_end;
+	}
+}
+
+bool rewind_buffer::apply(const std::vector<uint8_t>& inData, std::vector<uint8_t>& ioState)
+{
+	const uint8_t* pos = inData.data();
+	const uint8_t* end = pos + inData.size();
+	size_t offset = 0;
+
+	while (pos < end) {
+		size_t zeros, count;
+		if (!read_varint(pos, end, zeros) || !read_varint(pos, end, count)) {
+			return false;
+		}
+		offset += zeros;
+		if (offset + count > ioState.size() || (size_t)(end - pos) < count) {
+			return false;
+		}
+		for (size_t j = 0; j < count; j++) {
+			ioState[offset + j] ^= pos[j];
+		}
+		pos += count;
+		offset += count;
+	}
+	return true;
+}
+
+void rewind_buffer::push(bus& inBus)
+{
+	inBus.save_state(scratch);
+
+	entry frame;
+	frame.size = (uint32_t)scratch.size();
+	frame.keyframe = entries.empty() || since_keyframe + 1 >= keyframe_interval || scratch.size() != latest.size();
+
+	if (frame.keyframe) {
+		encode(scratch.data(), nullptr, scratch.size(), frame.data);
+		since_keyframe = 0;
+	}
+	else {
+		encode(scratch.data(), latest.data(), scratch.size(), frame.data);
+		since_keyframe++;
+	}
+
+	used += frame.data.size();
+	entries.push_back(std::move(frame));
+	latest.swap(scratch);
+	trim();
+}
+
+size_t rewind_buffer::last_keyframe() const
+{
+	size_t index = entries.size() - 1;
+	while (index > 0 && !entries[index].keyframe) {
+		index--;
+	}
+	return index;
+}
+
+bool rewind_buffer::step_back(bus& inBus)
+{
+	if (entries.size() < 2) {
+		return false;
+	}
+
+	entry newest = std::move(entries.back());
+	entries.pop_back();
+	used -= newest.data.size();
+
+	size_t keyframe = last_keyframe();
+	if (!newest.keyframe) {
+		// XOR is its own inverse, the delta turns the newest state back into the one before
+		apply(newest.data, latest);
+	}
+	else {
+		latest.assign(entries[keyframe].size, 0);
+		for (size_t i = keyframe; i < entries.size(); i++) {
+			apply(entries[i].data, latest);
+		}
+	}
+	since_keyframe = (uint32_t)(entries.size() - 1 - keyframe);
+
+	return inBus.load_state(latest.data(), latest.size());
+}
+
+void rewind_buffer::trim()
+{
+	while (used > budget) {
+		// Find where the second keyframe group starts, the newest group is never dropped
+		size_t next = 1;
+		while (next < entries.size() && !entries[next].keyframe) {
+			next++;
+		}
+		if (next >= entries.size()) {
+			return;
+		}
+		for (size_t i = 0; i < next; i++) {
+			used -= entries.front().data.size();
+			entries.pop_front();
+		}
+	}
+}
+
+void rewind_buffer::clear()
+{
+	entries.clear();
+	latest.clear();
+	used = 0;
+	since_keyframe = 0;
+}
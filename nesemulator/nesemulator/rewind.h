@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+class bus;
+
+/*
+* Rewind buffer
+* ---
+* Records the bus state once per frame inside a memory budget. Every
+* keyframe_interval frames the whole state is stored, in between only
+* the XOR against the previous frame, run length encoded, which is
+* mostly zero runs. Both use the same encoding (a keyframe is the XOR
+* against an all zero state), so any entry reads back the same way.
+*
+* The newest state is kept decoded, so stepping back is one delta
+* decode and a load. Only stepping back over a keyframe has to rebuild
+* from the keyframe before it. When over budget the oldest keyframe
+* group is dropped as a whole, so the oldest entry is always a keyframe.
+*/
+class rewind_buffer
+{
+private:
+	struct entry {
+		std::vector<uint8_t> data;	// Encoded XOR against the previous state (zeros for keyframes)
+		uint32_t size;				// Decoded state size
+		bool keyframe;
+	};
+
+	std::deque<entry> entries;
+	std::vector<uint8_t> latest;	// Decoded state of the newest entry
+	std::vector<uint8_t> scratch;
+	size_t budget;
+	size_t used = 0;				// Encoded bytes held
+	uint32_t keyframe_interval;
+	uint32_t since_keyframe = 0;
+
+	static void encode(const uint8_t* inState, const uint8_t* inBase, size_t inSize, std::vector<uint8_t>& outData);
+	static bool apply(const std::vector<uint8_t>& inData, std::vector<uint8_t>& ioState);
+	void trim();
+	size_t last_keyframe() const;
+
+public:
+	rewind_buffer(size_t inBudget, uint32_t inKeyframeInterval = 60);
+
+	// Record the state of inBus, call once per frame
+	void push(bus& inBus);
+
+	// Load the frame recorded before the newest one and forget the newest, false when none is left
+	bool step_back(bus& inBus);
+
+	void clear();
+
+	size_t frames() const { return entries.size(); }
+	size_t bytes_used() const { return used; }
+	size_t state_size() const { return latest.size(); }
+
+	// Average encoded bytes per second of retained history, at 60 frames a second
+	double bytes_per_second() const { return entries.empty() ? 0 : (double)used / entries.size() * 60; }
+};
@@ -0,0 +1,198 @@
+#include "rom.h"
+
+#include <cstring>
+#include <map>
+#include <mutex>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/*
+* mapped_file
+*/
+mapped_file::~mapped_file()
+{
+#ifdef _WIN32
+	if (base) { UnmapViewOfFile(base); }
+	if (mapping_handle) { CloseHandle(mapping_handle); }
+	if (file_handle) { CloseHandle(file_handle); }
+#else
+	if (base) { munmap((void*)base, length); }
+#endif
+}
+
+std::shared_ptr<const mapped_file> mapped_file::open(const std::string& inPath)
+{
+	std::shared_ptr<mapped_file> file(new mapped_file());
+
+#ifdef _WIN32
+	HANDLE handle = CreateFileA(inPath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (handle == INVALID_HANDLE_VALUE) {
+		return nullptr;
+	}
+	file->file_handle = handle;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0) {
+		return nullptr;
+	}
+	file->length = (size_t)size.QuadPart;
+
+	file->mapping_handle = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!file->mapping_handle) {
+		return nullptr;
+	}
+	file->base = (const uint8_t*)MapViewOfFile(file->mapping_handle, FILE_MAP_READ, 0, 0, 0);
+#else
+	int fd = ::open(inPath.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return nullptr;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		close(fd);
+		return nullptr;
+	}
+	file->length = (size_t)info.st_size;
+
+	void* ptr = mmap(nullptr, file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);	// The mapping keeps the file referenced
+	if (ptr != MAP_FAILED) {
+		file->base = (const uint8_t*)ptr;
+	}
+#endif
+
+	if (!file->base) {
+		return nullptr;
+	}
+	return file;
+}
+
+/*
+* rom
+*/
+bool rom::is_ines(const uint8_t* inData, size_t inSize)
+{
+	return inSize >= 16 && memcmp(inData, "NES\x1A", 4) == 0;
+}
+
+/*
+* NES 2.0 sizes with an MSB nibble of 0xF use exponent-multiplier
+* notation: 2^E * (MM * 2 + 1)
+*/
+static uint64_t nes2_rom_size(uint8_t inLsb, uint8_t inMsb, uint32_t inUnit)
+{
+	if (inMsb == 0x0F) {
+		uint8_t exponent = inLsb >> 2;
+		uint8_t multiplier = inLsb & 0x03;
+		if (exponent > 40) {
+			return UINT64_MAX;
+		}
+		return (1ULL << exponent) * (multiplier * 2 + 1);
+	}
+	return (uint64_t)((inMsb << 8) | inLsb) * inUnit;
+}
+
+// NES 2.0 RAM sizes are shift counts, 0 means none
+static uint32_t nes2_ram_size(uint8_t inShift)
+{
+	return inShift ? 64u << inShift : 0;
+}
+
+std::shared_ptr<const rom> rom::parse(std::shared_ptr<const mapped_file> inFile, std::string* outError)
+{
+	const uint8_t* data = inFile->data();
+	size_t size = inFile->size();
+
+	if (!is_ines(data, size)) {
+		if (outError) { *outError = "missing iNES header"; }
+		return nullptr;
+	}
+
+	std::shared_ptr<rom> image = std::make_shared<rom>();
+	const uint8_t* header = data;
+	uint64_t prg_size;
+	uint64_t chr_size;
+
+	image->nes2 = (header[7] & 0x0C) == 0x08;
+	image->mirror = (header[6] & 0x08) ? rom::mirroring::four_screen
+		: (header[6] & 0x01) ? rom::mirroring::vertical : rom::mirroring::horizontal;
+	image->battery = (header[6] & 0x02) != 0;
+
+	if (image->nes2) {
+		image->mapper = (header[6] >> 4) | (header[7] & 0xF0) | ((header[8] & 0x0F) << 8);
+		image->submapper = header[8] >> 4;
+		prg_size = nes2_rom_size(header[4], header[9] & 0x0F, 0x4000);
+		chr_size = nes2_rom_size(header[5], header[9] >> 4, 0x2000);
+		image->prg_ram_size = nes2_ram_size(header[10] & 0x0F) + nes2_ram_size(header[10] >> 4);
+		image->chr_ram_size = nes2_ram_size(header[11] & 0x0F) + nes2_ram_size(header[11] >> 4);
+	}
+	else {
+		// Old dumpers wrote junk into bytes 12-15, the upper mapper nibble is unusable then
+		bool dirty = header[12] || header[13] || header[14] || header[15];
+		image->mapper = (header[6] >> 4) | (dirty ? 0 : (header[7] & 0xF0));
+		prg_size = (uint64_t)header[4] * 0x4000;
+		chr_size = (uint64_t)header[5] * 0x2000;
+		image->prg_ram_size = (header[8] ? header[8] : 1) * 0x2000;
+		image->chr_ram_size = chr_size ? 0 : 0x2000;
+	}
+
+	// A 512 byte trainer sits between the header and PRG
+	uint64_t offset = 16 + ((header[6] & 0x04) ? 512 : 0);
+
+	// Compared against what is left of the file, so huge NES 2.0 sizes can't wrap the sum
+	if (prg_size == 0 || offset > size || prg_size > size - offset || chr_size > size - offset - prg_size) {
+		if (outError) { *outError = "file is smaller than its header says"; }
+		return nullptr;
+	}
+	// Mappers bank PRG in 8KB and CHR in 1KB units at the smallest
+	if (prg_size % 0x2000 || chr_size % 0x400) {
+		if (outError) { *outError = "PRG or CHR size isn't a whole number of banks"; }
+		return nullptr;
+	}
+
+	image->prg = data + offset;
+	image->prg_size = (uint32_t)prg_size;
+	image->chr = chr_size ? data + offset + prg_size : nullptr;
+	image->chr_size = (uint32_t)chr_size;
+	if (!chr_size && !image->chr_ram_size) {
+		image->chr_ram_size = 0x2000;
+	}
+	image->file = std::move(inFile);
+	return image;
+}
+
+std::shared_ptr<const rom> rom::load(const std::string& inPath, std::string* outError)
+{
+	// Images still alive somewhere are handed out again instead of mapped twice
+	static std::mutex cache_lock;
+	static std::map<std::string, std::weak_ptr<const rom>> cache;
+
+	std::lock_guard<std::mutex> lock(cache_lock);
+	auto cached = cache.find(inPath);
+	if (cached != cache.end()) {
+		if (std::shared_ptr<const rom> image = cached->second.lock()) {
+			return image;
+		}
+	}
+
+	std::shared_ptr<const mapped_file> file = mapped_file::open(inPath);
+	if (!file) {
+		if (outError) { *outError = "could not open " + inPath; }
+		return nullptr;
+	}
+
+	std::shared_ptr<const rom> image = parse(std::move(file), outError);
+	if (image) {
+		cache[inPath] = image;
+	}
+	return image;
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+
+/*
+* Read only view of a whole file mapped into memory. Nothing is copied,
+* and every mapping of the same file shares the same physical pages
+* through the OS page cache, also across processes
+*/
+class mapped_file
+{
+private:
+	const uint8_t* base = nullptr;
+	size_t length = 0;
+#ifdef _WIN32
+	void* file_handle = nullptr;
+	void* mapping_handle = nullptr;
+#endif
+
+public:
+	mapped_file() = default;
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+	~mapped_file();
+
+	// Returns nullptr if the file can't be opened or mapped
+	static std::shared_ptr<const mapped_file> open(const std::string& inPath);
+
+	const uint8_t* data() const { return base; }
+	size_t size() const { return length; }
+};
+
+/*
+* Cartridge image
+* ---
+* A parsed iNES / NES 2.0 file. PRG and CHR point straight into the
+* mapped file, so the image is immutable and loading it is just a header
+* parse. Loading the same path again while an image is alive returns the
+* same image, so every instance running a game shares one copy.
+* Per instance state (PRG-RAM, CHR-RAM, mapper registers) lives elsewhere.
+*/
+class rom
+{
+public:
+	enum class mirroring {
+		horizontal,
+		vertical,
+		four_screen,
+		single_lower,	// Only set at runtime by mappers
+		single_upper
+	};
+
+	bool nes2 = false;			// Header is NES 2.0 rather than iNES
+	uint16_t mapper = 0;		// Mapper number
+	uint8_t submapper = 0;		// NES 2.0 only
+	mirroring mirror = mirroring::horizontal;
+	bool battery = false;		// PRG-RAM is battery backed
+
+	const uint8_t* prg = nullptr;
+	uint32_t prg_size = 0;		// Bytes
+	const uint8_t* chr = nullptr;
+	uint32_t chr_size = 0;		// Bytes, 0 means the board has CHR-RAM
+	uint32_t prg_ram_size = 0;	// Bytes of work RAM at $6000
+	uint32_t chr_ram_size = 0;	// Bytes of CHR-RAM
+
+private:
+	std::shared_ptr<const mapped_file> file;	// Keeps prg and chr alive
+
+	static std::shared_ptr<const rom> parse(std::shared_ptr<const mapped_file>, std::string*);
+
+public:
+	/*
+	* Map and parse the file at inPath. Returns nullptr and fills outError
+	* if it isn't a usable iNES / NES 2.0 file
+	*/
+	static std::shared_ptr<const rom> load(const std::string& inPath, std::string* outError = nullptr);
+
+	// True if the data starts with the "NES\x1A" magic
+	static bool is_ines(const uint8_t* inData, size_t inSize);
+};
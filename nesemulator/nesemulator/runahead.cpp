@@ -0,0 +1,65 @@
+#include "runahead.h"
+#include "bus.h"
+
+#include <chrono>
+
+runahead::runahead(bus* inBus, uint32_t inFramesAhead, bool inShadow)
+	: cBUS(inBus), frames_ahead(inFramesAhead)
+{
+	if (inShadow && cBUS->cartridge) {
+		shadow.reset(new bus());
+		shadow->insert_cartridge(cBUS->cartridge);
+	}
+}
+
+runahead::~runahead() = default;
+
+bus& runahead::presented()
+{
+	return (shadow && frames_ahead) ? *shadow : *cBUS;
+}
+
+void runahead::run_frame(uint8_t inPad1, uint8_t inPad2)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	cBUS->cINPUT.buttons[0] = inPad1;
+	cBUS->cINPUT.buttons[1] = inPad2;
+
+	if (!frames_ahead) {
+		cBUS->output_enabled = true;
+		cBUS->run_frame();
+		frames_emulated++;
+	}
+	else if (shadow) {
+		// The real frame is never shown, the shadow picks up from it
+		cBUS->output_enabled = false;
+		cBUS->run_frame();
+		cBUS->save(state);
+		shadow->restore(state);
+
+		for (uint32_t i = 1; i <= frames_ahead; i++) {
+			shadow->output_enabled = i == frames_ahead;
+			shadow->run_frame();
+		}
+		frames_emulated += 1 + frames_ahead;
+	}
+	else {
+		cBUS->output_enabled = false;
+		cBUS->run_frame();
+		cBUS->save(state);
+
+		for (uint32_t i = 1; i <= frames_ahead; i++) {
+			cBUS->output_enabled = i == frames_ahead;
+			cBUS->run_frame();
+		}
+
+		cBUS->restore(state);
+		cBUS->output_enabled = true;
+		frames_emulated += 1 + frames_ahead;
+	}
+
+	last_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	total_us += last_us;
+	frames++;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "state.h"
+
+class bus;
+
+/*
+* Run-ahead
+* ---
+* Hides the frames of input lag a game has internally. Each displayed
+* frame runs the real frame with the new input, then frames_ahead more
+* with output suppressed except for the last, whose picture is the one
+* shown. The real timeline is then put back.
+*
+* Without a shadow bus the real frame is snapshotted and restored after
+* the look ahead, which only copies back the pages it wrote. With a
+* shadow bus the look ahead runs on a second instance loaded from the
+* real one, so the real bus never rewinds and the shadow's output is the
+* one to present.
+*/
+class runahead
+{
+private:
+	bus* cBUS;
+	std::unique_ptr<bus> shadow;
+	snapshot state;
+	uint32_t frames_ahead;
+
+public:
+	// Per displayed frame cost
+	double last_us = 0;
+	double total_us = 0;
+	uint64_t frames = 0;
+	uint64_t frames_emulated = 0;	// Including the look ahead
+
+public:
+	runahead(bus* inBus, uint32_t inFramesAhead, bool inShadow = false);
+	~runahead();
+
+	// Emulate one displayed frame with the given controller buttons
+	void run_frame(uint8_t inPad1, uint8_t inPad2 = 0);
+
+	// The bus whose PPU and APU produced the frame to present
+	bus& presented();
+
+	double average_us() const { return frames ? total_us / frames : 0; }
+};
@@ -0,0 +1,180 @@
+#include "sprite_kernels.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NES_SPRITE_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+uint32_t first_sprites(uint64_t inCovering, uint8_t outFound[8])
+{
+	uint32_t count = 0;
+	for (; inCovering && count < 9; count++) {
+#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanForward64(&index, inCovering);
+#else
+		uint32_t index = (uint32_t)__builtin_ctzll(inCovering);
+#endif
+		if (count < 8) {
+			outFound[count] = (uint8_t)index;
+		}
+		inCovering &= inCovering - 1;
+	}
+	return count;
+}
+
+/*
+* Scalar reference
+*/
+static uint32_t evaluate_scalar(const uint8_t* inOam, uint32_t inRow, uint32_t inHeight, uint8_t outFound[8])
+{
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < 64 && count < 9; i++) {
+		if (inRow - inOam[i * 4] < inHeight) {
+			if (count < 8) {
+				outFound[count] = (uint8_t)i;
+			}
+			count++;
+		}
+	}
+	return count;
+}
+
+static void draw_scalar(uint8_t* ioLine, const uint8_t* inPixels, uint8_t inBase)
+{
+	for (uint32_t i = 0; i < 8; i++) {
+		if (inPixels[i]) {
+			ioLine[i] = inBase | inPixels[i];
+		}
+	}
+}
+
+static bool composite_scalar(uint8_t* outPixels, const uint8_t* inBackground, const uint8_t* inSprites, uint32_t inCount,
+	const uint8_t* inPalette, uint8_t inGrey)
+{
+	bool hit = false;
+	for (uint32_t i = 0; i < inCount; i++) {
+		uint8_t background = inBackground[i];
+		uint8_t sprite = inSprites[i];
+
+		hit |= (sprite & SPRITE_ZERO) && background;
+
+		uint8_t index = background;
+		if (sprite && (!background || !(sprite & SPRITE_BEHIND))) {
+			index = sprite & 0x1F;
+		}
+		outPixels[i] = inPalette[index] & inGrey;
+	}
+	return hit;
+}
+
+static const sprite_kernels scalar_kernels = { "scalar", evaluate_scalar, draw_scalar, composite_scalar };
+
+/*
+* SSE2: 4 OAM entries or 16 pixels at a time. SSE2 has no byte shuffle,
+* so the palette lookup stays scalar
+*/
+#ifdef NES_SPRITE_SSE2
+static uint32_t evaluate_sse2(const uint8_t* inOam, uint32_t inRow, uint32_t inHeight, uint8_t outFound[8])
+{
+	// Row - Y as signed 32 bit lanes, so the row of line 0 (-1) is below every sprite as it is in the scalar version
+	const __m128i row = _mm_set1_epi32((int32_t)inRow);
+	const __m128i height = _mm_set1_epi32((int32_t)inHeight);
+	const __m128i low_byte = _mm_set1_epi32(0xFF);
+	const __m128i minus_one = _mm_set1_epi32(-1);
+
+	uint64_t covering = 0;
+	for (uint32_t i = 0; i < 16; i++) {
+		__m128i y = _mm_and_si128(_mm_loadu_si128((const __m128i*)(inOam + i * 16)), low_byte);
+		__m128i offset = _mm_sub_epi32(row, y);
+		__m128i inside = _mm_and_si128(_mm_cmpgt_epi32(offset, minus_one), _mm_cmpgt_epi32(height, offset));
+		covering |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(inside)) << (i * 4);
+	}
+	return first_sprites(covering, outFound);
+}
+
+static void draw_sse2(uint8_t* ioLine, const uint8_t* inPixels, uint8_t inBase)
+{
+	__m128i line = _mm_loadl_epi64((const __m128i*)ioLine);
+	__m128i pixels = _mm_loadl_epi64((const __m128i*)inPixels);
+	__m128i transparent = _mm_cmpeq_epi8(pixels, _mm_setzero_si128());
+	__m128i drawn = _mm_or_si128(pixels, _mm_set1_epi8((char)inBase));
+	_mm_storel_epi64((__m128i*)ioLine, _mm_or_si128(_mm_and_si128(transparent, line), _mm_andnot_si128(transparent, drawn)));
+}
+
+static bool composite_sse2(uint8_t* outPixels, const uint8_t* inBackground, const uint8_t* inSprites, uint32_t inCount,
+	const uint8_t* inPalette, uint8_t inGrey)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i behind_bit = _mm_set1_epi8(SPRITE_BEHIND);
+	const __m128i zero_bit = _mm_set1_epi8(SPRITE_ZERO);
+	const __m128i colour_bits = _mm_set1_epi8(0x1F);
+
+	uint8_t colours[0x20];
+	for (uint32_t i = 0; i < 0x20; i++) {
+		colours[i] = inPalette[i] & inGrey;
+	}
+
+	int hits = 0;
+	uint32_t i = 0;
+	for (; i + 16 <= inCount; i += 16) {
+		__m128i background = _mm_loadu_si128((const __m128i*)(inBackground + i));
+		__m128i sprite = _mm_loadu_si128((const __m128i*)(inSprites + i));
+		__m128i no_background = _mm_cmpeq_epi8(background, zero);
+		__m128i no_sprite = _mm_cmpeq_epi8(sprite, zero);
+		__m128i behind = _mm_cmpeq_epi8(_mm_and_si128(sprite, behind_bit), behind_bit);
+
+		__m128i sprite_wins = _mm_andnot_si128(no_sprite, _mm_or_si128(no_background, _mm_andnot_si128(behind, _mm_cmpeq_epi8(zero, zero))));
+		__m128i index = _mm_or_si128(_mm_and_si128(sprite_wins, _mm_and_si128(sprite, colour_bits)), _mm_andnot_si128(sprite_wins, background));
+		hits |= _mm_movemask_epi8(_mm_andnot_si128(no_background, _mm_cmpeq_epi8(_mm_and_si128(sprite, zero_bit), zero_bit)));
+
+		alignas(16) uint8_t indices[16];
+		_mm_store_si128((__m128i*)indices, index);
+		for (uint32_t j = 0; j < 16; j++) {
+			outPixels[i + j] = colours[indices[j]];
+		}
+	}
+	return composite_scalar(outPixels + i, inBackground + i, inSprites + i, inCount - i, inPalette, inGrey) || hits;
+}
+
+static const sprite_kernels sse2_kernels = { "SSE2", evaluate_sse2, draw_sse2, composite_sse2 };
+#endif
+
+/*
+* Host detection
+*/
+static bool host_has_avx2()
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+	int info[4];
+	__cpuidex(info, 1, 0);
+	// The OS has to save the YMM registers as well
+	if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6) {
+		return false;
+	}
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
+
+const sprite_kernels& sprite_kernels::get(level inMost)
+{
+	static const sprite_kernels* avx2 = host_has_avx2() ? avx2_sprite_kernels() : nullptr;
+
+	if (inMost >= level::avx2 && avx2) {
+		return *avx2;
+	}
+#ifdef NES_SPRITE_SSE2
+	if (inMost >= level::sse2) {
+		return sse2_kernels;
+	}
+#endif
+	return scalar_kernels;
+}
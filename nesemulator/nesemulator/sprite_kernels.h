@@ -0,0 +1,58 @@
+#pragma once
+#include <cstdint>
+
+/*
+* Sprite kernels
+* ---
+* The data parallel stages of a PPU line: finding the OAM entries that
+* cover it, drawing their 8 pixel rows into the line's sprite buffer and
+* compositing that over the background into palette colours. There is a
+* scalar version of each, which is the reference, and SSE2 and AVX2
+* versions that give the same results bit for bit.
+*
+* get() picks by what the host supports, checked once, so a single
+* build runs everywhere. The AVX2 versions are in their own file, the
+* only one built with AVX2 enabled, and are never called on a CPU
+* without it.
+*/
+struct sprite_kernels {
+	const char* name;
+
+	/*
+	* Sprites covering the line whose row is inRow (the line - 1, as
+	* sprite Y is one less than its first line): their indices in OAM
+	* order into outFound, at most 8. Returns how many were found, 9 if
+	* there were more than 8
+	*/
+	uint32_t (*evaluate)(const uint8_t* inOam, uint32_t inRow, uint32_t inHeight, uint8_t outFound[8]);
+
+	// 8 pixels of a sprite row over ioLine, inBase | pixel where the pixel isn't 0
+	void (*draw)(uint8_t* ioLine, const uint8_t* inPixels, uint8_t inBase);
+
+	/*
+	* Colours of inCount pixels: the sprite entry where it is opaque and
+	* either in front or over background pixel 0, the background otherwise,
+	* looked up in inPalette and masked with inGrey. Returns true if sprite
+	* 0 is opaque over an opaque background pixel anywhere in the run
+	*/
+	bool (*composite)(uint8_t* outPixels, const uint8_t* inBackground, const uint8_t* inSprites, uint32_t inCount,
+		const uint8_t* inPalette, uint8_t inGrey);
+
+	enum level : uint8_t {
+		scalar,
+		sse2,
+		avx2
+	};
+
+	// The best kernels the host runs, up to inMost
+	static const sprite_kernels& get(level inMost = avx2);
+};
+
+// For the SIMD kernels: the first 8 set bits of inCovering into outFound, returns what evaluate does
+uint32_t first_sprites(uint64_t inCovering, uint8_t outFound[8]);
+// nullptr unless sprite_kernels_avx2.cpp was built with AVX2
+const sprite_kernels* avx2_sprite_kernels();
+
+// Sprite entries in the line buffer: 0x10 | palette << 2 | pixel, plus these
+static constexpr uint8_t SPRITE_BEHIND = 0x20;
+static constexpr uint8_t SPRITE_ZERO = 0x40;
@@ -0,0 +1,99 @@
+/*
+* AVX2 sprite kernels
+* ---
+* The only file built with AVX2 enabled, see sprite_kernels.h. It is
+* kept to intrinsics and its own static functions: an inline function
+* from a shared header instantiated here could be the copy the linker
+* keeps, and would then run AVX2 code on hosts without it.
+*/
+#include "sprite_kernels.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+static uint32_t evaluate_avx2(const uint8_t* inOam, uint32_t inRow, uint32_t inHeight, uint8_t outFound[8])
+{
+	const __m256i row = _mm256_set1_epi32((int32_t)inRow);
+	const __m256i height = _mm256_set1_epi32((int32_t)inHeight);
+	const __m256i low_byte = _mm256_set1_epi32(0xFF);
+	const __m256i minus_one = _mm256_set1_epi32(-1);
+
+	uint64_t covering = 0;
+	for (uint32_t i = 0; i < 8; i++) {
+		__m256i y = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(inOam + i * 32)), low_byte);
+		__m256i offset = _mm256_sub_epi32(row, y);
+		__m256i inside = _mm256_and_si256(_mm256_cmpgt_epi32(offset, minus_one), _mm256_cmpgt_epi32(height, offset));
+		covering |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(inside)) << (i * 8);
+	}
+	return first_sprites(covering, outFound);
+}
+
+static void draw_avx2(uint8_t* ioLine, const uint8_t* inPixels, uint8_t inBase)
+{
+	__m128i line = _mm_loadl_epi64((const __m128i*)ioLine);
+	__m128i pixels = _mm_loadl_epi64((const __m128i*)inPixels);
+	__m128i transparent = _mm_cmpeq_epi8(pixels, _mm_setzero_si128());
+	__m128i drawn = _mm_or_si128(pixels, _mm_set1_epi8((char)inBase));
+	_mm_storel_epi64((__m128i*)ioLine, _mm_blendv_epi8(drawn, line, transparent));
+}
+
+/*
+* 32 pixels at a time, the palette lookup is two byte shuffles of its
+* halves, picked by bit 4 of the index
+*/
+static bool composite_avx2(uint8_t* outPixels, const uint8_t* inBackground, const uint8_t* inSprites, uint32_t inCount,
+	const uint8_t* inPalette, uint8_t inGrey)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i behind_bit = _mm256_set1_epi8(SPRITE_BEHIND);
+	const __m256i zero_bit = _mm256_set1_epi8(SPRITE_ZERO);
+	const __m256i colour_bits = _mm256_set1_epi8(0x1F);
+	const __m256i grey = _mm256_set1_epi8((char)inGrey);
+	const __m256i low_palette = _mm256_and_si256(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)inPalette)), grey);
+	const __m256i high_palette = _mm256_and_si256(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(inPalette + 16))), grey);
+
+	int hits = 0;
+	uint32_t i = 0;
+	for (; i + 32 <= inCount; i += 32) {
+		__m256i background = _mm256_loadu_si256((const __m256i*)(inBackground + i));
+		__m256i sprite = _mm256_loadu_si256((const __m256i*)(inSprites + i));
+		__m256i no_background = _mm256_cmpeq_epi8(background, zero);
+		__m256i no_sprite = _mm256_cmpeq_epi8(sprite, zero);
+		__m256i behind = _mm256_cmpeq_epi8(_mm256_and_si256(sprite, behind_bit), behind_bit);
+
+		__m256i sprite_wins = _mm256_andnot_si256(no_sprite, _mm256_or_si256(no_background, _mm256_andnot_si256(behind, _mm256_cmpeq_epi8(zero, zero))));
+		__m256i index = _mm256_blendv_epi8(background, _mm256_and_si256(sprite, colour_bits), sprite_wins);
+		hits |= _mm256_movemask_epi8(_mm256_andnot_si256(no_background, _mm256_cmpeq_epi8(_mm256_and_si256(sprite, zero_bit), zero_bit)));
+
+		__m256i colour = _mm256_blendv_epi8(_mm256_shuffle_epi8(low_palette, index), _mm256_shuffle_epi8(high_palette, index), _mm256_slli_epi16(index, 3));
+		_mm256_storeu_si256((__m256i*)(outPixels + i), colour);
+	}
+
+	// The rest one by one, as the scalar reference does
+	for (; i < inCount; i++) {
+		uint8_t background = inBackground[i];
+		uint8_t sprite = inSprites[i];
+
+		hits |= (sprite & SPRITE_ZERO) && background;
+
+		uint8_t index = background;
+		if (sprite && (!background || !(sprite & SPRITE_BEHIND))) {
+			index = sprite & 0x1F;
+		}
+		outPixels[i] = inPalette[index] & inGrey;
+	}
+	return hits != 0;
+}
+
+static const sprite_kernels avx2_kernels = { "AVX2", evaluate_avx2, draw_avx2, composite_avx2 };
+
+const sprite_kernels* avx2_sprite_kernels()
+{
+	return &avx2_kernels;
+}
+#else
+const sprite_kernels* avx2_sprite_kernels()
+{
+	return nullptr;
+}
+#endif
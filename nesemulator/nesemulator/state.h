@@ -0,0 +1,78 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+/*
+* Save state streams
+* ---
+* Component state is written as raw host bytes in a fixed order, so a
+* state can only be loaded by the same build. Readers never run past the
+* end, a short or foreign state just leaves ok() false.
+*/
+class state_writer
+{
+private:
+	std::vector<uint8_t>& out;
+
+public:
+	state_writer(std::vector<uint8_t>& inOut) : out(inOut) {}
+
+	void write_bytes(const void* inData, size_t inSize)
+	{
+		const uint8_t* bytes = (const uint8_t*)inData;
+		out.insert(out.end(), bytes, bytes + inSize);
+	}
+
+	template<typename T>
+	void write(const T& inValue)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "only plain values can be written");
+		write_bytes(&inValue, sizeof(T));
+	}
+};
+
+class state_reader
+{
+private:
+	const uint8_t* pos;
+	const uint8_t* end;
+	bool good = true;
+
+public:
+	state_reader(const uint8_t* inData, size_t inSize) : pos(inData), end(inData + inSize) {}
+	state_reader(const std::vector<uint8_t>& inData) : state_reader(inData.data(), inData.size()) {}
+
+	void read_bytes(void* outData, size_t inSize)
+	{
+		if (!good || (size_t)(end - pos) < inSize) {
+			good = false;
+			return;
+		}
+		memcpy(outData, pos, inSize);
+		pos += inSize;
+	}
+
+	template<typename T>
+	void read(T& outValue)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "only plain values can be read");
+		read_bytes(&outValue, sizeof(T));
+	}
+
+	bool ok() const { return good; }
+	bool at_end() const { return pos == end; }
+};
+
+/*
+* Everything needed to put a bus back where it was: the registers of
+* every component and a copy of every memory region, page aligned in the
+* order the bus registered them
+*/
+struct snapshot
+{
+	uint64_t id = 0;	// New on every save, lets the bus recognise contents it already has
+	std::vector<uint8_t> registers;
+	std::vector<uint8_t> memory;
+};
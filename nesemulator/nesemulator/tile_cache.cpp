@@ -0,0 +1,55 @@
+#include "tile_cache.h"
+
+#include <cstdint>
+
+void tile_cache::build(uint32_t inTile)
+{
+	const uint8_t* source = sources[inTile >> 6] + (inTile & 0x3F) * 16;
+	for (uint32_t y = 0; y < 8; y++) {
+		uint8_t low = source[y];
+		uint8_t high = source[y + 8];
+		for (uint32_t x = 0; x < 8; x++) {
+			uint8_t pixel = (uint8_t)((low >> (7 - x) & 1) | (high >> (7 - x) & 1) << 1);
+			pixels[inTile][y][x] = pixel;
+			pixels[inTile][y][15 - x] = pixel;
+		}
+	}
+	valid[inTile] = true;
+	rebuilds++;
+}
+
+void tile_cache::map(const uint8_t* const inPages[8])
+{
+	for (uint32_t slot = 0; slot < 8; slot++) {
+		if (sources[slot] == inPages[slot]) {
+			continue;
+		}
+		sources[slot] = inPages[slot];
+		for (uint32_t tile = slot * 64; tile < slot * 64 + 64; tile++) {
+			invalidations += valid[tile];
+			valid[tile] = false;
+		}
+	}
+}
+
+void tile_cache::write(const uint8_t* inByte)
+{
+	for (uint32_t slot = 0; slot < 8; slot++) {
+		uintptr_t offset = (uintptr_t)inByte - (uintptr_t)sources[slot];
+		if (sources[slot] && offset < 0x400) {
+			uint32_t tile = slot * 64 + (uint32_t)offset / 16;
+			invalidations += valid[tile];
+			valid[tile] = false;
+		}
+	}
+}
+
+void tile_cache::clear()
+{
+	for (uint32_t slot = 0; slot < 8; slot++) {
+		sources[slot] = nullptr;
+	}
+	for (bool& tile : valid) {
+		tile = false;
+	}
+}
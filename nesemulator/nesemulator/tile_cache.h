@@ -0,0 +1,55 @@
+#pragma once
+#include <cstdint>
+
+/*
+* Decoded pattern tile cache
+* ---
+* Every tile of the PPU's $0000-$1FFF pattern space kept expanded to one
+* palette index (0-3) per pixel, so rendering reads a row of 8 pixels
+* instead of combining two bit planes bit by bit. Each row is followed
+* by its mirror image for horizontally flipped sprites.
+*
+* Tiles are decoded on first use. Each 1KB slot remembers the memory it
+* was decoded from; when the mapper points the slot elsewhere, map()
+* drops the slot's 64 tiles and they are decoded again the next time
+* they are used. CHR-RAM writes drop the written tile in every slot that
+* shows the byte.
+*/
+class tile_cache
+{
+public:
+	// Row lookups, tiles decoded and tiles dropped
+	uint64_t hits = 0;
+	uint64_t rebuilds = 0;
+	uint64_t invalidations = 0;
+
+private:
+	uint8_t pixels[0x200][8][16];
+	bool valid[0x200] = {};
+	const uint8_t* sources[8] = {};
+
+	void build(uint32_t inTile);
+
+public:
+	// Follow the mapper's chr_pages, dropping the tiles of slots that show different memory
+	void map(const uint8_t* const inPages[8]);
+
+	// A CHR-RAM byte changed
+	void write(const uint8_t* inByte);
+
+	// Drop everything, for a new cartridge or a loaded state
+	void clear();
+
+	// The 8 pixels of the row at pattern address inAddr, bit 3 (the plane) clear, then the same flipped
+	inline const uint8_t* row(uint16_t inAddr)
+	{
+		uint32_t tile = (inAddr >> 4) & 0x1FF;
+		if (valid[tile]) {
+			hits++;
+		}
+		else {
+			build(tile);
+		}
+		return pixels[tile][inAddr & 7];
+	}
+};
@@ -0,0 +1,120 @@
+#include "tracer.h"
+#include "cpu.h"
+
+#include <cstdio>
+#include <cstring>
+#include <istream>
+#include <ostream>
+
+/*
+* Dump layout
+* ---
+* 4 byte magic, then the record size and count as little endian
+* uint32/uint64, then the records themselves oldest first
+*/
+static const char trace_magic[4] = { 'N', 'T', 'R', 'C' };
+
+void tracer::enable(size_t inCapacity)
+{
+	size_t capacity = 1;
+	while (capacity < inCapacity) {
+		capacity <<= 1;
+	}
+
+	records.reset(new trace_record[capacity]);
+	mask = capacity - 1;
+	written = 0;
+}
+
+void tracer::disable()
+{
+	records.reset();
+	mask = 0;
+	written = 0;
+}
+
+size_t tracer::size() const
+{
+	if (!records) {
+		return 0;
+	}
+	return written > mask ? mask + 1 : (size_t)written;
+}
+
+void tracer::dump(std::ostream& out) const
+{
+	uint32_t record_size = sizeof(trace_record);
+	uint64_t count = size();
+
+	out.write(trace_magic, sizeof(trace_magic));
+	out.write((const char*)&record_size, sizeof(record_size));
+	out.write((const char*)&count, sizeof(count));
+
+	// Oldest record sits right after the newest once the buffer has wrapped
+	uint64_t first = written - count;
+	for (uint64_t i = 0; i < count; i++) {
+		out.write((const char*)&records[(first + i) & mask], sizeof(trace_record));
+	}
+}
+
+/*
+* Operand text for each address mode, in the same form nestest uses
+*/
+static void format_operand(char* out, size_t len, const trace_record& r, cpu::mode m)
+{
+	uint16_t word = (uint16_t)(r.operand[1] << 8) | r.operand[0];
+
+	switch (m) {
+	case cpu::mode::acc:	snprintf(out, len, "A"); break;
+	case cpu::mode::abs:	snprintf(out, len, "$%04X", word); break;
+	case cpu::mode::absx:	snprintf(out, len, "$%04X,X", word); break;
+	case cpu::mode::absy:	snprintf(out, len, "$%04X,Y", word); break;
+	case cpu::mode::imm:	snprintf(out, len, "#$%02X", r.operand[0]); break;
+	case cpu::mode::ind:	snprintf(out, len, "($%04X)", word); break;
+	case cpu::mode::xind:	snprintf(out, len, "($%02X,X)", r.operand[0]); break;
+	case cpu::mode::yind:	snprintf(out, len, "($%02X),Y", r.operand[0]); break;
+	case cpu::mode::zpg:	snprintf(out, len, "$%02X", r.operand[0]); break;
+	case cpu::mode::zpgx:	snprintf(out, len, "$%02X,X", r.operand[0]); break;
+	case cpu::mode::zpgy:	snprintf(out, len, "$%02X,Y", r.operand[0]); break;
+	case cpu::mode::rel:
+		// Branch target is relative to the next instruction
+		snprintf(out, len, "$%04X", (uint16_t)(r.PC + 2 + (int8_t)r.operand[0]));
+		break;
+	default: out[0] = '\0'; break;
+	}
+}
+
+void tracer::decode(std::istream& in, std::ostream& out)
+{
+	char magic[4];
+	uint32_t record_size = 0;
+	uint64_t count = 0;
+
+	in.read(magic, sizeof(magic));
+	in.read((char*)&record_size, sizeof(record_size));
+	in.read((char*)&count, sizeof(count));
+	if (!in || memcmp(magic, trace_magic, sizeof(magic)) != 0 || record_size != sizeof(trace_record)) {
+		out << "Not a trace dump" << std::endl;
+		return;
+	}
+
+	trace_record r;
+	char bytes[16];
+	char operand[16];
+	char line[128];
+	for (uint64_t i = 0; i < count && in.read((char*)&r, sizeof(r)); i++) {
+		const cpu::opcode_info& info = cpu::opcode_table[r.opcode];
+
+		switch (info.bytes) {
+		case 2:	 snprintf(bytes, sizeof(bytes), "%02X %02X", r.opcode, r.operand[0]); break;
+		case 3:	 snprintf(bytes, sizeof(bytes), "%02X %02X %02X", r.opcode, r.operand[0], r.operand[1]); break;
+		default: snprintf(bytes, sizeof(bytes), "%02X", r.opcode); break;
+		}
+		format_operand(operand, sizeof(operand), r, info.addressing);
+
+		snprintf(line, sizeof(line), "%04X  %-8s  %s %-26s  A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%llu\n",
+			r.PC, bytes, cpu::mnemonic(info.operation), operand,
+			r.A, r.X, r.Y, r.PF, r.SP, (unsigned long long)r.cycle);
+		out << line;
+	}
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <iosfwd>
+#include <memory>
+
+/*
+* Instruction tracer
+* ---
+* Build with NES_TRACE defined to compile the hooks in cpu::clock().
+* Without it the tracer is never touched and costs nothing.
+*
+* Records are written into a fixed size ring buffer that is allocated
+* once by enable(), so tracing an instruction is a 18 byte copy with no
+* formatting. dump() writes the buffer out as binary and decode() turns
+* such a dump into nestest style text offline.
+*/
+#pragma pack(push, 1)
+struct trace_record {
+	uint64_t cycle;			// Total cycles before the instruction ran
+	uint16_t PC;
+	uint8_t opcode;
+	uint8_t operand[2];		// Bytes after the opcode, unused ones are 0
+	uint8_t A;
+	uint8_t X;
+	uint8_t Y;
+	uint8_t PF;
+	uint8_t SP;
+};
+#pragma pack(pop)
+
+class tracer
+{
+private:
+	std::unique_ptr<trace_record[]> records;
+	size_t mask = 0;		// Capacity - 1, capacity is a power of two
+	uint64_t written = 0;	// Records written since enable()
+
+public:
+	/*
+	* Allocate room for at least inCapacity records and start recording.
+	* Once full the oldest records are overwritten
+	*/
+	void enable(size_t inCapacity);
+	void disable();
+	bool enabled() const { return records != nullptr; }
+
+	// Only call while enabled()
+	inline void record(const trace_record& inRecord)
+	{
+		records[written++ & mask] = inRecord;
+	}
+
+	size_t size() const;
+
+	// Binary dump, oldest record first
+	void dump(std::ostream&) const;
+
+	// Render a binary dump as one nestest style line per instruction
+	static void decode(std::istream&, std::ostream&);
+};